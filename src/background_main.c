@@ -0,0 +1,116 @@
+// Test for remote frees and the background thread.
+//
+// The main thread allocates COUNT small objects and another thread,
+// bound to another arena, frees all of them. With the transfer cache
+// off they must go back to the arena of the main thread through its
+// remote queue, and taking COUNT objects again must map nothing new.
+//
+// Then the main thread frees everything and sleeps. The background
+// thread must wake up on its own and purge the idle arena, so the
+// mapped bytes drop without a call to xmalloc_purge.
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "xmalloc.h"
+
+#define OBJ_SIZE 64
+#define DECAY_MS 100
+
+void** objs;
+long count = 0;
+
+size_t
+ctl_get(const char* name)
+{
+    size_t value = 0;
+    size_t len = sizeof(value);
+    xmallctl(name, &value, &len, NULL, 0);
+    return value;
+}
+
+void
+ctl_set(const char* name, size_t value)
+{
+    int rv = xmallctl(name, NULL, NULL, &value, sizeof(value));
+    assert(rv == 0);
+}
+
+void*
+remote_free(void* arg)
+{
+    for (long ii = 0; ii < count; ++ii) {
+        xfree(objs[ii]);
+    }
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 2) {
+        printf("Usage:\n");
+        printf("\t%s COUNT\n", argv[0]);
+        return 1;
+    }
+
+    count = atol(argv[1]);
+    long bad = 0;
+
+    ctl_set("transfer.depth", 0);
+    ctl_set("background.decay_ms", DECAY_MS);
+    ctl_set("background.enabled", 1);
+
+    objs = xmalloc(count * sizeof(void*));
+    for (long ii = 0; ii < count; ++ii) {
+        objs[ii] = xmalloc(OBJ_SIZE);
+        memset(objs[ii], 1, OBJ_SIZE);
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "arena.%zu.remote_frees",
+             ctl_get("thread.arena"));
+
+    pthread_t thread;
+    int rv = pthread_create(&thread, 0, remote_free, 0);
+    assert(rv == 0);
+    rv = pthread_join(thread, 0);
+    assert(rv == 0);
+
+    size_t remote = ctl_get(name);
+
+    // the chunks are back in our arena, they are reused
+    size_t mapped_kb = ctl_get("stats.mapped") / 1024;
+    for (long ii = 0; ii < count; ++ii) {
+        objs[ii] = xmalloc(OBJ_SIZE);
+        memset(objs[ii], 2, OBJ_SIZE);
+    }
+    size_t again_kb = ctl_get("stats.mapped") / 1024;
+    bad += again_kb > mapped_kb;
+
+    for (long ii = 0; ii < count; ++ii) {
+        xfree(objs[ii]);
+    }
+    xfree(objs);
+    ctl_get("thread.tcache.flush");
+
+    // idle arenas are purged by the background thread alone
+    size_t wakeups = ctl_get("background.wakeups");
+    usleep(5 * DECAY_MS * 1000);
+    size_t idle_kb = ctl_get("stats.mapped") / 1024;
+    wakeups = ctl_get("background.wakeups") - wakeups;
+    bad += wakeups == 0 || idle_kb >= again_kb;
+
+    ctl_set("background.enabled", 0);
+
+    printf("remote: %zu of %ld objects freed remotely, mapped %zu KB -> %zu KB\n",
+           remote, count, mapped_kb, again_kb);
+    printf("background: %zu wakeups, mapped %zu KB when idle, %ld bad\n",
+           wakeups, idle_kb, bad);
+
+    return 0;
+}
@@ -0,0 +1,167 @@
+// Cross-thread test for object caches.
+//
+// Producer threads allocate objects from a cache and hand them over a
+// ring to a consumer thread each, which frees them. Freed objects pile
+// up in the consumer's magazines and only come back to the producer
+// through the depot of the cache, so the count of constructed objects
+// stays near the ones in flight when the exchange works, and grows
+// with every object passed when it does not.
+//
+// Objects must keep the state of the constructor across free and
+// alloc. Once the threads are gone the cache is destroyed and a new
+// one takes its thread slot, objects of the new cache must come from
+// its own constructor and not from magazines of the old one.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <assert.h>
+
+#include "xmalloc.h"
+
+#define RING      4096
+#define MAX_PAIRS 64
+#define OLD_MAGIC 0x6f6c64
+#define NEW_MAGIC 0x6e6577
+
+typedef struct object {
+    long    magic;
+    long    seq;
+    char    payload[48];
+} object;
+
+typedef struct ring {
+    object* slots[RING];
+    long    head;
+    long    tail;
+} ring;
+
+xcache* cache;
+ring* rings;
+long count = 0;
+
+long constructed = 0;
+long bad = 0;
+
+void
+old_ctor(void* obj)
+{
+    ((object*)obj)->magic = OLD_MAGIC;
+    __atomic_add_fetch(&constructed, 1, __ATOMIC_RELAXED);
+}
+
+void
+new_ctor(void* obj)
+{
+    ((object*)obj)->magic = NEW_MAGIC;
+}
+
+void*
+producer(void* arg)
+{
+    ring* rr = &(rings[(long)arg]);
+    long my_bad = 0;
+
+    for (long ii = 0; ii < count; ++ii) {
+        object* obj = xcache_alloc(cache);
+        my_bad += obj->magic != OLD_MAGIC;
+        obj->seq = ii;
+
+        while (ii - __atomic_load_n(&(rr->tail), __ATOMIC_ACQUIRE) >= RING) {
+            sched_yield();
+        }
+        rr->slots[ii % RING] = obj;
+        __atomic_store_n(&(rr->head), ii + 1, __ATOMIC_RELEASE);
+    }
+
+    __atomic_add_fetch(&bad, my_bad, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void*
+consumer(void* arg)
+{
+    ring* rr = &(rings[(long)arg]);
+    long my_bad = 0;
+
+    for (long ii = 0; ii < count; ++ii) {
+        while (__atomic_load_n(&(rr->head), __ATOMIC_ACQUIRE) <= ii) {
+            sched_yield();
+        }
+        object* obj = rr->slots[ii % RING];
+        __atomic_store_n(&(rr->tail), ii + 1, __ATOMIC_RELEASE);
+
+        my_bad += obj->magic != OLD_MAGIC || obj->seq != ii;
+        xcache_free(cache, obj);
+    }
+
+    __atomic_add_fetch(&bad, my_bad, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    long pairs = 2;
+    int rv;
+
+    if (argc != 2 && argc != 3) {
+        printf("Usage:\n");
+        printf("\t%s COUNT [PAIRS]\n", argv[0]);
+        return 1;
+    }
+
+    count = atol(argv[1]);
+    if (argc == 3) {
+        pairs = atol(argv[2]);
+    }
+
+    if (count < 1 || pairs < 1 || pairs > MAX_PAIRS) {
+        printf("COUNT must be at least 1, PAIRS from 1 to %d\n", MAX_PAIRS);
+        return 1;
+    }
+
+    cache = xcache_create(sizeof(object), 0, old_ctor);
+    rings = xcalloc(pairs, sizeof(ring));
+
+    // leave magazines of the old cache in this thread's slot
+    object* mine = xcache_alloc(cache);
+    xcache_free(cache, mine);
+
+    pthread_t* threads = xmalloc(2 * pairs * sizeof(pthread_t));
+    for (long ii = 0; ii < pairs; ++ii) {
+        rv = pthread_create(&(threads[2 * ii]), 0, producer, (void*)ii);
+        assert(rv == 0);
+        rv = pthread_create(&(threads[2 * ii + 1]), 0, consumer, (void*)ii);
+        assert(rv == 0);
+    }
+
+    for (long ii = 0; ii < 2 * pairs; ++ii) {
+        rv = pthread_join(threads[ii], 0);
+        assert(rv == 0);
+    }
+
+    xcache_destroy(cache);
+
+    // the new cache reuses the slot, the old magazines must be dropped
+    cache = xcache_create(sizeof(object), 0, new_ctor);
+    object* objs[1000];
+    for (int ii = 0; ii < 1000; ++ii) {
+        objs[ii] = xcache_alloc(cache);
+        bad += objs[ii]->magic != NEW_MAGIC;
+    }
+    for (int ii = 0; ii < 1000; ++ii) {
+        xcache_free(cache, objs[ii]);
+    }
+    xcache_destroy(cache);
+
+    printf("cache: %ld objects passed, %ld constructed, %ld bad\n",
+           pairs * count, constructed, bad);
+
+    xfree(threads);
+    xfree(rings);
+
+    return 0;
+}
@@ -0,0 +1,105 @@
+// Zeroing test for xcalloc.
+//
+// xcalloc only clears memory that was written since it was mapped.
+// Chunks of every kind, standard, medium runs and big blocks, are
+// filled with garbage, freed and taken again with xcalloc, they must
+// come back zeroed. Then COUNT medium chunks are taken with xcalloc
+// from fresh segments, which must not be cleared: the resident set
+// may only grow by a small part of their size.
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include "xmalloc.h"
+
+#define BATCH      64
+#define FRESH_SIZE (256 * 1024)
+
+long
+resident_kb()
+{
+    long pages = 0;
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (file == NULL) {
+        return 0;
+    }
+    if (fscanf(file, "%*s %ld", &pages) != 1) {
+        pages = 0;
+    }
+    fclose(file);
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+int
+is_zero(const char* ptr, size_t size)
+{
+    for (size_t ii = 0; ii < size; ++ii) {
+        if (ptr[ii] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// returns the number of reused chunks that were not zeroed
+long
+check_reused(size_t size, long* checked)
+{
+    char* ptrs[BATCH];
+    long bad = 0;
+
+    for (int round = 0; round < 4; ++round) {
+        for (int ii = 0; ii < BATCH; ++ii) {
+            ptrs[ii] = xcalloc(1, size);
+            bad += !is_zero(ptrs[ii], size);
+            memset(ptrs[ii], 0xa5, size);
+        }
+        for (int ii = 0; ii < BATCH; ++ii) {
+            xfree(ptrs[ii]);
+        }
+        *checked += BATCH;
+    }
+
+    return bad;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 2) {
+        printf("Usage:\n");
+        printf("\t%s COUNT\n", argv[0]);
+        return 1;
+    }
+
+    long count = atol(argv[1]);
+
+    // fresh segments first, before any medium run is recycled
+    long before = resident_kb();
+    char** fresh = xmalloc(count * sizeof(char*));
+    for (long ii = 0; ii < count; ++ii) {
+        fresh[ii] = xcalloc(FRESH_SIZE / 16, 16);
+    }
+    long grown = resident_kb() - before;
+
+    long bad = 0;
+    for (long ii = 0; ii < count; ++ii) {
+        bad += !is_zero(fresh[ii], FRESH_SIZE);
+        xfree(fresh[ii]);
+    }
+    xfree(fresh);
+
+    size_t sizes[] = { 16, 24, 100, 1000, 4000, 8192, 20000, 300000, 3000000 };
+    long checked = 0;
+    for (size_t ii = 0; ii < sizeof(sizes) / sizeof(sizes[0]); ++ii) {
+        bad += check_reused(sizes[ii], &checked);
+    }
+
+    printf("calloc: %ld reused chunks checked, %ld bad\n", checked, bad);
+    printf("fresh: %ld KB taken, %ld KB resident\n",
+           count * FRESH_SIZE / 1024, grown);
+
+    return 0;
+}
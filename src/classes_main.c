@@ -0,0 +1,97 @@
+// Size class benchmark for class tables.
+//
+// Keeps COUNT objects alive with the spiky sizes of a service that
+// allocates mostly 24, 40 and 72 byte records with a tail of others,
+// then reports the resident set. Run it once with hist.sample set in
+// LIMALLOC_CONF and LIMALLOC_HIST naming a file, feed the file to
+// classgen and run it again with LIMALLOC_CLASSES naming the table to
+// compare the resident sets. A table that fails to load leaves the
+// powers of two in place, the last line tells which classes were used.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "xmalloc.h"
+
+size_t
+ctl_get(const char* name)
+{
+    size_t value = 0;
+    size_t len = sizeof(value);
+    xmallctl(name, &value, &len, NULL, 0);
+    return value;
+}
+
+long
+resident_kb()
+{
+    long pages = 0;
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (file == NULL) {
+        return 0;
+    }
+    if (fscanf(file, "%*s %ld", &pages) != 1) {
+        pages = 0;
+    }
+    fclose(file);
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+size_t
+object_size(long ii)
+{
+    static const size_t spikes[] = { 24, 24, 24, 40, 40, 40, 72, 72, 72 };
+
+    long pick = (ii * 7919) % 10;
+    if (pick < 9) {
+        return spikes[pick];
+    }
+
+    // the tail spreads over the small sizes
+    return 16 + (ii * 104729) % 600;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 2 || atol(argv[1]) < 1) {
+        printf("Usage:\n");
+        printf("\t%s COUNT\n", argv[0]);
+        return 1;
+    }
+
+    long count = atol(argv[1]);
+    long base_kb = resident_kb();
+
+    void** objs = xmalloc(count * sizeof(void*));
+    size_t requested = 0;
+    long bad = 0;
+
+    for (long ii = 0; ii < count; ++ii) {
+        size_t size = object_size(ii);
+        objs[ii] = xmalloc(size);
+        memset(objs[ii], (int)(ii & 0x7f), size);
+        requested += size;
+    }
+
+    // every object kept its own bytes
+    for (long ii = 0; ii < count; ++ii) {
+        unsigned char* obj = objs[ii];
+        bad += obj[0] != (ii & 0x7f) || obj[object_size(ii) - 1] != (ii & 0x7f);
+    }
+
+    long used_kb = resident_kb() - base_kb;
+
+    printf("%ld objects, %zu KB requested, %ld KB resident, %ld bad\n",
+           count, requested / 1024, used_kb, bad);
+    printf("classes: %s\n", ctl_get("classes.custom") ? "loaded table" : "powers of two");
+
+    for (long ii = 0; ii < count; ++ii) {
+        xfree(objs[ii]);
+    }
+    xfree(objs);
+
+    return bad != 0;
+}
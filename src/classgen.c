@@ -0,0 +1,173 @@
+// Size class table generator.
+//
+// Reads size histograms written through LIMALLOC_HIST, "size count"
+// lines, or traces of requested sizes, one size per line, and finds
+// the table of at most CLASSES chunk sizes that wastes the fewest
+// bytes inside chunks for those requests. Sizes step by 16 bytes and
+// the last class is always the biggest standard size, bigger requests
+// are not served by classes and are skipped.
+//
+// The table goes to stdout in the format LIMALLOC_CLASSES loads, the
+// waste of the default powers of two and of the new table to stderr.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define STEP      16
+#define MAX_SIZE  8192
+#define SLOTS     (MAX_SIZE / STEP)
+#define MAX_CLASSES 10
+
+// requests and requested bytes per 16 byte step, slot ss holds the
+// sizes from (ss - 1) * STEP + 1 to ss * STEP
+double counts[SLOTS + 1];
+double bytes[SLOTS + 1];
+
+int
+read_file(const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] == '#') {
+            continue;
+        }
+
+        double size;
+        double count = 1;
+        int fields = sscanf(line, "%lf %lf", &size, &count);
+        if (fields < 1 || size < 1 || size > MAX_SIZE) {
+            continue;
+        }
+
+        long slot = ((long)size + STEP - 1) / STEP;
+        counts[slot] += count;
+        bytes[slot] += size * count;
+    }
+
+    fclose(file);
+    return 0;
+}
+
+// waste of serving slots lo..hi from chunks of the size of slot hi
+double
+waste(long lo, long hi, double* sum_counts, double* sum_bytes)
+{
+    double cc = sum_counts[hi] - sum_counts[lo - 1];
+    double bb = sum_bytes[hi] - sum_bytes[lo - 1];
+    return cc * hi * STEP - bb;
+}
+
+// waste of a table of class sizes
+double
+table_waste(long* table, int count, double* sum_counts, double* sum_bytes)
+{
+    double total = 0;
+    long lo = 1;
+    for (int ii = 0; ii < count; ++ii) {
+        long hi = table[ii] / STEP;
+        total += waste(lo, hi, sum_counts, sum_bytes);
+        lo = hi + 1;
+    }
+    return total;
+}
+
+int
+main(int argc, char* argv[])
+{
+    int classes = MAX_CLASSES;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "k:")) != -1) {
+        if (opt == 'k') {
+            classes = atoi(optarg);
+        }
+        else {
+            optind = argc + 1;
+        }
+    }
+
+    if (optind >= argc || classes < 1 || classes > MAX_CLASSES) {
+        printf("Usage:\n");
+        printf("\t%s [-k CLASSES] FILE...\n", argv[0]);
+        printf("CLASSES from 1 to %d, %d by default\n", MAX_CLASSES, MAX_CLASSES);
+        return 1;
+    }
+
+    for (int ii = optind; ii < argc; ++ii) {
+        if (read_file(argv[ii]) != 0) {
+            return 1;
+        }
+    }
+
+    static double sum_counts[SLOTS + 1];
+    static double sum_bytes[SLOTS + 1];
+    for (long ss = 1; ss <= SLOTS; ++ss) {
+        sum_counts[ss] = sum_counts[ss - 1] + counts[ss];
+        sum_bytes[ss] = sum_bytes[ss - 1] + bytes[ss];
+    }
+
+    if (sum_counts[SLOTS] == 0) {
+        fprintf(stderr, "no requests up to %d bytes\n", MAX_SIZE);
+        return 1;
+    }
+
+    // best[kk][hi] is the least waste of slots 1..hi with kk classes, the
+    // biggest of them at slot hi, from[kk][hi] the slot of the one before
+    static double best[MAX_CLASSES + 1][SLOTS + 1];
+    static long from[MAX_CLASSES + 1][SLOTS + 1];
+
+    for (long hi = 1; hi <= SLOTS; ++hi) {
+        best[1][hi] = waste(1, hi, sum_counts, sum_bytes);
+        from[1][hi] = 0;
+    }
+
+    for (int kk = 2; kk <= classes; ++kk) {
+        for (long hi = kk; hi <= SLOTS; ++hi) {
+            best[kk][hi] = -1;
+            for (long prev = kk - 1; prev < hi; ++prev) {
+                double ww = best[kk - 1][prev] + waste(prev + 1, hi, sum_counts, sum_bytes);
+                if (best[kk][hi] < 0 || ww < best[kk][hi]) {
+                    best[kk][hi] = ww;
+                    from[kk][hi] = prev;
+                }
+            }
+        }
+    }
+
+    int used = classes;
+    long table[MAX_CLASSES];
+    long hi = SLOTS;
+    for (int kk = used; kk >= 1; --kk) {
+        table[kk - 1] = hi * STEP;
+        hi = from[kk][hi];
+    }
+
+    long pow2[MAX_CLASSES];
+    for (int ii = 0; ii < MAX_CLASSES; ++ii) {
+        pow2[ii] = 16L << ii;
+    }
+
+    double requested = sum_bytes[SLOTS];
+    double old_waste = table_waste(pow2, MAX_CLASSES, sum_counts, sum_bytes);
+    double new_waste = table_waste(table, used, sum_counts, sum_bytes);
+
+    printf("# %d classes from %.0f requests\n", used, sum_counts[SLOTS]);
+    for (int ii = 0; ii < used; ++ii) {
+        printf("%s%ld", (ii == 0) ? "" : " ", table[ii]);
+    }
+    printf("\n");
+
+    fprintf(stderr, "requested %.0f bytes, waste %.1f%% with powers of two, "
+                    "%.1f%% with the new table\n",
+            requested, 100 * old_waste / requested, 100 * new_waste / requested);
+
+    return 0;
+}
@@ -0,0 +1,120 @@
+// Contention test for arena migration.
+//
+// All threads start on a single arena and keep allocating and freeing
+// medium buffers, each of which takes the arena lock. Threads that
+// keep waiting for the lock must move to arenas of their own, growing
+// the arena count, and a buffer must never be handed to two threads.
+//
+// Run it as "migrate" with migration on, or as "stay" to turn it off
+// with arenas.migrate, which keeps every thread on the first arena.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <assert.h>
+#include <time.h>
+
+#include "xmalloc.h"
+
+#define MAX_THREADS 64
+#define LIVE        16
+#define BUF_SIZE    (16 * 1024)
+
+long count = 0;
+long bad = 0;
+
+double
+now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+size_t
+ctl_get(const char* name)
+{
+    size_t value = 0;
+    size_t len = sizeof(value);
+    xmallctl(name, &value, &len, NULL, 0);
+    return value;
+}
+
+void*
+worker(void* arg)
+{
+    long id = (long)arg;
+    long* bufs[LIVE];
+    long my_bad = 0;
+
+    for (int ii = 0; ii < LIVE; ++ii) {
+        bufs[ii] = xmalloc(BUF_SIZE);
+        bufs[ii][0] = id;
+    }
+
+    for (long ii = 0; ii < count; ++ii) {
+        int slot = ii % LIVE;
+        my_bad += bufs[slot][0] != id;
+        xfree(bufs[slot]);
+        bufs[slot] = xmalloc(BUF_SIZE);
+        bufs[slot][0] = id;
+    }
+
+    for (int ii = 0; ii < LIVE; ++ii) {
+        my_bad += bufs[ii][0] != id;
+        xfree(bufs[ii]);
+    }
+
+    __atomic_add_fetch(&bad, my_bad, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    pthread_t threads[MAX_THREADS];
+    int rv;
+
+    if (argc != 4 || (strcmp(argv[3], "migrate") && strcmp(argv[3], "stay"))) {
+        printf("Usage:\n");
+        printf("\t%s THREADS COUNT migrate|stay\n", argv[0]);
+        return 1;
+    }
+
+    long thread_count = atol(argv[1]);
+    count = atol(argv[2]);
+    if (thread_count < 1 || thread_count > MAX_THREADS) {
+        printf("THREADS must be from 1 to %d\n", MAX_THREADS);
+        return 1;
+    }
+
+    // before the first allocation, the arena count is fixed after it
+    size_t one = 1;
+    rv = xmallctl("arenas.count", NULL, NULL, &one, sizeof(one));
+    assert(rv == 0);
+
+    size_t migrate = strcmp(argv[3], "migrate") == 0;
+    rv = xmallctl("arenas.migrate", NULL, NULL, &migrate, sizeof(migrate));
+    assert(rv == 0);
+
+    double start = now_ms();
+
+    for (long ii = 0; ii < thread_count; ++ii) {
+        rv = pthread_create(&(threads[ii]), 0, worker, (void*)ii);
+        assert(rv == 0);
+    }
+
+    for (long ii = 0; ii < thread_count; ++ii) {
+        rv = pthread_join(threads[ii], 0);
+        assert(rv == 0);
+    }
+
+    double run_ms = now_ms() - start;
+
+    printf("arenas: 1 -> %zu, %zu migrations, %ld bad\n",
+           ctl_get("arenas.count"), ctl_get("arenas.migrations"), bad);
+    printf("time: %.1f ms for %ld buffers\n", run_ms, thread_count * count);
+
+    return 0;
+}
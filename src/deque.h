@@ -0,0 +1,105 @@
+#ifndef DEQUE_H
+#define DEQUE_H
+
+#include <assert.h>
+
+#include "xmalloc.h"
+
+// Work-stealing deque of task indices (Chase-Lev).
+// The owner pushes and pops at the bottom, other threads steal from the top.
+// Capacity is fixed, the deque never holds more than cap items.
+typedef struct deque {
+    long* items;
+    long  mask;
+    long  top;
+    long  bottom;
+} deque;
+
+static
+void
+deque_init(deque* dq, long cap)
+{
+    assert(cap > 0);
+
+    long size = 1;
+    while (size < cap) {
+        size *= 2;
+    }
+
+    dq->items  = xmalloc(size * sizeof(long));
+    dq->mask   = size - 1;
+    dq->top    = 0;
+    dq->bottom = 0;
+}
+
+static
+void
+deque_free(deque* dq)
+{
+    xfree(dq->items);
+}
+
+// Owner only.
+static
+void
+deque_push(deque* dq, long item)
+{
+    long bb = __atomic_load_n(&(dq->bottom), __ATOMIC_RELAXED);
+    assert(bb - __atomic_load_n(&(dq->top), __ATOMIC_RELAXED) <= dq->mask);
+
+    __atomic_store_n(&(dq->items[bb & dq->mask]), item, __ATOMIC_RELAXED);
+    __atomic_store_n(&(dq->bottom), bb + 1, __ATOMIC_RELEASE);
+}
+
+// Owner only, returns -1 if the deque is empty.
+static
+long
+deque_pop(deque* dq)
+{
+    long bb = __atomic_load_n(&(dq->bottom), __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&(dq->bottom), bb, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long tt = __atomic_load_n(&(dq->top), __ATOMIC_RELAXED);
+
+    if (tt > bb) {
+        __atomic_store_n(&(dq->bottom), bb + 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    long item = __atomic_load_n(&(dq->items[bb & dq->mask]), __ATOMIC_RELAXED);
+
+    // last item, race the thieves for it
+    if (tt == bb) {
+        if (!__atomic_compare_exchange_n(&(dq->top), &tt, tt + 1, 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            item = -1;
+        }
+        __atomic_store_n(&(dq->bottom), bb + 1, __ATOMIC_RELAXED);
+    }
+
+    return item;
+}
+
+// Any thread, returns -1 if the deque is empty or the steal lost a race.
+static
+long
+deque_steal(deque* dq)
+{
+    long tt = __atomic_load_n(&(dq->top), __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long bb = __atomic_load_n(&(dq->bottom), __ATOMIC_ACQUIRE);
+
+    if (tt >= bb) {
+        return -1;
+    }
+
+    long item = __atomic_load_n(&(dq->items[tt & dq->mask]), __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&(dq->top), &tt, tt + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+
+    return item;
+}
+
+#endif
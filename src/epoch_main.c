@@ -0,0 +1,158 @@
+// Reader scaling benchmark for deferred free.
+//
+// Reader threads keep summing a shared list of cells while a writer
+// keeps replacing it with a new version. Version v holds the items
+// v .. v + LENGTH - 1, so a reader can tell from the head whether the
+// sum is right, a list freed under a reader and reused shows up as a
+// bad sum.
+//
+// Run it as "lock" to guard every traversal and swap with a mutex and
+// free old lists right away, or as "epoch" to traverse without locks
+// inside xepoch_enter / xepoch_exit and free old lists with
+// xfree_deferred.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <assert.h>
+#include <time.h>
+
+#include "xmalloc.h"
+#include "list.h"
+
+#define LENGTH   1000
+#define VERSIONS 2000
+
+cell* shared = NULL;
+pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int use_epoch = 0;
+int writing = 1;
+
+long reads = 0;
+long bad = 0;
+
+double
+now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+cell*
+make_version(long vv)
+{
+    cell* xs = 0;
+    for (long ii = LENGTH - 1; ii >= 0; --ii) {
+        xs = cons(vv + ii, xs);
+    }
+    return xs;
+}
+
+// returns 1 if the list sums up as its head says
+int
+check_list(cell* xs)
+{
+    long vv = xs->item;
+    long sum = 0;
+    for (; xs; xs = xs->rest) {
+        sum += xs->item;
+    }
+    return sum == LENGTH * vv + LENGTH * (LENGTH - 1) / 2;
+}
+
+void*
+reader(void* arg)
+{
+    long my_reads = 0;
+    long my_bad = 0;
+
+    while (__atomic_load_n(&writing, __ATOMIC_ACQUIRE)) {
+        if (use_epoch) {
+            xepoch_enter();
+            cell* xs = __atomic_load_n(&shared, __ATOMIC_ACQUIRE);
+            my_bad += !check_list(xs);
+            xepoch_exit();
+        }
+        else {
+            pthread_mutex_lock(&shared_lock);
+            my_bad += !check_list(shared);
+            pthread_mutex_unlock(&shared_lock);
+        }
+        my_reads += 1;
+    }
+
+    __atomic_add_fetch(&reads, my_reads, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bad, my_bad, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void
+writer()
+{
+    for (long vv = 1; vv <= VERSIONS; ++vv) {
+        cell* xs = make_version(vv);
+
+        if (use_epoch) {
+            cell* old = __atomic_exchange_n(&shared, xs, __ATOMIC_ACQ_REL);
+            while (old) {
+                cell* rest = old->rest;
+                xfree_deferred(old);
+                old = rest;
+            }
+        }
+        else {
+            pthread_mutex_lock(&shared_lock);
+            cell* old = shared;
+            shared = xs;
+            pthread_mutex_unlock(&shared_lock);
+            free_list(old);
+        }
+    }
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 3 || (strcmp(argv[1], "lock") && strcmp(argv[1], "epoch"))) {
+        printf("Usage:\n");
+        printf("\t%s lock|epoch READERS\n", argv[0]);
+        return 1;
+    }
+
+    use_epoch = strcmp(argv[1], "epoch") == 0;
+    long readers_n = atol(argv[2]);
+
+    shared = make_version(0);
+
+    pthread_t* threads = xmalloc(readers_n * sizeof(pthread_t));
+    for (long ii = 0; ii < readers_n; ++ii) {
+        int rv = pthread_create(&(threads[ii]), 0, reader, 0);
+        assert(rv == 0);
+    }
+
+    double start = now_ms();
+    writer();
+    double write_ms = now_ms() - start;
+
+    __atomic_store_n(&writing, 0, __ATOMIC_RELEASE);
+    for (long ii = 0; ii < readers_n; ++ii) {
+        int rv = pthread_join(threads[ii], 0);
+        assert(rv == 0);
+    }
+
+    free_list(shared);
+    xfree(threads);
+
+    size_t pending = 0;
+    size_t len = sizeof(pending);
+    xepoch_reclaim();
+    xmallctl("epoch.pending", &pending, &len, NULL, 0);
+
+    printf("%s: %ld reads, %d versions in %.0f ms, %ld bad, %zu pending\n",
+           argv[1], reads, VERSIONS, write_ms, bad, pending);
+
+    return bad != 0;
+}
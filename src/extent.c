@@ -0,0 +1,346 @@
+/*  LIMALLOC - lit malloc    */
+/*  by Oleksandr Litus       */
+
+/*  Extent cache: mappings freed by the allocators are kept for a while and
+    handed out again, so code that keeps creating and freeing big buffers
+    does not pay for mmap, munmap and page faults on every round. Extents
+    are binned by the power of two of their page count and shared by all
+    threads. The cache holds at most max_cached bytes, extents unused for
+    longer than decay_ms are unmapped. A cached extent keeps its header in
+    its first bytes, so memory handed out from the cache is not zeroed. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "extent.h"
+#include "probe.h"
+
+
+/* ============================= GLOBALS =================================== */
+#define CLASS_COUNT 40
+
+static const size_t  PAGE_SIZE        = 4096;
+static const long    DECAY_CHECK_NS   = 100 * 1000 * 1000;
+
+// a single extent may take at most this share of the cache
+static const size_t  EXTENT_MAX_DIV   = 4;
+
+/* Cached extent, the header lives at its start */
+typedef struct extent {
+    struct extent*  next;
+    size_t          size;
+    long            freed_at;
+} extent;
+
+static pthread_mutex_t  extent_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// newest extents first, so the stale ones are at the tail of each list
+static extent*          classes[CLASS_COUNT];
+
+static size_t           cached_bytes  = 0;
+static size_t           cached_count  = 0;
+static size_t           hits          = 0;
+static size_t           misses        = 0;
+static size_t           decayed_bytes = 0;
+
+static size_t           max_cached    = 64 * 1024 * 1024;
+static size_t           decay_ms      = 1000;
+static long             decay_checked = 0;
+
+
+/* ============================= FUNCTIONS ================================= */
+static long    now_ns();
+static int     size_class(size_t size);
+static void    release_chain(extent* chain);
+
+static extent* __take_extent(size_t size, int exact);
+static void    decay_check();
+
+void*  extent_map(size_t size, size_t* mapped, int* fresh);
+void   extent_unmap(void* ptr, size_t size);
+size_t extent_purge();
+size_t extent_cached();
+void   extent_decay();
+
+void   extent_set_max_cached(size_t bytes);
+void   extent_set_decay(size_t ms);
+void   extent_stats_get(extent_stats* stats);
+
+
+
+/* ============================= UTILS ===================================== */
+/* Monotonic time in nanoseconds */
+static
+long
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Class of the extent, the power of two of its page count */
+static
+int
+size_class(size_t size)
+{
+    size_t pages = size / PAGE_SIZE;
+    assert(pages > 0);
+
+    int cls = 63 - __builtin_clzl(pages);
+    return (cls < CLASS_COUNT) ? cls : CLASS_COUNT - 1;
+}
+
+/* Unmap a list of extents taken out of the cache */
+static
+void
+release_chain(extent* chain)
+{
+    while (chain != NULL) {
+        extent* next = chain->next;
+        munmap(chain, chain->size);
+        chain = next;
+    }
+}
+
+
+
+/* ============================= CACHE ===================================== */
+/* Take the first extent of at least size bytes out of its class, under lock.
+ With exact set only an extent of exactly size bytes is taken */
+static
+extent*
+__take_extent(size_t size, int exact)
+{
+    extent** link = &(classes[size_class(size)]);
+
+    while (*link != NULL) {
+        extent* curr = *link;
+
+        if (curr->size == size || (!exact && curr->size > size)) {
+            *link = curr->next;
+            cached_bytes -= curr->size;
+            cached_count -= 1;
+            return curr;
+        }
+
+        link = &(curr->next);
+    }
+
+    return NULL;
+}
+
+/* Unmap extents unused for longer than decay_ms, at most once per interval */
+static
+void
+decay_check()
+{
+    long now  = now_ns();
+    long last = __atomic_load_n(&decay_checked, __ATOMIC_RELAXED);
+
+    // only one thread checks per interval
+    if (now - last < DECAY_CHECK_NS ||
+        !__atomic_compare_exchange_n(&decay_checked, &last, now, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    size_t ms = __atomic_load_n(&decay_ms, __ATOMIC_RELAXED);
+    if (ms == 0) {
+        return;
+    }
+
+    long oldest = now - (long)ms * 1000 * 1000;
+    extent* stale = NULL;
+
+    pthread_mutex_lock(&extent_lock);
+
+    for (int cc = 0; cc < CLASS_COUNT; ++cc) {
+        extent** link = &(classes[cc]);
+        while (*link != NULL && (*link)->freed_at >= oldest) {
+            link = &((*link)->next);
+        }
+
+        // everything past the first stale extent is stale too
+        while (*link != NULL) {
+            extent* curr = *link;
+            *link = curr->next;
+
+            cached_bytes  -= curr->size;
+            cached_count  -= 1;
+            decayed_bytes += curr->size;
+
+            curr->next = stale;
+            stale = curr;
+        }
+    }
+
+    pthread_mutex_unlock(&extent_lock);
+
+    // unmap with the lock dropped
+    PROBE1(extent, decay, stale != NULL);
+    release_chain(stale);
+}
+
+/* Map size bytes, reusing a cached extent if there is one. If mapped is
+ not NULL a bigger extent may be returned and its size is stored there,
+ otherwise the size is exact. fresh is set if the memory is zeroed */
+void*
+extent_map(size_t size, size_t* mapped, int* fresh)
+{
+    assert(size > 0);
+    assert(size % PAGE_SIZE == 0);
+
+    pthread_mutex_lock(&extent_lock);
+    extent* ptr = __take_extent(size, mapped == NULL);
+    if (ptr != NULL) {
+        hits += 1;
+    }
+    else {
+        misses += 1;
+    }
+    pthread_mutex_unlock(&extent_lock);
+
+    decay_check();
+
+    if (ptr != NULL) {
+        PROBE2(extent, hit, size, ptr->size);
+        if (mapped != NULL) *mapped = ptr->size;
+        *fresh = 0;
+        return ptr;
+    }
+
+    PROBE1(extent, miss, size);
+
+    void* raw = mmap(NULL, size,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1, 0);
+    assert(raw != MAP_FAILED);
+
+    if (mapped != NULL) *mapped = size;
+    *fresh = 1;
+    return raw;
+}
+
+/* Give the extent to the cache, or back to the system if it does not fit */
+void
+extent_unmap(void* ptr, size_t size)
+{
+    assert(ptr != NULL);
+    assert(size % PAGE_SIZE == 0);
+
+    size_t max = __atomic_load_n(&max_cached, __ATOMIC_RELAXED);
+
+    if (size > max / EXTENT_MAX_DIV) {
+        munmap(ptr, size);
+        return;
+    }
+
+    extent* ext = ptr;
+    ext->size = size;
+    ext->freed_at = now_ns();
+
+    pthread_mutex_lock(&extent_lock);
+
+    int cached = cached_bytes + size <= max;
+    if (cached) {
+        int cls = size_class(size);
+        ext->next = classes[cls];
+        classes[cls] = ext;
+        cached_bytes += size;
+        cached_count += 1;
+    }
+
+    pthread_mutex_unlock(&extent_lock);
+
+    if (!cached) {
+        munmap(ptr, size);
+    }
+
+    decay_check();
+}
+
+/* Unmap every cached extent, returns bytes released */
+size_t
+extent_purge()
+{
+    extent* chain = NULL;
+
+    pthread_mutex_lock(&extent_lock);
+
+    size_t released = cached_bytes;
+    for (int cc = 0; cc < CLASS_COUNT; ++cc) {
+        while (classes[cc] != NULL) {
+            extent* curr = classes[cc];
+            classes[cc] = curr->next;
+            curr->next = chain;
+            chain = curr;
+        }
+    }
+    cached_bytes = 0;
+    cached_count = 0;
+
+    pthread_mutex_unlock(&extent_lock);
+
+    release_chain(chain);
+    return released;
+}
+
+/* Unmap stale extents now, for callers that do not map or unmap often */
+void
+extent_decay()
+{
+    decay_check();
+}
+
+/* Bytes currently held by the cache */
+size_t
+extent_cached()
+{
+    pthread_mutex_lock(&extent_lock);
+    size_t bytes = cached_bytes;
+    pthread_mutex_unlock(&extent_lock);
+    return bytes;
+}
+
+
+
+/* ============================= SETTINGS ================================== */
+/* Limit the bytes held by the cache, 0 disables caching */
+void
+extent_set_max_cached(size_t bytes)
+{
+    __atomic_store_n(&max_cached, bytes, __ATOMIC_RELAXED);
+}
+
+/* Unmap extents unused for ms milliseconds, 0 keeps them until a purge */
+void
+extent_set_decay(size_t ms)
+{
+    __atomic_store_n(&decay_ms, ms, __ATOMIC_RELAXED);
+}
+
+/* Copy the counters and limits of the cache */
+void
+extent_stats_get(extent_stats* stats)
+{
+    pthread_mutex_lock(&extent_lock);
+
+    stats->hits          = hits;
+    stats->misses        = misses;
+    stats->cached_bytes  = cached_bytes;
+    stats->cached_count  = cached_count;
+    stats->decayed_bytes = decayed_bytes;
+
+    pthread_mutex_unlock(&extent_lock);
+
+    stats->max_cached = __atomic_load_n(&max_cached, __ATOMIC_RELAXED);
+    stats->decay_ms   = __atomic_load_n(&decay_ms, __ATOMIC_RELAXED);
+}
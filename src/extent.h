@@ -0,0 +1,30 @@
+/*  LIMALLOC - lit malloc    */
+/*  by Oleksandr Litus       */
+
+#ifndef extent_h
+#define extent_h
+
+#include <stddef.h>
+
+/* Counters and limits of the extent cache */
+typedef struct extent_stats {
+    size_t  hits;
+    size_t  misses;
+    size_t  cached_bytes;
+    size_t  cached_count;
+    size_t  decayed_bytes;
+    size_t  max_cached;
+    size_t  decay_ms;
+} extent_stats;
+
+void*  extent_map(size_t size, size_t* mapped, int* fresh);
+void   extent_unmap(void* ptr, size_t size);
+size_t extent_purge();
+size_t extent_cached();
+void   extent_decay();
+
+void   extent_set_max_cached(size_t bytes);
+void   extent_set_decay(size_t ms);
+void   extent_stats_get(extent_stats* stats);
+
+#endif /* extent_h */
@@ -0,0 +1,82 @@
+// Benchmark for the extent cache.
+//
+// Every round allocates a buffer of each size from MIN_KB, 8 KB by
+// default, doubling up to 8 MB or eight sizes, writes its first and last
+// page and frees it again. Such buffers are mappings of their own, with
+// the extent cache a freed one is handed out again and only the first
+// round maps memory. Each buffer gets a mark at both ends that must read
+// back before it is freed. On par everything up to 1 MB is served from
+// medium runs, so only sizes above that reach the cache.
+//
+// Run it as "cache" with the cache on, or as "nocache" to set its limit
+// to 0, which unmaps every extent as it is freed.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "xmalloc.h"
+#include "extent.h"
+
+#define SIZE_COUNT 8
+#define MIN_KB     8
+#define MAX_SIZE   (8 * 1024 * 1024)
+
+double
+now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if ((argc != 3 && argc != 4)
+        || (strcmp(argv[2], "cache") && strcmp(argv[2], "nocache"))) {
+        printf("Usage:\n");
+        printf("\t%s ROUNDS cache|nocache [MIN_KB]\n", argv[0]);
+        return 1;
+    }
+
+    long rounds = atol(argv[1]);
+    size_t min_size = (size_t)((argc == 4) ? atol(argv[3]) : MIN_KB) * 1024;
+
+    int size_count = 0;
+    while (size_count < SIZE_COUNT && (min_size << size_count) <= MAX_SIZE) {
+        size_count += 1;
+    }
+    if (strcmp(argv[2], "nocache") == 0) {
+        extent_set_max_cached(0);
+    }
+
+    long bad = 0;
+    double start = now_ms();
+
+    for (long rr = 0; rr < rounds; ++rr) {
+        for (int ii = 0; ii < size_count; ++ii) {
+            size_t size = min_size << ii;
+            char* ptr = xmalloc(size);
+
+            char mark = (char)(rr + ii + 1);
+            ptr[0] = mark;
+            ptr[size - 1] = mark;
+            bad += ptr[0] != mark || ptr[size - 1] != mark;
+
+            xfree(ptr);
+        }
+    }
+
+    double run_ms = now_ms() - start;
+
+    extent_stats stats;
+    extent_stats_get(&stats);
+
+    printf("extent: %zu hits, %zu misses, %ld bad\n",
+           stats.hits, stats.misses, bad);
+    printf("time: %.1f ms for %ld buffers\n", run_ms, rounds * size_count);
+
+    return 0;
+}
@@ -0,0 +1,101 @@
+// Fragmentation benchmark for lifetime hints.
+//
+// Every round allocates a burst of transient objects interleaved
+// with a few objects that live until the end of the program, then
+// frees the transient ones and purges the allocator. The resident
+// set left after the purge is memory pinned by the long lived
+// objects.
+//
+// Run it as "hint" to pass XM_SHORT_LIVED / XM_LONG_LIVED, or as
+// "plain" to allocate everything with xmalloc.
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include "xmalloc.h"
+
+#define ROUNDS     20
+#define TRANSIENT  40000
+#define KEEP_EVERY 100
+
+long
+resident_kb()
+{
+    long pages = 0;
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (file == NULL) {
+        return 0;
+    }
+    if (fscanf(file, "%*s %ld", &pages) != 1) {
+        pages = 0;
+    }
+    fclose(file);
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+size_t
+object_size(long ii)
+{
+    // mostly small objects with a tail of bigger ones
+    static const size_t sizes[] = { 16, 24, 32, 48, 64, 96, 128, 256, 1024, 4000 };
+    return sizes[(ii * 7919) % 10];
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 2 || (strcmp(argv[1], "hint") && strcmp(argv[1], "plain"))) {
+        printf("Usage:\n");
+        printf("\t%s hint|plain\n", argv[0]);
+        return 1;
+    }
+
+    int hint = strcmp(argv[1], "hint") == 0;
+    int short_flags = hint ? XM_SHORT_LIVED : 0;
+    int long_flags  = hint ? XM_LONG_LIVED : 0;
+
+    long keep_count = ROUNDS * (TRANSIENT / KEEP_EVERY);
+    void** keep = xmalloc(keep_count * sizeof(void*));
+    void** temp = xmalloc(TRANSIENT * sizeof(void*));
+    long kk = 0;
+
+    long peak_kb = 0;
+    long left_kb = 0;
+
+    for (int rr = 0; rr < ROUNDS; ++rr) {
+        for (long ii = 0; ii < TRANSIENT; ++ii) {
+            size_t size = object_size(rr * TRANSIENT + ii);
+            temp[ii] = xmalloc_flags(size, short_flags);
+            memset(temp[ii], 1, size);
+
+            if (ii % KEEP_EVERY == 0) {
+                keep[kk] = xmalloc_flags(size, long_flags);
+                memset(keep[kk], 2, size);
+                kk += 1;
+            }
+        }
+
+        long rss = resident_kb();
+        peak_kb = (rss > peak_kb) ? rss : peak_kb;
+
+        for (long ii = 0; ii < TRANSIENT; ++ii) {
+            xfree(temp[ii]);
+        }
+        xmalloc_purge();
+
+        left_kb = resident_kb();
+    }
+
+    printf("%s: peak %ld KB, after free %ld KB, %ld long lived objects\n",
+           argv[1], peak_kb, left_kb, kk);
+
+    for (long ii = 0; ii < kk; ++ii) {
+        xfree(keep[ii]);
+    }
+    xfree(temp);
+    xfree(keep);
+
+    return 0;
+}
@@ -5,37 +5,63 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
 #include <sys/mman.h>
 #include <assert.h>
 #include <string.h>
 #include <pthread.h>
 
 #include "hmalloc.h"
+#include "extent.h"
+#include "probe.h"
 
 /* ============================ FUNCTIONS ================================== */
 void* hmalloc(size_t bytes);
 void  hfree(void* item);
 void* hrealloc(void* prev, size_t bytes);
+void* hcalloc(size_t count, size_t bytes);
 
 static size_t   div_up(size_t aa, size_t bb);
-static long     chunk_list_length();
-static void     chunk_list_coalesce();
+static void     reserve_spans();
+static int      in_spans(void* ptr);
+static stripe*  stripe_of(void* ptr);
+static void     lock_stripe(stripe* st);
+static stripe*  lock_home();
+static long     chunk_list_length(stripe* st);
+static void     chunk_list_coalesce(stripe* st);
 
-static void     push_chunk(chunk* chunk_addr);
-static chunk*   pop_chunk(size_t chunk_size);
-static chunk*   allocate_chunk(int page_count);
+static void     push_chunk(stripe* st, chunk* chunk_addr);
+static chunk*   pop_chunk(stripe* st, size_t chunk_size);
+static void     split_chunk(stripe* st, chunk* ptr, size_t size);
+static chunk*   stripe_page(stripe* st);
+static chunk*   stripe_alloc(stripe* st, size_t size);
+static chunk*   allocate_chunk(int page_count, int* fresh);
 
 
 
 /* ============================ GLOBAL VARS ================================ */
+#define STRIPE_COUNT 8
+
 const size_t    PAGE_SIZE = 4096;
 const size_t    BIG_ALLOC_SIZE = 4096;
 const size_t    OVERHEAD_SIZE = sizeof(size_t);
 const size_t    CHUNK_SIZE = sizeof(chunk);
 
-static chunk*   head = NULL;            // Initializes chunk list to NULL.
+// address space reserved for the small chunks of each stripe, and how
+// much of it is made accessible at a time
+static const size_t STRIPE_SPAN = (size_t)4 << 30;
+static const size_t STRIPE_GROW = 64 * 1024;
+
+#define STRIPE_INIT { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, NULL, NULL }
+
+static stripe   stripes[STRIPE_COUNT] = { [0 ... STRIPE_COUNT - 1] = STRIPE_INIT };
 
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static char*    spans = NULL;           // STRIPE_COUNT spans, one per stripe
+static pthread_once_t spans_once = PTHREAD_ONCE_INIT;
+
+static int      next_home = 0;          // stripe of the next new thread
+static __thread int __home = -1;
 
 
 
@@ -48,14 +74,90 @@ div_up(size_t aa, size_t bb)
     return ((aa - 1) / bb) + 1;
 }
 
+/* Reserve the address space of all stripes, nothing is accessible yet */
+static
+void
+reserve_spans()
+{
+    void* raw = mmap(NULL, STRIPE_COUNT * STRIPE_SPAN,
+                     PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                     -1, 0);
+    assert(raw != MAP_FAILED);
+    
+    // spans are carved from the top down
+    spans = raw;
+    for (int ss = 0; ss < STRIPE_COUNT; ++ss) {
+        stripes[ss].limit = spans + ss * STRIPE_SPAN;
+        stripes[ss].cur   = stripes[ss].limit + STRIPE_SPAN;
+        stripes[ss].end   = stripes[ss].cur;
+    }
+}
+
+/* Check if the chunk is a small one, carved from the stripe spans */
+static
+int
+in_spans(void* ptr)
+{
+    return spans != NULL && (char*)ptr >= spans
+           && (char*)ptr < spans + STRIPE_COUNT * STRIPE_SPAN;
+}
+
+/* Stripe whose span holds the chunk */
+static
+stripe*
+stripe_of(void* ptr)
+{
+    assert(in_spans(ptr));
+    return &(stripes[((char*)ptr - spans) / STRIPE_SPAN]);
+}
+
+/* Lock the stripe, waits on a held lock are traced */
+static
+void
+lock_stripe(stripe* st)
+{
+    if (pthread_mutex_trylock(&(st->lock)) == 0) {
+        return;
+    }
+    
+    PROBE1(hmalloc, lock_wait, (int)(st - stripes));
+    pthread_mutex_lock(&(st->lock));
+    PROBE1(hmalloc, lock_acquired, (int)(st - stripes));
+}
+
+/* Lock the home stripe of the thread, or any other one that is free at the
+ moment. Waits on the home stripe if all of them are busy */
+static
+stripe*
+lock_home()
+{
+    pthread_once(&spans_once, reserve_spans);
+    
+    if (__home < 0) {
+        __home = __atomic_fetch_add(&next_home, 1, __ATOMIC_RELAXED) % STRIPE_COUNT;
+    }
+    
+    for (int ii = 0; ii < STRIPE_COUNT; ++ii) {
+        stripe* st = &(stripes[(__home + ii) % STRIPE_COUNT]);
+        if (pthread_mutex_trylock(&(st->lock)) == 0) {
+            return st;
+        }
+    }
+    
+    stripe* st = &(stripes[__home]);
+    lock_stripe(st);
+    return st;
+}
+
 /* Calculate the length of the chunk list*/
 static
 long
-chunk_list_length()
+chunk_list_length(stripe* st)
 {
     int len = 0;
     
-    chunk* curr = head;
+    chunk* curr = st->head;
     while(curr != NULL) {
         len += 1;
         curr = curr->next;
@@ -71,16 +173,16 @@ chunk_list_length()
 /* Traverse through the list and coalesce chunks */
 static
 void
-chunk_list_coalesce()
+chunk_list_coalesce(stripe* st)
 {
     // head does not exist, or only head exists
-    if (head == 0 || head->next == NULL) {
+    if (st->head == 0 || st->head->next == NULL) {
         return;
     }
     
     // loop to coalesce
-    chunk* curr = head;
-    chunk* next = head->next;
+    chunk* curr = st->head;
+    chunk* next = st->head->next;
     while(curr != NULL && next != NULL) {
         chunk* curr_end = (chunk*)(((char*)curr) + curr->size);
         
@@ -106,20 +208,20 @@ chunk_list_coalesce()
 /* Push chunk to the list of chunks (from lowest to greatest address) */
 static
 void
-push_chunk(chunk* ptr)
+push_chunk(stripe* st, chunk* ptr)
 {
     assert(ptr != NULL);
     
     // chunk address is smaller than head address, or head is NULL
-    if (head == NULL || ptr < head) {
-        ptr->next = head;
-        head = ptr;
+    if (st->head == NULL || ptr < st->head) {
+        ptr->next = st->head;
+        st->head = ptr;
         return;
     }
     
     // traverse through the chunk list to find insert position
     chunk* prev = NULL;
-    chunk* curr = head;
+    chunk* curr = st->head;
     while (curr != NULL && ptr > curr) {
         prev = curr;
         curr = curr->next;
@@ -136,27 +238,27 @@ push_chunk(chunk* ptr)
 /* Pop chunk from the list of chunks */
 static
 chunk*
-pop_chunk(size_t size)
+pop_chunk(stripe* st, size_t size)
 {
     assert(size >= CHUNK_SIZE);
     
     chunk* ptr = NULL;
     
     // chunk list is empty, head is NULL
-    if (head == NULL) {
+    if (st->head == NULL) {
         return ptr;
     }
     
     // head can be used as a chunk
-    if (size <= head->size) {
-        ptr = head;
-        head = head->next;
+    if (size <= st->head->size) {
+        ptr = st->head;
+        st->head = st->head->next;
         return ptr;
     }
     
     // traverse through the list of chunks to find big enough chunk
     chunk* prev = NULL;
-    chunk* curr = head;
+    chunk* curr = st->head;
     while (curr != NULL && size > curr->size) {
         prev = curr;
         curr = curr->next;
@@ -181,7 +283,7 @@ pop_chunk(size_t size)
 /* Split the memory by the size, and push leftover to the chunk list */
 static
 void
-split_chunk(chunk* ptr, size_t size)
+split_chunk(stripe* st, chunk* ptr, size_t size)
 {
     assert(size > 0);
     assert(ptr != NULL);
@@ -203,7 +305,7 @@ split_chunk(chunk* ptr, size_t size)
         leftover_ptr->size = leftover_size;
         
         // push leftover to the chunk list
-        push_chunk(leftover_ptr);
+        push_chunk(st, leftover_ptr);
     }
     
     // leftover is smaller than CHUNK_SIZE
@@ -220,22 +322,70 @@ split_chunk(chunk* ptr, size_t size)
 
 
 /* ============================== ALLOCATION =============================== */
-/* Allocate chunk with given number of pages */
+/* Carve a page off the span of the locked stripe, making more of the span
+ accessible when needed. Returns NULL once the span is used up. Pages are
+ carved downwards, so the leftover of a new page goes near the list head */
+static
+chunk*
+stripe_page(stripe* st)
+{
+    if (st->cur == st->end) {
+        if (st->end == st->limit) {
+            return NULL;
+        }
+        
+        int rv = mprotect(st->end - STRIPE_GROW, STRIPE_GROW, PROT_READ | PROT_WRITE);
+        assert(rv == 0);
+        
+        PROBE2(hmalloc, chunk_map, STRIPE_GROW, 1);
+        st->end -= STRIPE_GROW;
+    }
+    
+    st->cur -= PAGE_SIZE;
+    chunk* ptr = (chunk*)st->cur;
+    
+    ptr->size = PAGE_SIZE;
+    return ptr;
+}
+
+/* Allocate a small chunk of size bytes from the locked stripe, NULL if it
+ has no chunk big enough and its span is used up */
+static
+chunk*
+stripe_alloc(stripe* st, size_t size)
+{
+    // try to pop chunk from the list
+    chunk* ptr = pop_chunk(st, size);
+    
+    // in case nothing was found, carve a new page
+    if (ptr == NULL) {
+        ptr = stripe_page(st);
+    }
+    
+    // split chunk and push leftover to the list of chunks
+    if (ptr != NULL) {
+        split_chunk(st, ptr, size);
+    }
+    
+    return ptr;
+}
+
+/* Allocate chunk with at least the given number of pages, reusing freed
+ mappings. fresh is set if the memory is zeroed */
 static
 chunk*
-allocate_chunk(int page_count)
+allocate_chunk(int page_count, int* fresh)
 {
     assert(page_count > 0);
     
     // calc allocation size
     size_t size = page_count * PAGE_SIZE;
     
-    // allocate chunk
-    chunk* ptr = mmap(NULL, size,
-                      PROT_READ | PROT_WRITE,
-                      MAP_PRIVATE | MAP_ANONYMOUS,
-                      -1, 0);
-    assert(ptr != MAP_FAILED);
+    // allocate chunk, a cached extent may be bigger
+    chunk* ptr = extent_map(size, &size, fresh);
+    assert(ptr != NULL);
+    
+    PROBE2(hmalloc, chunk_map, size, *fresh);
     
     // add size info to start of the chunk
     ptr->size = size;
@@ -254,29 +404,25 @@ hmalloc(size_t size)
     
     chunk* ptr = NULL;
     
+    int fresh;
+    
     size += OVERHEAD_SIZE;
     
     // make sure size is at least CHUNK_SIZE
     size = (size < CHUNK_SIZE) ? CHUNK_SIZE : size;
     
     if (size < BIG_ALLOC_SIZE) {
-        pthread_mutex_lock(&mutex);
-        
-        // try to pop chunk from the list
-        ptr = pop_chunk(size);
+        stripe* st = lock_home();
+        ptr = stripe_alloc(st, size);
+        pthread_mutex_unlock(&(st->lock));
         
-        // in case nothing was found, allocate a new page
-        if (ptr == NULL) {
-            int page_count = 1;
-            ptr = allocate_chunk(page_count);
-            assert(ptr != NULL);
+        // span of the stripe is used up, go through the others
+        for (int ss = 0; ptr == NULL && ss < STRIPE_COUNT; ++ss) {
+            lock_stripe(&(stripes[ss]));
+            ptr = stripe_alloc(&(stripes[ss]), size);
+            pthread_mutex_unlock(&(stripes[ss].lock));
         }
-        
-        // split chunk and push leftover to the list of chunks
-        split_chunk(ptr, size);
         assert(ptr != NULL);
-        
-        pthread_mutex_unlock(&mutex);
     }
     
     // allocation is bigger than BIG_ALLOC
@@ -284,7 +430,7 @@ hmalloc(size_t size)
         
         // allocate multiple pages
         int page_count = div_up(size, PAGE_SIZE);
-        ptr = allocate_chunk(page_count);
+        ptr = allocate_chunk(page_count, &fresh);
         assert(ptr != NULL);
     }
     
@@ -305,25 +451,25 @@ hfree(void* user_ptr)
     chunk* ptr = (chunk*)(((char*)user_ptr) - OVERHEAD_SIZE);
     assert(ptr != NULL);
 
-    // allocated size is a multiple of pages
-    if (ptr->size >= PAGE_SIZE) {
+    // small chunk goes back to the stripe whose span holds it
+    if (in_spans(ptr)) {
+        stripe* st = stripe_of(ptr);
+        lock_stripe(st);
         
-        // calc number of pages
-        int pages_count = div_up(ptr->size, PAGE_SIZE);
+        // add chunk to the list
+        push_chunk(st, ptr);
         
-        // unmap all of the pages
-        munmap(ptr, ptr->size);
-    } 
+        // coalesce chunks in the list
+        chunk_list_coalesce(st);
+        pthread_mutex_unlock(&(st->lock));
+    }
 
-    // allocated size is smaller than a page
+    // big allocation, a multiple of pages
     else {
-        pthread_mutex_lock(&mutex);
-        // add chunk to the list
-        push_chunk(ptr);
         
-        // coalesce chunks in the list
-        chunk_list_coalesce();
-        pthread_mutex_unlock(&mutex);
+        // keep the pages around for the next big allocation
+        PROBE1(hmalloc, chunk_unmap, ptr->size);
+        extent_unmap(ptr, ptr->size);
     }
 }
 
@@ -333,29 +479,62 @@ hrealloc(void* user_ptr, size_t new_size)
 {
     assert(new_size != 0);
     
-    // move back user address by the size of allocation info
-    chunk* ptr = (chunk*)(((char*)user_ptr) - OVERHEAD_SIZE);
-    
-    // return new allocation, if alloc_addr is NULL
-    if (ptr == NULL) {
+    // return new allocation, if user_ptr is NULL
+    if (user_ptr == NULL) {
         return hmalloc(new_size);
     }
     
-    // return the same chunk, if requested size the same or smaller
-    if (new_size <= ptr->size) {
-        return ptr;
+    // move back user address by the size of allocation info
+    chunk* ptr = (chunk*)(((char*)user_ptr) - OVERHEAD_SIZE);
+    size_t user_size = ptr->size - OVERHEAD_SIZE;
+    
+    // return the same chunk, if requested size fits in it
+    if (new_size <= user_size) {
+        return user_ptr;
     }
     
     // otherwise make new allocation
-    chunk* new_user_ptr = hmalloc(new_size);
+    void* new_user_ptr = hmalloc(new_size);
     assert(new_user_ptr != NULL);
     
+    PROBE2(hmalloc, realloc_copy, user_size, new_size);
+    
     // copy all data from old allocation to new
-    int user_size = ptr->size - OVERHEAD_SIZE;
-    memcpy(user_ptr, new_user_ptr, user_size);
+    memcpy(new_user_ptr, user_ptr, user_size);
     
     // free the old allocation
     hfree(user_ptr);
     
     return new_user_ptr;
 }
+
+/* Allocate zeroed memory for count items of the given size */
+void*
+hcalloc(size_t count, size_t size)
+{
+    // count * size does not fit into size_t
+    if (size != 0 && count > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    
+    size_t total = count * size;
+    total = (total == 0) ? 1 : total;
+    
+    if (total + OVERHEAD_SIZE < BIG_ALLOC_SIZE) {
+        void* user_ptr = hmalloc(total);
+        memset(user_ptr, 0, total);
+        return user_ptr;
+    }
+    
+    // fresh mappings are already zeroed by the kernel, cached ones are not
+    int fresh;
+    chunk* ptr = allocate_chunk(div_up(total + OVERHEAD_SIZE, PAGE_SIZE), &fresh);
+    
+    char* user_ptr = ((char*)ptr) + OVERHEAD_SIZE;
+    if (!fresh) {
+        memset(user_ptr, 0, total);
+    }
+    
+    return user_ptr;
+}
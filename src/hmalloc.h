@@ -7,6 +7,7 @@
 #define hmalloc_h
 
 #include <stdio.h>
+#include <pthread.h>
 
 /* Singly-linked list of free memory chunks */
 typedef struct chunk {
@@ -14,8 +15,21 @@ typedef struct chunk {
 	struct chunk*   next;
 } chunk;
 
+/* Independently locked part of the heap: an address-ordered free list of
+ small chunks, all carved from the stripe's own span of addresses. Pages
+ between end and cur are accessible but not carved yet, limit is the
+ bottom of the span */
+typedef struct stripe {
+	pthread_mutex_t lock;
+	chunk*          head;
+	char*           cur;
+	char*           end;
+	char*           limit;
+} __attribute__((aligned(64))) stripe;
+
 void* hmalloc(size_t alloc_size);
 void  hfree(void* item);
 void* hrealloc(void* prev, size_t alloc_size);
+void* hcalloc(size_t count, size_t alloc_size);
 
 #endif /* hmalloc_h */
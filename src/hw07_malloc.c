@@ -23,3 +23,9 @@ xrealloc(void* prev, size_t bytes)
     return hrealloc(prev, bytes);
     return 0;
 }
+
+void*
+xcalloc(size_t count, size_t bytes)
+{
+    return hcalloc(count, bytes);
+}
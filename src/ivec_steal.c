@@ -0,0 +1,231 @@
+// The Collatz conjecture:
+//
+// If we start with some number n and iterate the following:
+// - If x is even, n -> n/2
+// - If x is odd,  n -> 3*n + 1
+// We'll eventually get to 1.
+
+// This program searches for the largest number of steps that
+// this takes for numbers from 2 to a provided TOP number.
+
+// Same work as ivec_main.c, scheduled for scaling runs:
+//  - the thread count comes from the command line.
+//  - every thread owns a deque of task indices and steals from
+//    the others when it runs dry, a task is only ever held by
+//    one thread so tasks need no locks.
+//  - with PERFCTR_CSV set, every thread appends its hardware
+//    counters per task step to that file.
+
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <assert.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include "xmalloc.h"
+#include "ivec.h"
+#include "deque.h"
+#include "perfctr.h"
+
+#define THREADS 4
+#define MAX_THREADS 256
+
+typedef struct num_task {
+    ivec* vals;
+    long  steps;
+} num_task;
+
+num_task** tasks;
+long data_top = 0;
+
+deque* deques;
+long threads_n = THREADS;
+long tasks_left = 0;
+
+const char* prog_name = 0;
+const char* perf_path = 0;
+
+long
+collatz_step(long n)
+{
+    if (n % 2 == 0) {
+        return n/2;
+    }
+    else {
+        return 3*n + 1;
+    }
+}
+
+ivec*
+iterate(ivec* xs)
+{
+    long vv = 0;
+    for (int jj = 0; vv != 1 && jj < 50; ++jj) {
+        vv = collatz_step(ivec_last(xs));
+        ivec_push(xs, vv);
+    }
+    return xs;
+}
+
+// Advance the task, returns 1 once its sequence reached 1
+int
+run_task(long ii)
+{
+    ivec* xs = tasks[ii]->vals;
+    long vv = ivec_last(xs);
+
+    if (vv > 1) {
+        xs = ivec_copy(xs);
+        xs = iterate(xs);
+        free_ivec(tasks[ii]->vals);
+        tasks[ii]->vals = xs;
+        return 0;
+    }
+
+    tasks[ii]->steps = tasks[ii]->vals->size - 1;
+    return 1;
+}
+
+long
+steal_task(long id, unsigned int* seed)
+{
+    long base = rand_r(seed) % threads_n;
+
+    for (long i0 = 0; i0 < threads_n; ++i0) {
+        long victim = (base + i0) % threads_n;
+        if (victim == id) {
+            continue;
+        }
+
+        long ii = deque_steal(&(deques[victim]));
+        if (ii >= 0) {
+            return ii;
+        }
+    }
+
+    return -1;
+}
+
+void*
+worker(void* arg)
+{
+    long id = (long)arg;
+    unsigned int seed = id + 1;
+    long steps = 0;
+
+    perfctr pc;
+    if (perf_path) {
+        perfctr_open(&pc, 0, 0);
+        perfctr_enable(&pc);
+    }
+
+    while (__atomic_load_n(&tasks_left, __ATOMIC_ACQUIRE) > 0) {
+        long ii = deque_pop(&(deques[id]));
+        if (ii < 0) {
+            ii = steal_task(id, &seed);
+        }
+        if (ii < 0) {
+            sched_yield();
+            continue;
+        }
+
+        steps += 1;
+        if (run_task(ii)) {
+            __atomic_sub_fetch(&tasks_left, 1, __ATOMIC_RELEASE);
+        }
+        else {
+            deque_push(&(deques[id]), ii);
+        }
+    }
+
+    if (perf_path) {
+        int64_t vals[PERFCTR_COUNT];
+        perfctr_read(&pc, vals);
+        perfctr_close(&pc);
+        perfctr_thread_csv(perf_path, prog_name, id, steps, vals);
+    }
+
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    int rv;
+
+    if (argc != 2 && argc != 3) {
+        printf("Usage:\n");
+        printf("\t%s TOP [THREADS]\n", argv[0]);
+        return 1;
+    }
+
+    data_top = atol(argv[1]);
+    if (argc == 3) {
+        threads_n = atol(argv[2]);
+    }
+
+    if (data_top < 2 || threads_n < 1 || threads_n > MAX_THREADS) {
+        printf("TOP must be at least 2, THREADS from 1 to %d\n", MAX_THREADS);
+        return 1;
+    }
+
+    tasks = xmalloc(data_top * sizeof(num_task*));
+    for (int ii = 0; ii < data_top; ++ii) {
+        tasks[ii] = xmalloc(sizeof(num_task));
+        ivec* xs = make_ivec(4);
+        ivec_push(xs, ii);
+        tasks[ii]->vals  = xs;
+        tasks[ii]->steps = -1;
+    }
+
+    // deal the tasks out round robin
+    deques = xmalloc(threads_n * sizeof(deque));
+    for (long ii = 0; ii < threads_n; ++ii) {
+        deque_init(&(deques[ii]), data_top);
+    }
+    for (long ii = 1; ii < data_top; ++ii) {
+        deque_push(&(deques[ii % threads_n]), ii);
+    }
+    tasks_left = data_top - 1;
+
+    prog_name = argv[0];
+    perf_path = getenv("PERFCTR_CSV");
+
+    pthread_t* threads = xmalloc(threads_n * sizeof(pthread_t));
+    for (long ii = 0; ii < threads_n; ++ii) {
+        rv = pthread_create(&(threads[ii]), 0, worker, (void*)ii);
+        assert(rv == 0);
+    }
+
+    for (long ii = 0; ii < threads_n; ++ii) {
+        rv = pthread_join(threads[ii], 0);
+        assert(rv == 0);
+    }
+
+    long max_v = 0;
+    long max_s = 0;
+
+    for (int ii = 0; ii < data_top; ++ii) {
+        if (tasks[ii]->steps > max_s) {
+            max_v = ii;
+            max_s = tasks[ii]->steps;
+        }
+    }
+
+    printf("Max steps is at %ld: %ld steps\n", max_v, max_s);
+
+    for (long ii = 0; ii < threads_n; ++ii) {
+        deque_free(&(deques[ii]));
+    }
+    xfree(deques);
+    xfree(threads);
+
+    for (int ii = 0; ii < data_top; ++ii) {
+        free_ivec(tasks[ii]->vals);
+        xfree(tasks[ii]);
+    }
+    xfree(tasks);
+
+    return 0;
+}
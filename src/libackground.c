@@ -0,0 +1,223 @@
+/*  LIMALLOC - lit malloc    */
+/*  by Oleksandr Litus       */
+
+/*  Background thread: optional maintenance off the allocation path. Every
+    background.interval_ms it drains the remote queues of the arenas, and
+    for every arena that was used since its last visit it carves prefaulted
+    segments for buckets running dry and tops up the segment reserve, so
+    threads rarely map or fault on a refill. An arena left idle for
+    background.decay_ms is purged once, and stale extents are unmapped. The
+    thread never allocates through limalloc and is stopped and joined at
+    exit. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "limalloc.h"
+#include "extent.h"
+#include "probe.h"
+
+
+/* ============================= GLOBALS =================================== */
+/* What the thread saw of an arena on its last visit */
+typedef struct arena_seen {
+    size_t  activity;
+    long    since;
+    int     purged;
+} arena_seen;
+
+// start and stop hold control_lock throughout, bg_lock guards the flags
+static pthread_mutex_t  control_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t  bg_lock    = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   bg_wake;
+static pthread_once_t   bg_once    = PTHREAD_ONCE_INIT;
+static pthread_t        bg_thread;
+static int              bg_running = 0;
+static int              bg_stop    = 0;
+
+static arena_seen       seen[LI_ARENA_MAX];
+static size_t           wakeups    = 0;
+
+
+/* ============================= FUNCTIONS ================================= */
+static long  now_ns();
+static void  bg_init();
+static void  maintain(int idx, long now);
+static void* bg_main(void* arg);
+
+int    libackground_start();
+void   libackground_stop();
+size_t libackground_wakeups();
+
+
+
+/* ============================= UTILS ===================================== */
+/* Monotonic time in nanoseconds */
+static
+long
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Create the wake condition on the monotonic clock and the exit hook */
+static
+void
+bg_init()
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&bg_wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    atexit(libackground_stop);
+}
+
+
+
+/* ============================= MAINTENANCE =============================== */
+/* One visit of an arena */
+static
+void
+maintain(int idx, long now)
+{
+    arena_seen* last = &(seen[idx]);
+
+    liarena_drain(idx);
+
+    size_t activity = liarena_activity(idx);
+
+    // used since the last visit, refill what is running dry
+    if (activity != last->activity) {
+        size_t low = __atomic_load_n(&(li_config.background_low_bytes), __ATOMIC_RELAXED);
+        if (low > 0) {
+            liarena_refill(idx, low);
+        }
+
+        // the refill locks the arena too, only later locks are activity
+        last->activity = liarena_activity(idx);
+        last->since    = now;
+        last->purged   = 0;
+        return;
+    }
+
+    // idle for long enough, give its free memory back once
+    size_t decay_ms = __atomic_load_n(&(li_config.background_decay_ms), __ATOMIC_RELAXED);
+    if (decay_ms > 0 && !last->purged
+        && now - last->since >= (long)decay_ms * 1000 * 1000) {
+        liarena_purge(idx);
+        last->activity = liarena_activity(idx);
+        last->purged   = 1;
+    }
+}
+
+/* Thread body, visits every arena each interval until stopped */
+static
+void*
+bg_main(void* arg)
+{
+    pthread_mutex_lock(&bg_lock);
+
+    while (!bg_stop) {
+        size_t interval_ms = __atomic_load_n(&(li_config.background_interval_ms),
+                                             __ATOMIC_RELAXED);
+
+        struct timespec until;
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        until.tv_sec  += interval_ms / 1000;
+        until.tv_nsec += (interval_ms % 1000) * 1000 * 1000;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec  += 1;
+            until.tv_nsec -= 1000000000L;
+        }
+
+        int rv = 0;
+        while (!bg_stop && rv != ETIMEDOUT) {
+            rv = pthread_cond_timedwait(&bg_wake, &bg_lock, &until);
+        }
+        if (bg_stop) {
+            break;
+        }
+
+        pthread_mutex_unlock(&bg_lock);
+
+        PROBE0(limalloc, background_wake);
+
+        long now = now_ns();
+        int count = (int)liarena_count();
+        for (int aa = 0; aa < count; ++aa) {
+            maintain(aa, now);
+        }
+        extent_decay();
+
+        __atomic_add_fetch(&wakeups, 1, __ATOMIC_RELAXED);
+
+        pthread_mutex_lock(&bg_lock);
+    }
+
+    pthread_mutex_unlock(&bg_lock);
+    return NULL;
+}
+
+
+
+/* ============================= CONTROL =================================== */
+/* Start the background thread if it is not running, returns 0 or an errno
+ value */
+int
+libackground_start()
+{
+    pthread_once(&bg_once, bg_init);
+
+    pthread_mutex_lock(&control_lock);
+    pthread_mutex_lock(&bg_lock);
+
+    int rv = 0;
+    if (!bg_running) {
+        bg_stop = 0;
+        rv = pthread_create(&bg_thread, NULL, bg_main, NULL);
+        bg_running = rv == 0;
+    }
+
+    __atomic_store_n(&(li_config.background), (size_t)bg_running, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&bg_lock);
+    pthread_mutex_unlock(&control_lock);
+    return rv;
+}
+
+/* Stop the background thread and wait for it, it finishes its visit first */
+void
+libackground_stop()
+{
+    pthread_mutex_lock(&control_lock);
+    pthread_mutex_lock(&bg_lock);
+
+    int running = bg_running;
+    bg_stop = 1;
+    bg_running = 0;
+    pthread_cond_signal(&bg_wake);
+    pthread_mutex_unlock(&bg_lock);
+
+    if (running) {
+        pthread_join(bg_thread, NULL);
+    }
+
+    __atomic_store_n(&(li_config.background), 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&control_lock);
+}
+
+/* Rounds of maintenance done so far */
+size_t
+libackground_wakeups()
+{
+    return __atomic_load_n(&wakeups, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,353 @@
+/*  LIMALLOC - lit malloc    */
+/*  by Oleksandr Litus       */
+
+/*  Caches: fixed size objects of one type carved from dedicated slabs.
+    Each thread keeps two magazines per cache, so alloc and free are a push
+    or a pop without locks or size lookup. Full and empty magazines are
+    traded with the depot of the cache under its lock. Objects are built by
+    the constructor once, when carved from a slab, and keep that state
+    across free and alloc. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "limalloc.h"
+
+
+/* ============================= GLOBALS =================================== */
+#define CACHE_SLOTS 64
+
+static const size_t  PAGE_SIZE        = 4096;
+static const size_t  SEG_SIZE         = LI_SEGMENT_SIZE;
+static const size_t  MIN_ALIGN        = 16;
+static const size_t  MIN_SLAB_OBJS    = 8;
+
+/* Magazines of a thread for one cache */
+typedef struct cache_slot {
+    licache*        cache;
+    unsigned long   gen;
+    licache_mag*    loaded;
+    licache_mag*    prev;
+} cache_slot;
+
+static __thread cache_slot __slots[CACHE_SLOTS];
+
+static pthread_mutex_t  slots_lock      = PTHREAD_MUTEX_INITIALIZER;
+static int              slots_used[CACHE_SLOTS];
+static unsigned long    slots_gens[CACHE_SLOTS];
+static unsigned long    slots_gen       = 0;
+
+
+/* ============================= FUNCTIONS ================================= */
+static size_t align_up(size_t size, size_t align);
+
+static void*        slab_carve(licache* cache, size_t size, size_t align);
+static licache_mag* depot_empty(licache* cache);
+static void*        carve_objects(licache* cache, licache_mag* mag);
+
+static cache_slot*  __get_slot(licache* cache);
+static void         depot_put(licache* cache, licache_mag* mag);
+
+licache* licache_create(size_t size, size_t align, void (*ctor)(void* obj));
+void*    licache_alloc(licache* cache);
+void     licache_free(licache* cache, void* ptr);
+void     licache_destroy(licache* cache);
+void     licache_thread_exit();
+
+
+
+/* ============================= UTILS ===================================== */
+/* Round size up to the multiple of align */
+static
+size_t
+align_up(size_t size, size_t align)
+{
+    return (size + align - 1) & ~(align - 1);
+}
+
+
+
+/* ============================= SLABS ===================================== */
+/* Carve size bytes from the current slab, mapping a new one if needed */
+static
+void*
+slab_carve(licache* cache, size_t size, size_t align)
+{
+    char* ptr = (char*)align_up((uintptr_t)cache->cur, align);
+
+    // current slab is exhausted, map a new one
+    if (cache->cur == NULL || ptr + size > cache->end) {
+        size_t slab_size = align_up(sizeof(licache_slab), align)
+                           + MIN_SLAB_OBJS * size;
+        slab_size = (slab_size < SEG_SIZE) ? SEG_SIZE
+                                           : align_up(slab_size, PAGE_SIZE);
+
+        licache_slab* slab = lisegment_map(slab_size);
+        slab->size = slab_size;
+        slab->next = cache->slabs;
+        cache->slabs = slab;
+
+        cache->cur = (char*)slab + sizeof(licache_slab);
+        cache->end = (char*)slab + slab_size;
+        ptr = (char*)align_up((uintptr_t)cache->cur, align);
+    }
+
+    cache->cur = ptr + size;
+    return ptr;
+}
+
+/* Get an empty magazine from the depot or carve a new one, under lock */
+static
+licache_mag*
+depot_empty(licache* cache)
+{
+    licache_mag* mag = cache->empty;
+
+    if (mag != NULL) {
+        cache->empty = mag->next;
+    }
+    else {
+        mag = slab_carve(cache, sizeof(licache_mag), MIN_ALIGN);
+    }
+
+    mag->next = NULL;
+    mag->count = 0;
+    return mag;
+}
+
+/* Return a magazine of any fill to the depot, under lock */
+static
+void
+depot_put(licache* cache, licache_mag* mag)
+{
+    if (mag->count > 0) {
+        mag->next = cache->full;
+        cache->full = mag;
+    }
+    else {
+        mag->next = cache->empty;
+        cache->empty = mag;
+    }
+}
+
+/* Fill the magazine with freshly constructed objects, return one more */
+static
+void*
+carve_objects(licache* cache, licache_mag* mag)
+{
+    assert(mag->count == 0);
+
+    while (mag->count < LICACHE_MAG_SIZE) {
+        void* obj = slab_carve(cache, cache->obj_size, cache->align);
+        if (cache->ctor != NULL) cache->ctor(obj);
+        mag->objs[mag->count++] = obj;
+    }
+
+    void* obj = slab_carve(cache, cache->obj_size, cache->align);
+    if (cache->ctor != NULL) cache->ctor(obj);
+    return obj;
+}
+
+
+
+/* ============================= SLOTS ===================================== */
+/* Magazines of the current thread for the cache */
+static
+cache_slot*
+__get_slot(licache* cache)
+{
+    cache_slot* slot = &(__slots[cache->slot]);
+
+    // slot still belongs to a destroyed cache, its magazines are gone
+    if (slot->cache != cache || slot->gen != cache->gen) {
+        slot->cache  = cache;
+        slot->gen    = cache->gen;
+        slot->loaded = NULL;
+        slot->prev   = NULL;
+    }
+
+    return slot;
+}
+
+
+
+/* ============================= CACHE ===================================== */
+/* Create a cache of objects of the given size and alignment */
+licache*
+licache_create(size_t size, size_t align, void (*ctor)(void* obj))
+{
+    assert(size > 0);
+
+    align = (align < MIN_ALIGN) ? MIN_ALIGN : align;
+    assert((align & (align - 1)) == 0);
+    assert(align <= PAGE_SIZE);
+
+    // find a free thread slot for the cache
+    pthread_mutex_lock(&slots_lock);
+    int slot = 0;
+    while (slot < CACHE_SLOTS && slots_used[slot]) {
+        ++slot;
+    }
+    if (slot == CACHE_SLOTS) {
+        pthread_mutex_unlock(&slots_lock);
+        return NULL;
+    }
+    slots_used[slot] = 1;
+    unsigned long gen = ++slots_gen;
+    slots_gens[slot] = gen;
+    pthread_mutex_unlock(&slots_lock);
+
+    // cache header is the first object of its first slab
+    licache tmp;
+    memset(&tmp, 0, sizeof(tmp));
+    licache* cache = slab_carve(&tmp, sizeof(licache), MIN_ALIGN);
+    *cache = tmp;
+
+    pthread_mutex_init(&(cache->lock), NULL);
+    cache->obj_size = align_up(size, align);
+    cache->align    = align;
+    cache->ctor     = ctor;
+    cache->slot     = slot;
+    cache->gen      = gen;
+
+    return cache;
+}
+
+/* Allocate one object from the cache */
+void*
+licache_alloc(licache* cache)
+{
+    assert(cache != NULL);
+
+    cache_slot* slot = __get_slot(cache);
+
+    // fast path, pop from the loaded magazine
+    if (slot->loaded != NULL && slot->loaded->count > 0) {
+        return slot->loaded->objs[--slot->loaded->count];
+    }
+
+    // previous magazine has objects, swap it in
+    if (slot->prev != NULL && slot->prev->count > 0) {
+        licache_mag* tmp = slot->loaded;
+        slot->loaded = slot->prev;
+        slot->prev = tmp;
+        return slot->loaded->objs[--slot->loaded->count];
+    }
+
+    pthread_mutex_lock(&(cache->lock));
+
+    // trade an empty magazine for a full one from the depot
+    if (cache->full != NULL) {
+        if (slot->prev != NULL) {
+            slot->prev->next = cache->empty;
+            cache->empty = slot->prev;
+        }
+        slot->prev = slot->loaded;
+        slot->loaded = cache->full;
+        cache->full = slot->loaded->next;
+        pthread_mutex_unlock(&(cache->lock));
+
+        return slot->loaded->objs[--slot->loaded->count];
+    }
+
+    // depot is empty too, carve new objects from the slab
+    if (slot->loaded == NULL) {
+        slot->loaded = depot_empty(cache);
+    }
+    void* obj = carve_objects(cache, slot->loaded);
+
+    pthread_mutex_unlock(&(cache->lock));
+    return obj;
+}
+
+/* Return the object to the cache, its constructed state is kept */
+void
+licache_free(licache* cache, void* ptr)
+{
+    assert(cache != NULL);
+    assert(ptr != NULL);
+
+    cache_slot* slot = __get_slot(cache);
+
+    // fast path, push to the loaded magazine
+    if (slot->loaded != NULL && slot->loaded->count < LICACHE_MAG_SIZE) {
+        slot->loaded->objs[slot->loaded->count++] = ptr;
+        return;
+    }
+
+    // previous magazine is empty, swap it in
+    if (slot->prev != NULL && slot->prev->count == 0) {
+        licache_mag* tmp = slot->loaded;
+        slot->loaded = slot->prev;
+        slot->prev = tmp;
+        slot->loaded->objs[slot->loaded->count++] = ptr;
+        return;
+    }
+
+    pthread_mutex_lock(&(cache->lock));
+
+    // hand the full previous magazine to the depot
+    if (slot->prev != NULL) {
+        slot->prev->next = cache->full;
+        cache->full = slot->prev;
+    }
+    slot->prev = slot->loaded;
+    slot->loaded = depot_empty(cache);
+
+    pthread_mutex_unlock(&(cache->lock));
+
+    slot->loaded->objs[slot->loaded->count++] = ptr;
+}
+
+/* Destroy the cache and release all of its slabs */
+void
+licache_destroy(licache* cache)
+{
+    assert(cache != NULL);
+
+    pthread_mutex_lock(&slots_lock);
+    slots_used[cache->slot] = 0;
+    pthread_mutex_unlock(&slots_lock);
+
+    pthread_mutex_destroy(&(cache->lock));
+
+    // cache header lives in the last slab of the list
+    licache_slab* slab = cache->slabs;
+    while (slab != NULL) {
+        licache_slab* next = slab->next;
+        lisegment_unmap(slab, slab->size);
+        slab = next;
+    }
+}
+
+/* Give the magazines of the exiting thread back to their caches */
+void
+licache_thread_exit()
+{
+    // destroy waits for slots_lock, so live caches stay alive here
+    pthread_mutex_lock(&slots_lock);
+
+    for (int ii = 0; ii < CACHE_SLOTS; ++ii) {
+        cache_slot* slot = &(__slots[ii]);
+
+        if (!slots_used[ii] || slots_gens[ii] != slot->gen) {
+            continue;
+        }
+
+        licache* cache = slot->cache;
+        pthread_mutex_lock(&(cache->lock));
+        if (slot->loaded != NULL) depot_put(cache, slot->loaded);
+        if (slot->prev != NULL) depot_put(cache, slot->prev);
+        pthread_mutex_unlock(&(cache->lock));
+
+        slot->cache  = NULL;
+        slot->loaded = NULL;
+        slot->prev   = NULL;
+    }
+
+    pthread_mutex_unlock(&slots_lock);
+}
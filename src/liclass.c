@@ -0,0 +1,160 @@
+/*  LIMALLOC - lit malloc    */
+/*  by Oleksandr Litus       */
+
+/*  Size classes: a sampled histogram of requested sizes and loading of a
+    class table that replaces the powers of two. With hist.sample set to N
+    in LIMALLOC_CONF every thread records one in N of its allocations, in
+    steps of 16 bytes, and the histogram is written at exit to the file
+    named by LIMALLOC_HIST. classgen turns histograms or traces into a
+    table, which is loaded at startup from the file named by
+    LIMALLOC_CLASSES: up to LI_BUCKET_COUNT - 1 sizes in increasing order,
+    multiples of 16, the last one LI_MAX_BUCKET_SIZE. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "limalloc.h"
+
+
+/* ============================= GLOBALS =================================== */
+// sampled sizes by 16 byte step, the last slot counts big allocations
+static size_t           hist[LI_CLASS_SLOTS + 1];
+
+
+/* ============================= FUNCTIONS ================================= */
+static void write_at_exit();
+
+void   lihist_sample(size_t size);
+int    lihist_write(int fd);
+int    liclasses_load(const char* path);
+void   liclass_init();
+
+
+
+/* ============================= HISTOGRAM ================================= */
+/* Record size and count down to the next sample of the thread. A thread
+ reads hist.sample at its first allocation, later changes only affect
+ threads that have not allocated yet */
+void
+lihist_sample(size_t size)
+{
+    // the first allocation of a process comes before LIMALLOC_CONF is read
+    lictl_init();
+
+    size_t rate = __atomic_load_n(&(li_config.hist_sample), __ATOMIC_RELAXED);
+    if (rate == 0) {
+        __tcache.sample_left = LONG_MAX;
+        return;
+    }
+
+    size_t slot = (size > LI_MAX_BUCKET_SIZE) ? LI_CLASS_SLOTS
+                  : (size + LI_CLASS_STEP - 1) / LI_CLASS_STEP;
+    __atomic_add_fetch(&(hist[slot]), 1, __ATOMIC_RELAXED);
+
+    __tcache.sample_left = rate - 1;
+}
+
+/* Write the histogram as "size count" lines, big allocations as size 0.
+ Returns the number of lines */
+int
+lihist_write(int fd)
+{
+    int lines = 0;
+
+    dprintf(fd, "# limalloc size histogram, 1 in %zu allocations\n",
+            li_config.hist_sample);
+
+    for (size_t ss = 1; ss <= LI_CLASS_SLOTS; ++ss) {
+        size_t count = __atomic_load_n(&(hist[ss]), __ATOMIC_RELAXED);
+        if (count == 0) {
+            continue;
+        }
+
+        size_t size = (ss == LI_CLASS_SLOTS) ? 0 : ss * LI_CLASS_STEP;
+        dprintf(fd, "%zu %zu\n", size, count);
+        lines += 1;
+    }
+
+    return lines;
+}
+
+/* Write the histogram to LIMALLOC_HIST at exit */
+static
+void
+write_at_exit()
+{
+    const char* path = getenv("LIMALLOC_HIST");
+    if (path == NULL) {
+        return;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        dprintf(2, "limalloc: can not write LIMALLOC_HIST \"%s\"\n", path);
+        return;
+    }
+
+    lihist_write(fd);
+    close(fd);
+}
+
+
+
+/* ============================= CLASS TABLE =============================== */
+/* Load a class table from the file at path, '#' starts a comment. Returns
+ 0 on success, -1 if the file is unreadable or the table is bad */
+int
+liclasses_load(const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+
+    size_t sizes[LI_BUCKET_COUNT];
+    int count = 0;
+    int bad = 0;
+
+    char word[64];
+    while (fscanf(file, "%63s", word) == 1) {
+        if (word[0] == '#') {
+            int cc;
+            while ((cc = fgetc(file)) != EOF && cc != '\n') {
+            }
+            continue;
+        }
+
+        char* end;
+        size_t size = strtoul(word, &end, 10);
+        if (*end != '\0' || count == LI_BUCKET_COUNT - 1) {
+            bad = 1;
+            break;
+        }
+        sizes[count++] = size;
+    }
+    fclose(file);
+
+    if (bad || liarena_set_classes(sizes, count) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Load LIMALLOC_CLASSES and set up the histogram file, called once the
+ configuration is read */
+void
+liclass_init()
+{
+    const char* path = getenv("LIMALLOC_CLASSES");
+    if (path != NULL && liclasses_load(path) != 0) {
+        dprintf(2, "limalloc: bad LIMALLOC_CLASSES table \"%s\"\n", path);
+    }
+
+    if (li_config.hist_sample > 0) {
+        atexit(write_at_exit);
+    }
+}
@@ -0,0 +1,1176 @@
+/*  LIMALLOC - lit malloc    */
+/*  by Oleksandr Litus       */
+
+/*  Control: named values to inspect and tune the allocator at run time, in
+    the style of mallctl. Every value is a size_t, read through oldp and
+    oldlenp and written through newp and newlen. Actions such as purges run
+    on every call and report their result through oldp. Tunables are also
+    read at init from LIMALLOC_CONF, name:value pairs separated by commas,
+    values take an optional k, m or g suffix:
+
+        LIMALLOC_CONF="arenas.count:4,tcache.max:128,pressure.limit:512m"
+
+    Errors are reported as errno values: ENOENT for an unknown name, EINVAL
+    for a bad length or value, EPERM for a value that can not be changed. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "limalloc.h"
+#include "extent.h"
+
+
+/* ============================= GLOBALS =================================== */
+#define CONF_MAX 256
+
+static const size_t  TCACHE_MAX_LIMIT = 4096;
+
+typedef int (*ctl_get)(int idx, size_t* value);
+typedef int (*ctl_set)(int idx, size_t value);
+
+/* Named value, arena.N names take the arena index */
+typedef struct ctl_entry {
+    const char* name;
+    ctl_get     get;
+    ctl_set     set;
+    int         action;
+} ctl_entry;
+
+static pthread_once_t conf_once = PTHREAD_ONCE_INIT;
+
+
+/* ============================= FUNCTIONS ================================= */
+static size_t arena_free(int idx);
+static size_t total_free();
+
+static int get_arenas_count(int idx, size_t* value);
+static int set_arenas_count(int idx, size_t value);
+static int get_segment_size(int idx, size_t* value);
+static int get_bucket_count(int idx, size_t* value);
+static int get_arenas_purge(int idx, size_t* value);
+static int get_arenas_max(int idx, size_t* value);
+static int set_arenas_max(int idx, size_t value);
+static int get_arenas_migrate(int idx, size_t* value);
+static int set_arenas_migrate(int idx, size_t value);
+static int get_migrations(int idx, size_t* value);
+static int get_arena_threads(int idx, size_t* value);
+static int get_arena_segments(int idx, size_t* value);
+static int get_arena_free(int idx, size_t* value);
+static int get_arena_purge(int idx, size_t* value);
+static int get_arena_waits(int idx, size_t* value);
+static int get_arena_wait_ns(int idx, size_t* value);
+static int get_arena_empty(int idx, size_t* value);
+static int get_arena_remote(int idx, size_t* value);
+static int get_thread_arena(int idx, size_t* value);
+static int get_tcache_flush(int idx, size_t* value);
+static int get_tcache_max(int idx, size_t* value);
+static int set_tcache_max(int idx, size_t value);
+static int get_fill_size(int idx, size_t* value);
+static int set_fill_size(int idx, size_t value);
+static int get_transfer_depth(int idx, size_t* value);
+static int set_transfer_depth(int idx, size_t value);
+static int get_transfer_batches(int idx, size_t* value);
+static int get_transfer_spills(int idx, size_t* value);
+static int get_hist_sample(int idx, size_t* value);
+static int set_hist_sample(int idx, size_t value);
+static int get_classes_custom(int idx, size_t* value);
+static int get_vm_reserve(int idx, size_t* value);
+static int set_vm_reserve(int idx, size_t value);
+static int get_vm_committed(int idx, size_t* value);
+static int get_vm_free(int idx, size_t* value);
+static int get_vm_fallbacks(int idx, size_t* value);
+static int get_vm_merges(int idx, size_t* value);
+static int get_vm_decommit_fails(int idx, size_t* value);
+static int get_pool_max(int idx, size_t* value);
+static int set_pool_max(int idx, size_t value);
+static int get_prewarm_bytes(int idx, size_t* value);
+static int set_prewarm_bytes(int idx, size_t value);
+static int get_prewarm_classes(int idx, size_t* value);
+static int set_prewarm_classes(int idx, size_t value);
+static int get_reserve_bytes(int idx, size_t* value);
+static int set_reserve_bytes(int idx, size_t value);
+static int get_background(int idx, size_t* value);
+static int set_background(int idx, size_t value);
+static int get_bg_interval(int idx, size_t* value);
+static int set_bg_interval(int idx, size_t value);
+static int get_bg_decay(int idx, size_t* value);
+static int set_bg_decay(int idx, size_t value);
+static int get_bg_low(int idx, size_t* value);
+static int set_bg_low(int idx, size_t value);
+static int get_bg_wakeups(int idx, size_t* value);
+static int get_limit(int idx, size_t* value);
+static int set_limit(int idx, size_t value);
+static int get_stats_print(int idx, size_t* value);
+static int set_stats_print(int idx, size_t value);
+static int get_mapped(int idx, size_t* value);
+static int get_allocated(int idx, size_t* value);
+static int get_free(int idx, size_t* value);
+static int get_epoch_current(int idx, size_t* value);
+static int get_epoch_pending(int idx, size_t* value);
+static int get_epoch_reclaimed(int idx, size_t* value);
+static int get_epoch_reclaim(int idx, size_t* value);
+static int get_extent_hits(int idx, size_t* value);
+static int get_extent_misses(int idx, size_t* value);
+static int get_extent_cached(int idx, size_t* value);
+static int get_extent_max(int idx, size_t* value);
+static int set_extent_max(int idx, size_t value);
+static int get_extent_decay(int idx, size_t* value);
+static int set_extent_decay(int idx, size_t value);
+
+static const ctl_entry* ctl_find(const char* name, int* idx);
+static int  ctl_call(const char* name, void* oldp, size_t* oldlenp,
+                     const void* newp, size_t newlen);
+static int  parse_size(const char* str, size_t* value);
+static void load_conf();
+static void print_at_exit();
+
+void lictl_init();
+int  lictl(const char* name, void* oldp, size_t* oldlenp,
+           const void* newp, size_t newlen);
+void lictl_dump(int fd);
+
+
+static const ctl_entry entries[] = {
+    { "arenas.count",           get_arenas_count,   set_arenas_count,   0 },
+    { "arenas.segment_size",    get_segment_size,   NULL,               0 },
+    { "arenas.bucket_count",    get_bucket_count,   NULL,               0 },
+    { "arenas.purge",           get_arenas_purge,   NULL,               1 },
+    { "arenas.max",             get_arenas_max,     set_arenas_max,     0 },
+    { "arenas.migrate",         get_arenas_migrate, set_arenas_migrate, 0 },
+    { "arenas.migrations",      get_migrations,     NULL,               0 },
+    { "arenas.pool_max",        get_pool_max,       set_pool_max,       0 },
+    { "arena.N.threads",        get_arena_threads,  NULL,               0 },
+    { "arena.N.segments",       get_arena_segments, NULL,               0 },
+    { "arena.N.free",           get_arena_free,     NULL,               0 },
+    { "arena.N.purge",          get_arena_purge,    NULL,               1 },
+    { "arena.N.lock_waits",     get_arena_waits,    NULL,               0 },
+    { "arena.N.wait_ns",        get_arena_wait_ns,  NULL,               0 },
+    { "arena.N.empty_segments", get_arena_empty,    NULL,               0 },
+    { "arena.N.remote_frees",   get_arena_remote,   NULL,               0 },
+    { "thread.arena",           get_thread_arena,   NULL,               0 },
+    { "thread.tcache.flush",    get_tcache_flush,   NULL,               1 },
+    { "tcache.max",             get_tcache_max,     set_tcache_max,     0 },
+    { "tcache.fill_size",       get_fill_size,      set_fill_size,      0 },
+    { "transfer.depth",         get_transfer_depth, set_transfer_depth, 0 },
+    { "transfer.batches",       get_transfer_batches, NULL,             0 },
+    { "transfer.spills",        get_transfer_spills, NULL,              0 },
+    { "hist.sample",            get_hist_sample,    set_hist_sample,    0 },
+    { "classes.custom",         get_classes_custom, NULL,               0 },
+    { "vm.reserve",             get_vm_reserve,     set_vm_reserve,     0 },
+    { "vm.committed",           get_vm_committed,   NULL,               0 },
+    { "vm.free",                get_vm_free,        NULL,               0 },
+    { "vm.fallbacks",           get_vm_fallbacks,   NULL,               0 },
+    { "vm.merges",              get_vm_merges,      NULL,               0 },
+    { "vm.decommit_fails",      get_vm_decommit_fails, NULL,            0 },
+    { "prewarm.bytes",          get_prewarm_bytes,  set_prewarm_bytes,  0 },
+    { "prewarm.classes",        get_prewarm_classes, set_prewarm_classes, 0 },
+    { "reserve.bytes",          get_reserve_bytes,  set_reserve_bytes,  0 },
+    { "background.enabled",     get_background,     set_background,     0 },
+    { "background.interval_ms", get_bg_interval,    set_bg_interval,    0 },
+    { "background.decay_ms",    get_bg_decay,       set_bg_decay,       0 },
+    { "background.low_bytes",   get_bg_low,         set_bg_low,         0 },
+    { "background.wakeups",     get_bg_wakeups,     NULL,               0 },
+    { "pressure.limit",         get_limit,          set_limit,          0 },
+    { "stats.print",            get_stats_print,    set_stats_print,    0 },
+    { "stats.mapped",           get_mapped,         NULL,               0 },
+    { "stats.allocated",        get_allocated,      NULL,               0 },
+    { "stats.free",             get_free,           NULL,               0 },
+    { "epoch.current",          get_epoch_current,  NULL,               0 },
+    { "epoch.pending",          get_epoch_pending,  NULL,               0 },
+    { "epoch.reclaimed",        get_epoch_reclaimed, NULL,              0 },
+    { "epoch.reclaim",          get_epoch_reclaim,  NULL,               1 },
+    { "extent.hits",            get_extent_hits,    NULL,               0 },
+    { "extent.misses",          get_extent_misses,  NULL,               0 },
+    { "extent.cached",          get_extent_cached,  NULL,               0 },
+    { "extent.max_cached",      get_extent_max,     set_extent_max,     0 },
+    { "extent.decay_ms",        get_extent_decay,   set_extent_decay,   0 },
+};
+
+
+
+/* ============================= UTILS ===================================== */
+/* Free bytes held by the arena, including fresh space and pooled segments */
+static
+size_t
+arena_free(int idx)
+{
+    liarena_stats stats;
+    liarena_stats_get(idx, &stats);
+
+    size_t free = (stats.pool + stats.reserve) * LI_SEGMENT_SIZE
+                  + stats.medium_free_bytes;
+    for (int bb = 0; bb < 2 * LI_BUCKET_COUNT; ++bb) {
+        free += stats.buckets[bb].free_bytes + stats.buckets[bb].fresh_bytes;
+    }
+
+    return free;
+}
+
+/* Free bytes held by all arenas */
+static
+size_t
+total_free()
+{
+    size_t free = 0;
+    for (int aa = 0; aa < (int)liarena_count(); ++aa) {
+        free += arena_free(aa);
+    }
+    return free;
+}
+
+
+
+/* ============================= VALUES ==================================== */
+static
+int
+get_arenas_count(int idx, size_t* value)
+{
+    *value = liarena_count();
+    return 0;
+}
+
+static
+int
+set_arenas_count(int idx, size_t value)
+{
+    if (value < 1 || value > LI_ARENA_MAX) {
+        return EINVAL;
+    }
+    return (liarena_set_count(value) == 0) ? 0 : EPERM;
+}
+
+static
+int
+get_segment_size(int idx, size_t* value)
+{
+    *value = LI_SEGMENT_SIZE;
+    return 0;
+}
+
+static
+int
+get_bucket_count(int idx, size_t* value)
+{
+    *value = LI_BUCKET_COUNT;
+    return 0;
+}
+
+static
+int
+get_arenas_purge(int idx, size_t* value)
+{
+    *value = lipurge();
+    return 0;
+}
+
+static
+int
+get_arenas_max(int idx, size_t* value)
+{
+    *value = __atomic_load_n(&(li_config.arena_max), __ATOMIC_RELAXED);
+    return 0;
+}
+
+static
+int
+set_arenas_max(int idx, size_t value)
+{
+    if (value < 1 || value > LI_ARENA_MAX) {
+        return EINVAL;
+    }
+    __atomic_store_n(&(li_config.arena_max), value, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static
+int
+get_arenas_migrate(int idx, size_t* value)
+{
+    *value = __atomic_load_n(&(li_config.migrate), __ATOMIC_RELAXED);
+    return 0;
+}
+
+static
+int
+set_arenas_migrate(int idx, size_t value)
+{
+    __atomic_store_n(&(li_config.migrate), value != 0, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static
+int
+get_migrations(int idx, size_t* value)
+{
+    *value = liarena_migrations();
+    return 0;
+}
+
+static
+int
+get_arena_threads(int idx, size_t* value)
+{
+    liarena_stats stats;
+    liarena_stats_get(idx, &stats);
+    *value = stats.threads;
+    return 0;
+}
+
+static
+int
+get_arena_segments(int idx, size_t* value)
+{
+    liarena_stats stats;
+    liarena_stats_get(idx, &stats);
+
+    *value = stats.pool + stats.reserve + stats.medium_segments;
+    for (int bb = 0; bb < 2 * LI_BUCKET_COUNT; ++bb) {
+        *value += stats.buckets[bb].segments;
+    }
+    return 0;
+}
+
+static
+int
+get_arena_free(int idx, size_t* value)
+{
+    *value = arena_free(idx);
+    return 0;
+}
+
+static
+int
+get_arena_purge(int idx, size_t* value)
+{
+    *value = liarena_purge(idx);
+    return 0;
+}
+
+static
+int
+get_arena_waits(int idx, size_t* value)
+{
+    liarena_stats stats;
+    liarena_stats_get(idx, &stats);
+    *value = stats.lock_waits;
+    return 0;
+}
+
+static
+int
+get_arena_wait_ns(int idx, size_t* value)
+{
+    liarena_stats stats;
+    liarena_stats_get(idx, &stats);
+    *value = stats.wait_ns;
+    return 0;
+}
+
+/* Segments without live chunks still linked to their bucket */
+static
+int
+get_arena_empty(int idx, size_t* value)
+{
+    liarena_stats stats;
+    liarena_stats_get(idx, &stats);
+    *value = stats.empty_segments;
+    return 0;
+}
+
+/* Chunks of the arena freed by threads of other arenas */
+static
+int
+get_arena_remote(int idx, size_t* value)
+{
+    liarena_stats stats;
+    liarena_stats_get(idx, &stats);
+    *value = stats.remote_frees;
+    return 0;
+}
+
+/* Arena of the thread, SIZE_MAX if it has not allocated yet */
+static
+int
+get_thread_arena(int idx, size_t* value)
+{
+    int arena_idx = liarena_index();
+    *value = (arena_idx < 0) ? SIZE_MAX : (size_t)arena_idx;
+    return 0;
+}
+
+static
+int
+get_tcache_flush(int idx, size_t* value)
+{
+    litcache_flush();
+    *value = 0;
+    return 0;
+}
+
+static
+int
+get_tcache_max(int idx, size_t* value)
+{
+    *value = __atomic_load_n(&(li_config.tcache_max), __ATOMIC_RELAXED);
+    return 0;
+}
+
+static
+int
+set_tcache_max(int idx, size_t value)
+{
+    if (value < 2 || value > TCACHE_MAX_LIMIT) {
+        return EINVAL;
+    }
+    __atomic_store_n(&(li_config.tcache_max), value, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static
+int
+get_fill_size(int idx, size_t* value)
+{
+    *value = __atomic_load_n(&(li_config.tcache_fill_size), __ATOMIC_RELAXED);
+    return 0;
+}
+
+static
+int
+set_fill_size(int idx, size_t value)
+{
+    __atomic_store_n(&(li_config.tcache_fill_size), value, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Slots of the transfer cache used per bucket, 0 sends every flush to the
+ arenas */
+static
+int
+get_transfer_depth(int idx, size_t* value)
+{
+    *value = __atomic_load_n(&(li_config.transfer_depth), __ATOMIC_RELAXED);
+    return 0;
+}
+
+static
+int
+set_transfer_depth(int idx, size_t value)
+{
+    if (value > LI_TRANSFER_SLOTS) {
+        return EINVAL;
+    }
+    __atomic_store_n(&(li_config.transfer_depth), value, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static
+int
+get_transfer_batches(int idx, size_t* value)
+{
+    litransfer_stats stats;
+    litransfer_stats_get(&stats);
+    *value = stats.batches;
+    return 0;
+}
+
+static
+int
+get_transfer_spills(int idx, size_t* value)
+{
+    litransfer_stats stats;
+    litransfer_stats_get(&stats);
+    *value = stats.spills;
+    return 0;
+}
+
+static
+int
+get_hist_sample(int idx, size_t* value)
+{
+    *value = __atomic_load_n(&(li_config.hist_sample), __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* One in value allocations is sampled, 0 samples none */
+static
+int
+set_hist_sample(int idx, size_t value)
+{
+    __atomic_store_n(&(li_config.hist_sample), value, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* 1 if a class table from LIMALLOC_CLASSES replaced the powers of two */
+static
+int
+get_classes_custom(int idx, size_t* value)
+{
+    *value = __atomic_load_n(&li_classes_custom, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Size of the reserved range, or the size to reserve before it is */
+static
+int
+get_vm_reserve(int idx, size_t* value)
+{
+    livm_stats stats;
+    livm_stats_get(&stats);
+    *value = (stats.reserved > 0) ? stats.reserved
+             : __atomic_load_n(&(li_config.vm_reserve), __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Only takes effect before the first segment is mapped, 0 maps every
+ segment on its own */
+static
+int
+set_vm_reserve(int idx, size_t value)
+{
+    if (value > LI_VM_RESERVE_MAX) {
+        return EINVAL;
+    }
+    if (__atomic_load_n(&li_vm_base, __ATOMIC_ACQUIRE) != NULL) {
+        return EPERM;
+    }
+    __atomic_store_n(&(li_config.vm_reserve), value, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static
+int
+get_vm_committed(int idx, size_t* value)
+{
+    livm_stats stats;
+    livm_stats_get(&stats);
+    *value = stats.committed;
+    return 0;
+}
+
+static
+int
+get_vm_free(int idx, size_t* value)
+{
+    livm_stats stats;
+    livm_stats_get(&stats);
+    *value = stats.free_bytes;
+    return 0;
+}
+
+static
+int
+get_vm_fallbacks(int idx, size_t* value)
+{
+    livm_stats stats;
+    livm_stats_get(&stats);
+    *value = stats.fallbacks;
+    return 0;
+}
+
+/* Aligned groups of four free 1 MB segments merged into a 4 MB one */
+static
+int
+get_vm_merges(int idx, size_t* value)
+{
+    livm_stats stats;
+    livm_stats_get(&stats);
+    *value = stats.merges;
+    return 0;
+}
+
+/* Freed segments that could not be remapped PROT_NONE, only their pages
+ were dropped */
+static
+int
+get_vm_decommit_fails(int idx, size_t* value)
+{
+    livm_stats stats;
+    livm_stats_get(&stats);
+    *value = stats.decommit_fails;
+    return 0;
+}
+
+/* Empty segments an arena keeps */
+static
+int
+get_pool_max(int idx, size_t* value)
+{
+    *value = __atomic_load_n(&(li_config.pool_max), __ATOMIC_RELAXED);
+    return 0;
+}
+
+static
+int
+set_pool_max(int idx, size_t value)
+{
+    __atomic_store_n(&(li_config.pool_max), value, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Bytes of free chunks per class mapped at init, see limalloc_prewarm */
+static
+int
+get_prewarm_bytes(int idx, size_t* value)
+{
+    *value = __atomic_load_n(&(li_config.prewarm_bytes), __ATOMIC_RELAXED);
+    return 0;
+}
+
+static
+int
+set_prewarm_bytes(int idx, size_t value)
+{
+    __atomic_store_n(&(li_config.prewarm_bytes), value, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Bit bb selects bucket bb, only standard buckets can be prewarmed */
+static
+int
+get_prewarm_classes(int idx, size_t* value)
+{
+    *value = __atomic_load_n(&(li_config.prewarm_classes), __ATOMIC_RELAXED);
+    return 0;
+}
+
+static
+int
+set_prewarm_classes(int idx, size_t value)
+{
+    if (value & ~(size_t)((1 << LI_BUCKET_COUNT) - 2)) {
+        return EINVAL;
+    }
+    __atomic_store_n(&(li_config.prewarm_classes), value, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static
+int
+get_reserve_bytes(int idx, size_t* value)
+{
+    *value = __atomic_load_n(&(li_config.reserve_bytes), __ATOMIC_RELAXED);
+    return 0;
+}
+
+static
+int
+set_reserve_bytes(int idx, size_t value)
+{
+    __atomic_store_n(&(li_config.reserve_bytes), value, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static
+int
+get_background(int idx, size_t* value)
+{
+    *value = __atomic_load_n(&(li_config.background), __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Start or stop the maintenance thread */
+static
+int
+set_background(int idx, size_t value)
+{
+    if (value == 0) {
+        libackground_stop();
+        return 0;
+    }
+    return libackground_start();
+}
+
+static
+int
+get_bg_interval(int idx, size_t* value)
+{
+    *value = __atomic_load_n(&(li_config.background_interval_ms), __ATOMIC_RELAXED);
+    return 0;
+}
+
+static
+int
+set_bg_interval(int idx, size_t value)
+{
+    if (value < 1) {
+        return EINVAL;
+    }
+    __atomic_store_n(&(li_config.background_interval_ms), value, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static
+int
+get_bg_decay(int idx, size_t* value)
+{
+    *value = __atomic_load_n(&(li_config.background_decay_ms), __ATOMIC_RELAXED);
+    return 0;
+}
+
+static
+int
+set_bg_decay(int idx, size_t value)
+{
+    __atomic_store_n(&(li_config.background_decay_ms), value, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static
+int
+get_bg_low(int idx, size_t* value)
+{
+    *value = __atomic_load_n(&(li_config.background_low_bytes), __ATOMIC_RELAXED);
+    return 0;
+}
+
+static
+int
+set_bg_low(int idx, size_t value)
+{
+    __atomic_store_n(&(li_config.background_low_bytes), value, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static
+int
+get_bg_wakeups(int idx, size_t* value)
+{
+    *value = libackground_wakeups();
+    return 0;
+}
+
+static
+int
+get_limit(int idx, size_t* value)
+{
+    *value = lipressure_limit();
+    return 0;
+}
+
+static
+int
+set_limit(int idx, size_t value)
+{
+    lipressure_set_limit(value);
+    return 0;
+}
+
+static
+int
+get_stats_print(int idx, size_t* value)
+{
+    *value = __atomic_load_n(&(li_config.stats_print), __ATOMIC_RELAXED);
+    return 0;
+}
+
+static
+int
+set_stats_print(int idx, size_t value)
+{
+    __atomic_store_n(&(li_config.stats_print), value != 0, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static
+int
+get_mapped(int idx, size_t* value)
+{
+    *value = limapped();
+    return 0;
+}
+
+/* Bytes in use, chunks cached by threads count as used */
+static
+int
+get_allocated(int idx, size_t* value)
+{
+    size_t mapped = limapped();
+    size_t free = total_free();
+    *value = (mapped > free) ? mapped - free : 0;
+    return 0;
+}
+
+static
+int
+get_free(int idx, size_t* value)
+{
+    *value = total_free();
+    return 0;
+}
+
+static
+int
+get_epoch_current(int idx, size_t* value)
+{
+    *value = liepoch_current();
+    return 0;
+}
+
+static
+int
+get_epoch_pending(int idx, size_t* value)
+{
+    *value = liepoch_pending();
+    return 0;
+}
+
+static
+int
+get_epoch_reclaimed(int idx, size_t* value)
+{
+    *value = liepoch_reclaimed();
+    return 0;
+}
+
+/* Move the epoch on and free what the calling thread retired */
+static
+int
+get_epoch_reclaim(int idx, size_t* value)
+{
+    *value = liepoch_reclaim();
+    return 0;
+}
+
+static
+int
+get_extent_hits(int idx, size_t* value)
+{
+    extent_stats stats;
+    extent_stats_get(&stats);
+    *value = stats.hits;
+    return 0;
+}
+
+static
+int
+get_extent_misses(int idx, size_t* value)
+{
+    extent_stats stats;
+    extent_stats_get(&stats);
+    *value = stats.misses;
+    return 0;
+}
+
+static
+int
+get_extent_cached(int idx, size_t* value)
+{
+    *value = extent_cached();
+    return 0;
+}
+
+static
+int
+get_extent_max(int idx, size_t* value)
+{
+    extent_stats stats;
+    extent_stats_get(&stats);
+    *value = stats.max_cached;
+    return 0;
+}
+
+static
+int
+set_extent_max(int idx, size_t value)
+{
+    extent_set_max_cached(value);
+    return 0;
+}
+
+static
+int
+get_extent_decay(int idx, size_t* value)
+{
+    extent_stats stats;
+    extent_stats_get(&stats);
+    *value = stats.decay_ms;
+    return 0;
+}
+
+static
+int
+set_extent_decay(int idx, size_t value)
+{
+    extent_set_decay(value);
+    return 0;
+}
+
+
+
+/* ============================= LOOKUP ==================================== */
+/* Find the entry of the name, arena.N names store N in idx */
+static
+const ctl_entry*
+ctl_find(const char* name, int* idx)
+{
+    char key[64];
+    *idx = -1;
+
+    // replace the arena index with N
+    if (strncmp(name, "arena.", 6) == 0) {
+        char* end = NULL;
+        long nn = strtol(name + 6, &end, 10);
+
+        if (end == name + 6 || *end != '.' || nn < 0
+            || nn >= (long)liarena_count()) {
+            return NULL;
+        }
+
+        snprintf(key, sizeof(key), "arena.N%s", end);
+        name = key;
+        *idx = nn;
+    }
+
+    for (size_t ii = 0; ii < sizeof(entries) / sizeof(entries[0]); ++ii) {
+        if (strcmp(entries[ii].name, name) == 0) {
+            return &(entries[ii]);
+        }
+    }
+
+    return NULL;
+}
+
+/* Read and then write the named value */
+static
+int
+ctl_call(const char* name, void* oldp, size_t* oldlenp,
+         const void* newp, size_t newlen)
+{
+    int idx;
+    const ctl_entry* entry = ctl_find(name, &idx);
+
+    if (entry == NULL) {
+        return ENOENT;
+    }
+    if (oldp != NULL && (oldlenp == NULL || *oldlenp != sizeof(size_t))) {
+        return EINVAL;
+    }
+    if (newp != NULL && newlen != sizeof(size_t)) {
+        return EINVAL;
+    }
+    if (newp != NULL && entry->set == NULL) {
+        return EPERM;
+    }
+
+    // actions run even if nobody reads their result
+    if (oldp != NULL || entry->action) {
+        size_t value = 0;
+        int rv = entry->get(idx, &value);
+        if (rv != 0) {
+            return rv;
+        }
+        if (oldp != NULL) {
+            memcpy(oldp, &value, sizeof(value));
+        }
+    }
+
+    if (newp != NULL) {
+        size_t value;
+        memcpy(&value, newp, sizeof(value));
+        return entry->set(idx, value);
+    }
+
+    return 0;
+}
+
+
+
+/* ============================= CONFIG ==================================== */
+/* Parse a byte count with an optional k, m or g suffix */
+static
+int
+parse_size(const char* str, size_t* value)
+{
+    char* end = NULL;
+    errno = 0;
+    unsigned long long nn = strtoull(str, &end, 10);
+
+    if (end == str || errno != 0) {
+        return 0;
+    }
+
+    switch (*end) {
+    case 'k': case 'K': nn <<= 10; ++end; break;
+    case 'm': case 'M': nn <<= 20; ++end; break;
+    case 'g': case 'G': nn <<= 30; ++end; break;
+    }
+
+    *value = nn;
+    return *end == '\0';
+}
+
+/* Apply the name:value pairs of LIMALLOC_CONF */
+static
+void
+load_conf()
+{
+    const char* env = getenv("LIMALLOC_CONF");
+
+    if (env != NULL) {
+        char conf[CONF_MAX];
+        snprintf(conf, sizeof(conf), "%s", env);
+
+        char* save = NULL;
+        for (char* pair = strtok_r(conf, ",", &save); pair != NULL;
+             pair = strtok_r(NULL, ",", &save)) {
+
+            char* sep = strchr(pair, ':');
+            size_t value;
+
+            if (sep == NULL) {
+                dprintf(2, "limalloc: bad LIMALLOC_CONF entry \"%s\"\n", pair);
+                continue;
+            }
+
+            *sep = '\0';
+            if (!parse_size(sep + 1, &value)
+                || ctl_call(pair, NULL, NULL, &value, sizeof(value)) != 0) {
+                dprintf(2, "limalloc: bad LIMALLOC_CONF entry \"%s:%s\"\n",
+                        pair, sep + 1);
+            }
+        }
+    }
+
+    liclass_init();
+    atexit(print_at_exit);
+}
+
+/* Dump the state to stderr at exit if stats.print is set */
+static
+void
+print_at_exit()
+{
+    if (__atomic_load_n(&(li_config.stats_print), __ATOMIC_RELAXED)) {
+        lictl_dump(2);
+    }
+}
+
+
+
+/* ============================= CONTROL =================================== */
+/* Load LIMALLOC_CONF once, before the first arena is used */
+void
+lictl_init()
+{
+    pthread_once(&conf_once, load_conf);
+}
+
+/* Read the named value into oldp and then set it from newp, either may be
+ NULL. Returns 0 on success or an errno value */
+int
+lictl(const char* name, void* oldp, size_t* oldlenp,
+      const void* newp, size_t newlen)
+{
+    lictl_init();
+    return ctl_call(name, oldp, oldlenp, newp, newlen);
+}
+
+/* Write the configuration, totals and usage of every arena as JSON to fd */
+void
+lictl_dump(int fd)
+{
+    static const char* pools[] = { "default", "long" };
+
+    lictl_init();
+
+    size_t mapped = limapped();
+    size_t free = total_free();
+
+    dprintf(fd, "{\n  \"config\": {\"arenas.count\": %zu, \"arenas.max\": %zu, "
+                "\"arenas.migrate\": %zu, \"tcache.max\": %zu, "
+                "\"tcache.fill_size\": %zu, \"transfer.depth\": %zu, "
+                "\"arenas.pool_max\": %zu, "
+                "\"prewarm.bytes\": %zu, \"prewarm.classes\": %zu, "
+                "\"reserve.bytes\": %zu, \"background.enabled\": %zu, "
+                "\"background.interval_ms\": %zu, \"background.decay_ms\": %zu, "
+                "\"background.low_bytes\": %zu, \"hist.sample\": %zu, "
+                "\"classes.custom\": %d, \"pressure.limit\": %zu},\n",
+            liarena_count(), li_config.arena_max, li_config.migrate,
+            li_config.tcache_max, li_config.tcache_fill_size,
+            li_config.transfer_depth, li_config.pool_max, li_config.prewarm_bytes,
+            li_config.prewarm_classes, li_config.reserve_bytes,
+            li_config.background, li_config.background_interval_ms,
+            li_config.background_decay_ms, li_config.background_low_bytes,
+            li_config.hist_sample, li_classes_custom, lipressure_limit());
+
+    dprintf(fd, "  \"stats\": {\"mapped\": %zu, \"allocated\": %zu, "
+                "\"free\": %zu, \"migrations\": %zu, "
+                "\"background_wakeups\": %zu},\n",
+            mapped, (mapped > free) ? mapped - free : 0, free,
+            liarena_migrations(), libackground_wakeups());
+
+    litransfer_stats ts;
+    litransfer_stats_get(&ts);
+
+    dprintf(fd, "  \"transfer\": {\"batches\": %zu, \"spills\": %zu},\n",
+            ts.batches, ts.spills);
+
+    livm_stats vs;
+    livm_stats_get(&vs);
+
+    dprintf(fd, "  \"vm\": {\"reserved\": %zu, \"used\": %zu, "
+                "\"committed\": %zu, \"free\": %zu, \"fallbacks\": %zu, "
+                "\"merges\": %zu, \"decommit_fails\": %zu},\n",
+            vs.reserved, vs.used, vs.committed, vs.free_bytes, vs.fallbacks,
+            vs.merges, vs.decommit_fails);
+
+    dprintf(fd, "  \"epoch\": {\"current\": %zu, \"pending\": %zu, "
+                "\"reclaimed\": %zu},\n",
+            liepoch_current(), liepoch_pending(), liepoch_reclaimed());
+
+    extent_stats es;
+    extent_stats_get(&es);
+    size_t lookups = es.hits + es.misses;
+
+    dprintf(fd, "  \"extents\": {\"hits\": %zu, \"misses\": %zu, "
+                "\"hit_rate\": %.3f, \"cached_bytes\": %zu, "
+                "\"cached_count\": %zu, \"decayed_bytes\": %zu, "
+                "\"max_cached\": %zu, \"decay_ms\": %zu},\n",
+            es.hits, es.misses,
+            (lookups == 0) ? 0.0 : (double)es.hits / lookups,
+            es.cached_bytes, es.cached_count, es.decayed_bytes,
+            es.max_cached, es.decay_ms);
+
+    dprintf(fd, "  \"arenas\": [");
+
+    for (int aa = 0; aa < (int)liarena_count(); ++aa) {
+        liarena_stats stats;
+        liarena_stats_get(aa, &stats);
+
+        dprintf(fd, "%s\n    {\"index\": %d, \"threads\": %zu, \"orphaned\": %zu, "
+                    "\"pool\": %zu, \"empty_segments\": %zu, \"medium_segments\": %zu, "
+                    "\"medium_free_bytes\": %zu, \"lock_count\": %zu, "
+                    "\"lock_waits\": %zu, \"wait_ns\": %zu, \"reserve\": %zu, "
+                    "\"remote_frees\": %zu, \"buckets\": [",
+                (aa == 0) ? "" : ",", aa, stats.threads, stats.orphaned,
+                stats.pool, stats.empty_segments, stats.medium_segments,
+                stats.medium_free_bytes, stats.lock_count,
+                stats.lock_waits, stats.wait_ns, stats.reserve,
+                stats.remote_frees);
+
+        // only buckets that hold any memory
+        int first = 1;
+        for (int bb = 0; bb < 2 * LI_BUCKET_COUNT; ++bb) {
+            libucket_stats* bs = &(stats.buckets[bb]);
+            if (bs->segments == 0 && bs->free_chunks == 0) {
+                continue;
+            }
+
+            dprintf(fd, "%s\n      {\"pool\": \"%s\", \"chunk_size\": %zu, "
+                        "\"segments\": %zu, \"free_chunks\": %zu, "
+                        "\"free_bytes\": %zu, \"fresh_bytes\": %zu}",
+                    first ? "" : ",", pools[bb / LI_BUCKET_COUNT],
+                    bs->chunk_size, bs->segments, bs->free_chunks,
+                    bs->free_bytes, bs->fresh_bytes);
+            first = 0;
+        }
+
+        dprintf(fd, "%s]}", first ? "" : "\n    ");
+    }
+
+    dprintf(fd, "\n  ]\n}\n");
+}
@@ -0,0 +1,380 @@
+/*  LIMALLOC - lit malloc    */
+/*  by Oleksandr Litus       */
+
+/*  Epochs: deferred free for memory that readers may still be looking at.
+    Readers enclose every traversal in liepoch_enter and liepoch_exit, which
+    announce the global epoch the thread entered in. Writers unlink an object
+    and pass it to lifree_deferred, which batches it with the epoch it was
+    retired in. The global epoch only moves on once every thread inside a
+    traversal has announced the current one, so after two moves no reader
+    can hold a pointer to a batch and it is freed into the thread cache of
+    the thread that retired it. Batches left by exiting threads go to a list
+    of their arena and are freed by the next thread that reclaims. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "limalloc.h"
+#include "probe.h"
+
+
+/* ============================= GLOBALS =================================== */
+#define BATCH_SIZE 61
+
+// sealed batches a thread holds before it tries to move the epoch
+static const int     ADVANCE_BATCHES  = 2;
+
+/* Epoch announcement of a thread, records are reused once a thread exits */
+typedef struct epoch_rec {
+    struct epoch_rec*   next;
+    size_t              epoch;
+    int                 in_use;
+} epoch_rec;
+
+/* Objects retired by a thread, freed together */
+typedef struct retire_batch {
+    struct retire_batch*    next;
+    size_t                  epoch;
+    size_t                  count;
+    void*                   ptrs[BATCH_SIZE];
+} retire_batch;
+
+// epoch 0 marks a thread outside of any traversal
+static size_t           global_epoch  = 1;
+static epoch_rec*       records       = NULL;
+
+// batches of exited threads, by arena
+static pthread_mutex_t  orphans_lock  = PTHREAD_MUTEX_INITIALIZER;
+static retire_batch*    orphans[LI_ARENA_MAX];
+
+static size_t           retired_count   = 0;
+static size_t           reclaimed_count = 0;
+
+static __thread epoch_rec*      __rec     = NULL;
+static __thread int             __depth   = 0;
+static __thread retire_batch*   __open    = NULL;
+static __thread retire_batch*   __sealed  = NULL;
+static __thread retire_batch*   __last    = NULL;
+static __thread int             __sealed_count = 0;
+
+
+/* ============================= FUNCTIONS ================================= */
+static epoch_rec*    __get_rec();
+static int           try_advance();
+static size_t        free_batch(retire_batch* batch);
+static void          __seal();
+static size_t        __reclaim(size_t epoch);
+static size_t        reclaim_orphans(size_t epoch);
+
+void    liepoch_enter();
+void    liepoch_exit();
+void    lifree_deferred(void* ptr);
+size_t  liepoch_reclaim();
+size_t  liepoch_current();
+size_t  liepoch_pending();
+size_t  liepoch_reclaimed();
+void    liepoch_thread_exit();
+
+
+
+/* ============================= RECORDS =================================== */
+/* Record of the current thread, taking a free one or adding a new one */
+static
+epoch_rec*
+__get_rec()
+{
+    if (__rec != NULL) {
+        return __rec;
+    }
+
+    for (epoch_rec* rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE);
+         rec != NULL; rec = rec->next) {
+        int free = 0;
+        if (__atomic_compare_exchange_n(&(rec->in_use), &free, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            __rec = rec;
+            return rec;
+        }
+    }
+
+    // records are never freed, so readers of the list need no lock
+    epoch_rec* rec = limalloc(sizeof(epoch_rec));
+    rec->epoch  = 0;
+    rec->in_use = 1;
+    rec->next   = __atomic_load_n(&records, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&records, &(rec->next), rec, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+
+    __rec = rec;
+    return rec;
+}
+
+/* Move the global epoch on if every thread in a traversal has seen it.
+ Returns false if a thread is still in an older epoch */
+static
+int
+try_advance()
+{
+    size_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+
+    for (epoch_rec* rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE);
+         rec != NULL; rec = rec->next) {
+        size_t seen = __atomic_load_n(&(rec->epoch), __ATOMIC_SEQ_CST);
+        if (seen != 0 && seen != epoch) {
+            return 0;
+        }
+    }
+
+    __atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, 0,
+                                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+
+    PROBE1(limalloc, epoch_advance, epoch + 1);
+    return 1;
+}
+
+
+
+/* ============================= BATCHES =================================== */
+/* Free the objects of the batch and the batch itself, returns the count */
+static
+size_t
+free_batch(retire_batch* batch)
+{
+    size_t count = batch->count;
+
+    for (size_t ii = 0; ii < count; ++ii) {
+        lifree(batch->ptrs[ii]);
+    }
+    lifree((chunk*)batch);
+
+    return count;
+}
+
+/* Stamp the open batch with the current epoch and queue it for freeing.
+ Objects retired earlier are at least as old, so the stamp is safe */
+static
+void
+__seal()
+{
+    retire_batch* batch = __open;
+    if (batch == NULL) {
+        return;
+    }
+
+    __open = NULL;
+    batch->next  = NULL;
+    batch->epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+
+    // oldest batches first
+    if (__last == NULL) {
+        __sealed = batch;
+    }
+    else {
+        __last->next = batch;
+    }
+    __last = batch;
+    __sealed_count += 1;
+}
+
+/* Free the sealed batches no reader can reach once the global epoch is at
+ epoch, returns the count of objects freed */
+static
+size_t
+__reclaim(size_t epoch)
+{
+    size_t freed = 0;
+
+    while (__sealed != NULL && __sealed->epoch + 2 <= epoch) {
+        retire_batch* batch = __sealed;
+        __sealed = batch->next;
+        __sealed_count -= 1;
+        freed += free_batch(batch);
+    }
+
+    if (__sealed == NULL) {
+        __last = NULL;
+    }
+
+    return freed;
+}
+
+/* Free the batches exited threads left to their arenas. Every arena is
+ checked, one may have no threads left to reclaim its batches */
+static
+size_t
+reclaim_orphans(size_t epoch)
+{
+    retire_batch* ready = NULL;
+    int count = (int)liarena_count();
+
+    for (int aa = 0; aa < count; ++aa) {
+        if (__atomic_load_n(&(orphans[aa]), __ATOMIC_RELAXED) == NULL) {
+            continue;
+        }
+
+        pthread_mutex_lock(&orphans_lock);
+        retire_batch** link = &(orphans[aa]);
+        while (*link != NULL) {
+            retire_batch* batch = *link;
+            if (batch->epoch + 2 <= epoch) {
+                *link = batch->next;
+                batch->next = ready;
+                ready = batch;
+            }
+            else {
+                link = &(batch->next);
+            }
+        }
+        pthread_mutex_unlock(&orphans_lock);
+    }
+
+    size_t freed = 0;
+    while (ready != NULL) {
+        retire_batch* next = ready->next;
+        freed += free_batch(ready);
+        ready = next;
+    }
+
+    return freed;
+}
+
+
+
+/* ============================= EPOCHS ==================================== */
+/* Start a traversal, pointers read until the matching exit stay valid */
+void
+liepoch_enter()
+{
+    if (__depth++ > 0) {
+        return;
+    }
+
+    epoch_rec* rec = __get_rec();
+
+    // the announcement must be visible before any shared pointer is read
+    size_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+    __atomic_store_n(&(rec->epoch), epoch, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* End a traversal, pointers read inside it may be freed from now on */
+void
+liepoch_exit()
+{
+    assert(__depth > 0);
+
+    if (--__depth > 0) {
+        return;
+    }
+
+    __atomic_store_n(&(__rec->epoch), 0, __ATOMIC_RELEASE);
+}
+
+/* Free ptr once no traversal that might have seen it is running. The
+ object must already be unreachable for new traversals */
+void
+lifree_deferred(void* ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    __get_rec();
+
+    if (__open == NULL) {
+        __open = limalloc(sizeof(retire_batch));
+        __open->count = 0;
+    }
+
+    __open->ptrs[__open->count++] = ptr;
+    __atomic_add_fetch(&retired_count, 1, __ATOMIC_RELAXED);
+
+    if (__open->count < BATCH_SIZE) {
+        return;
+    }
+
+    __seal();
+
+    if (__sealed_count >= ADVANCE_BATCHES) {
+        liepoch_reclaim();
+    }
+}
+
+/* Seal the objects retired so far, try to move the epoch on and free
+ whatever became unreachable. Returns the count of objects freed, a thread
+ inside a traversal frees nothing */
+size_t
+liepoch_reclaim()
+{
+    if (__depth > 0) {
+        return 0;
+    }
+
+    __seal();
+
+    // a batch sealed now is free after two moves
+    if (try_advance()) {
+        try_advance();
+    }
+
+    size_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    size_t freed = __reclaim(epoch) + reclaim_orphans(epoch);
+
+    __atomic_add_fetch(&reclaimed_count, freed, __ATOMIC_RELAXED);
+    return freed;
+}
+
+/* Current global epoch */
+size_t
+liepoch_current()
+{
+    return __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+}
+
+/* Objects retired and not freed yet, by all threads */
+size_t
+liepoch_pending()
+{
+    return __atomic_load_n(&retired_count, __ATOMIC_RELAXED) -
+           __atomic_load_n(&reclaimed_count, __ATOMIC_RELAXED);
+}
+
+/* Objects freed by reclamation so far */
+size_t
+liepoch_reclaimed()
+{
+    return __atomic_load_n(&reclaimed_count, __ATOMIC_RELAXED);
+}
+
+/* Hand the batches of the exiting thread to its arena and free its record */
+void
+liepoch_thread_exit()
+{
+    if (__rec == NULL) {
+        return;
+    }
+
+    liepoch_reclaim();
+
+    int idx = liarena_index();
+    if (__sealed != NULL && idx >= 0) {
+        pthread_mutex_lock(&orphans_lock);
+        __last->next = orphans[idx];
+        orphans[idx] = __sealed;
+        pthread_mutex_unlock(&orphans_lock);
+    }
+
+    __sealed = NULL;
+    __last = NULL;
+    __sealed_count = 0;
+
+    __atomic_store_n(&(__rec->epoch), 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&(__rec->in_use), 0, __ATOMIC_RELEASE);
+    __rec = NULL;
+    __depth = 0;
+}
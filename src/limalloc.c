@@ -3,60 +3,270 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
 #include <sys/mman.h>
 #include <assert.h>
 #include <string.h>
+#include <time.h>
 #include <pthread.h>
 
 #include "limalloc.h"
+#include "extent.h"
+#include "probe.h"
 
 
 /* ============================= GLOBALS =================================== */
-#define ARENA_COUNT 8
+#define SEGMENT_SHIFT   20
+#define MAP_LEAF_BITS   14
+#define MAP_ROOT_BITS   14
 
 static const size_t  CHUNK_SIZE       = sizeof(chunk);
 static const size_t  BLOCK_SIZE       = sizeof(block);
+static const size_t  SEG_HEADER_SIZE  = 32;
+static const size_t  SHORT_HEADER_SIZE = 32;
 static const size_t  OVERHEAD_SIZE    = sizeof(size_t);
-static const size_t  MEM_PAGE_SIZE    = 1024 * 1024;
+static const size_t  MEM_PAGE_SIZE    = LI_SEGMENT_SIZE;
 static const size_t  PAGE_SIZE        = 4096;
-static const size_t  MAX_BUCKET_SIZE  = 8192;
-static const int     BUCKET_COUNT     = 11;
 
-static int FISRT_RUN = 1;
+static const int     TCACHE_FILL      = 32;
+
+// segment classes are bucket indexes, long and short lived ones follow
+static const int     LONG_CLASS       = LI_BUCKET_COUNT;
+static const int     SHORT_CLASS      = 2 * LI_BUCKET_COUNT;
+static const int     MEDIUM_CLASS     = 3 * LI_BUCKET_COUNT;
+
+static const int     MEDIUM_MASK_WORDS = (LI_MEDIUM_CLASSES + 63) / 64;
+
+// live count bias of a segment still carved by its thread
+static const size_t  SHORT_BIAS       = (size_t)1 << 62;
+
+// a thread moves to another arena once MIGRATE_WAITS of its last
+// MIGRATE_WINDOW locks of its arena had to wait
+static const int     MIGRATE_WINDOW   = 64;
+static const int     MIGRATE_WAITS    = 16;
+
+/* Short lived segment a thread is carving chunks of one bucket from */
+typedef struct short_run {
+    short_seg*  seg;
+    char*       cur;
+    char*       end;
+    size_t      count;
+    int         fresh;
+} short_run;
+
+/* Batch of chunks in the transfer cache, linked through the chunks. The
+ first chunk keeps the count, every standard chunk has room for it */
+typedef struct transfer_batch {
+    chunk*  next;
+    size_t  count;
+} transfer_batch;
 
 static __thread arena*   __arena    = NULL;
 static __thread bucket*  __bucket   = NULL;
 
-static arena arenas[ARENA_COUNT];
+// set while the thread holds the lock of its arena
+static __thread int      __arena_held = 0;
+
+// locks of the thread arena in the current window, and how many waited
+static __thread int      __lock_count = 0;
+static __thread int      __lock_waits = 0;
+
+// set when the arena was contended, the thread moves on its next refill
+static __thread int      __migrate    = 0;
+
+// leading bytes of the last chunk that may hold non-zero data
+static __thread size_t   __dirty    = 0;
+
+static __thread short_run __short[LI_BUCKET_COUNT];
+
+__thread tcache __tcache;
+
+#define BUCKET_INIT(bb) { NULL, NULL, ((bb) == 0) ? 0 : (8 << (bb)), NULL, NULL, 0 }
+
+#define BUCKETS_INIT                                                        \
+    BUCKET_INIT(0), BUCKET_INIT(1), BUCKET_INIT(2), BUCKET_INIT(3),         \
+    BUCKET_INIT(4), BUCKET_INIT(5), BUCKET_INIT(6), BUCKET_INIT(7),         \
+    BUCKET_INIT(8), BUCKET_INIT(9), BUCKET_INIT(10)
+
+#define ARENA_INIT {                                                        \
+    PTHREAD_MUTEX_INITIALIZER,                                              \
+    { BUCKETS_INIT, BUCKETS_INIT },                                         \
+    0, 0, NULL, 0, 0, { NULL }, { 0 }, NULL, 0, 0, 0, 0, NULL, 0, NULL, 0   \
+}
+
+// defaults, pool_max is the number of empty segments an arena keeps for
+// any bucket or short lived run, the rest is unmapped. prewarm_classes
+// has bit bb set for every bucket bb to prewarm, all standard buckets by
+// default
+liconfig li_config = {
+    .arena_count      = 8,
+    .tcache_max       = 64,
+    .tcache_fill_size = 16 * 1024,
+    .pool_max         = 4,
+    .stats_print      = 0,
+    .arena_max        = 32,
+    .migrate          = 1,
+    .prewarm_bytes    = 0,
+    .prewarm_classes  = 0x7fe,
+    .reserve_bytes    = 0,
+    .background       = 0,
+    .background_interval_ms = 10,
+    .background_decay_ms    = 1000,
+    .background_low_bytes   = 16 * 1024,
+    .transfer_depth         = 8,
+    .vm_reserve             = LI_VM_RESERVE_MAX,
+};
+
+// arenas need no run time initialization, li_config.arena_count are used
+// and contention may grow the count up to li_config.arena_max
+static arena arenas[LI_ARENA_MAX] = { [0 ... LI_ARENA_MAX - 1] = ARENA_INIT };
+
+// guards thread counts and orphan flags of the arenas
+static pthread_mutex_t  arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// set once the first thread is bound, from then on the arena count only grows
+static int              arenas_started = 0;
+
+// threads moved off contended arenas
+static size_t           arena_migrations = 0;
+
+// thread exit hook, its value is the arena of the thread
+static pthread_key_t    thread_key;
+static pthread_once_t   init_once = PTHREAD_ONCE_INIT;
+
+// bytes mapped for segments and big blocks
+static size_t mapped_bytes = 0;
+
+// segment address to segment class, 0 for memory outside of segments.
+// Segments of the reserved range have a slot in a flat table, the tree
+// only holds segments mapped outside of it
+static uint8_t          vm_map[LI_VM_RESERVE_MAX >> SEGMENT_SHIFT];
+static uint8_t*         seg_map[1 << MAP_ROOT_BITS];
+static pthread_mutex_t  seg_map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// chunk size of every bucket, and the bucket of every 16 byte step, slot
+// ss holds the sizes up to ss * 16. Both start out as the powers of two
+// and a loaded class table replaces them
+size_t  li_class_sizes[LI_BUCKET_COUNT] = {
+    0, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192
+};
+uint8_t li_class_index[LI_CLASS_SLOTS] = {
+    [0 ... 1] = 1, [2] = 2, [3 ... 4] = 3, [5 ... 8] = 4, [9 ... 16] = 5,
+    [17 ... 32] = 6, [33 ... 64] = 7, [65 ... 128] = 8, [129 ... 256] = 9,
+    [257 ... 512] = 10
+};
+int     li_classes_custom = 0;
+
+// batches of freed chunks traded between thread caches without the arena
+// locks, a slot is filled or emptied by one atomic operation. Spills are
+// counted on the way to an arena lock, trades only by probes
+static chunk*           transfer[LI_BUCKET_COUNT][LI_TRANSFER_SLOTS];
+static size_t           transfer_spills = 0;
 
 
 /* ============================= FUNCTIONS ================================= */
 static size_t div_up(size_t aa, size_t bb);
-static void init_malloc();
+static long   now_ns();
+static size_t class_chunk_size(int cls);
+
+static void seg_map_set(void* seg, int bb);
+static void seg_map_range(void* seg, size_t size, int bb);
+static int  seg_map_get(void* ptr);
+static page* map_segment(size_t size, int cls);
+static void unmap_segment(void* seg, size_t size);
+static void populate_segment(void* seg, size_t size);
 
 static int arena_trylock(arena* arena_ptr);
+static int arena_lock(arena* arena_ptr);
 
+static void __lock_arena();
 static void __unlock_arena();
 static void __assign_arena();
+static void __migrate_arena();
+static void limalloc_init();
+static void thread_exit(void* arena_ptr);
+
+static void list_splice(void** dst, void** src);
+static int  __adopt_orphans(int bb);
 static void __choose_bucket(size_t size);
-static void __find_bucket(chunk* ptr);
 
-static chunk* block_slice();
+static chunk* bump_chunk();
+static page*  page_of(void* ptr);
+static void   __seg_take(chunk* ptr);
+static void   seg_give(arena* arena_ptr, bucket* bucket_ptr, chunk* ptr);
+static void   __seg_give(bucket* bucket_ptr, chunk* ptr);
+static void   remote_push(arena* owner, chunk* head, chunk* tail, size_t count);
+static size_t drain_remote(arena* arena_ptr);
 
-static chunk* pop_big_block(size_t size);
 static chunk* allocate_big_block(size_t size);
 static chunk* pop_chunk();
+static page*  __reserve_take();
+static page*  __pool_take();
+static int    reclaim_segments(arena* arena_ptr);
+static void   trim_pool(arena* arena_ptr);
 static chunk* allocate_page();
 
+static medium_seg* medium_seg_of(void* ptr);
+static void   medium_set_run(medium_seg* seg, size_t start, size_t pages, int free);
+static void   medium_push(arena* arena_ptr, medium_seg* seg, size_t start, size_t pages);
+static void   medium_remove(arena* arena_ptr, medium_seg* seg, size_t start);
+static int    medium_find(arena* arena_ptr, int cls);
+static void   __medium_segment();
+static chunk* __medium_alloc(size_t size);
+static void   medium_release(arena* arena_ptr, medium_seg* seg);
+static void   medium_free(chunk* ptr);
+static size_t medium_size(chunk* ptr);
+
+static chunk* __refill_bin(int bb);
+static void   __flush_bin(int bb, int keep);
+
+static int    transfer_put(int bb, int count);
+static chunk* transfer_get(int bb);
+static void   transfer_drain();
+
+static void   __short_open(short_run* run, int bb);
+static void   short_retire(short_run* run);
+static void   short_release(short_seg* seg);
+static chunk* short_alloc(size_t size);
+
 static chunk* get_chunk(size_t size);
 void* limalloc(size_t size);
 
-static void clean_bucket();
 static void free_chunk(chunk* ptr);
 void lifree(chunk* ptr);
 
 void* lirealloc(chunk* prev_ptr, size_t new_size);
 
+void* licalloc(size_t count, size_t size);
+void* limalloc_flags(size_t size, int flags);
+
+void* lisegment_map(size_t size);
+void  lisegment_unmap(void* ptr, size_t size);
+
+static size_t purge_arena(arena* arena_ptr);
+size_t lipurge();
+size_t limapped();
+
+static void   carve_segment(arena* arena_ptr, int bb);
+static size_t fill_reserve(arena* arena_ptr, size_t reserve);
+static size_t prewarm_arena(arena* arena_ptr, size_t bytes, size_t classes,
+                            size_t reserve);
+size_t limalloc_prewarm(size_t bytes_per_class);
+
+int    liarena_set_count(size_t count);
+int    liarena_set_classes(const size_t* sizes, int count);
+int    liarena_index();
+void   liarena_stats_get(int idx, liarena_stats* stats);
+size_t liarena_count();
+size_t liarena_migrations();
+size_t liarena_purge(int idx);
+size_t liarena_drain(int idx);
+size_t liarena_refill(int idx, size_t low_bytes);
+size_t liarena_activity(int idx);
+void   litcache_flush();
+void   litransfer_stats_get(litransfer_stats* stats);
+
 
 
 /* ============================= UTILS ===================================== */
@@ -68,27 +278,170 @@ div_up(size_t aa, size_t bb)
     return ((aa - 1) / bb) + 1;
 }
 
+/* Monotonic time in nanoseconds */
+static
+long
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Chunk size of the segment class, 0 for big allocations */
+static
+size_t
+class_chunk_size(int cls)
+{
+    return li_class_sizes[cls % LI_BUCKET_COUNT];
+}
 
-/* Initialize all structs in malloc */
+
+
+/* ============================= SEGMENT MAP =============================== */
+/* Record the bucket index of the segment */
 static
 void
-init_malloc()
+seg_map_set(void* seg, int bb)
 {
-    for (int aa = 0; aa < ARENA_COUNT; ++aa) {
-        
-        // initialize mutex lock in each arena
-        pthread_mutex_init(&(arenas[aa].lock), NULL);
-        
-        // initialize all buckets
-        for (int bb = 0; bb < BUCKET_COUNT; ++bb) {
-            arenas[aa].buckets[bb].chunk_head = NULL;
-            arenas[aa].buckets[bb].block_head = NULL;
-            arenas[aa].buckets[bb].page_head = NULL;
-            arenas[aa].buckets[bb].chunk_size = (8 << bb);
-        }
+    // the range is reserved before its first segment is handed out
+    size_t off = (uintptr_t)seg - (uintptr_t)__atomic_load_n(&li_vm_base, __ATOMIC_RELAXED);
+    if (off < __atomic_load_n(&li_vm_size, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&(vm_map[off >> SEGMENT_SHIFT]), (uint8_t)bb, __ATOMIC_RELAXED);
+        return;
+    }
+
+    uintptr_t key  = ((uintptr_t)seg) >> SEGMENT_SHIFT;
+    uintptr_t root = key >> MAP_LEAF_BITS;
+    uintptr_t leaf = key & ((1 << MAP_LEAF_BITS) - 1);
+    assert(root < (1 << MAP_ROOT_BITS));
+
+    pthread_mutex_lock(&seg_map_lock);
+
+    // leaves are mapped on first use and never released
+    uint8_t* leaf_ptr = seg_map[root];
+    if (leaf_ptr == NULL) {
+        leaf_ptr = mmap(NULL, 1 << MAP_LEAF_BITS,
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1, 0);
+        assert(leaf_ptr != MAP_FAILED);
+        __atomic_store_n(&(seg_map[root]), leaf_ptr, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&(leaf_ptr[leaf]), (uint8_t)bb, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&seg_map_lock);
+}
+
+/* Record the class of every segment of a bigger mapping */
+static
+void
+seg_map_range(void* seg, size_t size, int bb)
+{
+    for (size_t off = 0; off < size; off += MEM_PAGE_SIZE) {
+        seg_map_set(((char*)seg) + off, bb);
+    }
+}
+
+/* Find the bucket index of the segment holding ptr, 0 if there is none */
+static
+int
+seg_map_get(void* ptr)
+{
+    size_t off = (uintptr_t)ptr - (uintptr_t)__atomic_load_n(&li_vm_base, __ATOMIC_RELAXED);
+    if (off < __atomic_load_n(&li_vm_size, __ATOMIC_RELAXED)) {
+        return __atomic_load_n(&(vm_map[off >> SEGMENT_SHIFT]), __ATOMIC_RELAXED);
+    }
+
+    uintptr_t key  = ((uintptr_t)ptr) >> SEGMENT_SHIFT;
+    uintptr_t root = key >> MAP_LEAF_BITS;
+    uintptr_t leaf = key & ((1 << MAP_LEAF_BITS) - 1);
+
+    if (root >= (1 << MAP_ROOT_BITS)) {
+        return 0;
+    }
+
+    uint8_t* leaf_ptr = __atomic_load_n(&(seg_map[root]), __ATOMIC_ACQUIRE);
+    if (leaf_ptr == NULL) {
+        return 0;
+    }
+
+    return __atomic_load_n(&(leaf_ptr[leaf]), __ATOMIC_RELAXED);
+}
+
+/* Map a segment of size bytes, a multiple of MEM_PAGE_SIZE, aligned to
+ its own size. cls is the segment class it is mapped for */
+static
+page*
+map_segment(size_t size, int cls)
+{
+    assert(((size_t)1 << SEGMENT_SHIFT) == MEM_PAGE_SIZE);
+    assert(size % MEM_PAGE_SIZE == 0);
+    
+    lipressure_check(size);
+
+    // carved from the reserved range when there is room left
+    char* ptr = livm_map(size);
+    if (ptr != NULL) {
+        __atomic_add_fetch(&mapped_bytes, size, __ATOMIC_RELAXED);
+        PROBE3(limalloc, segment_map, size, cls, liarena_index());
+        return (page*)ptr;
+    }
+
+    // map twice the size and trim the unaligned ends
+    char* raw = mmap(NULL, 2 * size,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1, 0);
+    assert(raw != MAP_FAILED);
+
+    uintptr_t mask = size - 1;
+    ptr = (char*)(((uintptr_t)raw + mask) & ~mask);
+
+    if (ptr > raw) {
+        munmap(raw, ptr - raw);
+    }
+    if (ptr + size < raw + 2 * size) {
+        munmap(ptr + size, raw + size - ptr);
+    }
+    
+    __atomic_add_fetch(&mapped_bytes, size, __ATOMIC_RELAXED);
+    
+    PROBE3(limalloc, segment_map, size, cls, liarena_index());
+
+    return (page*)ptr;
+}
+
+/* Give a segment back to the system and forget its class */
+static
+void
+unmap_segment(void* seg, size_t size)
+{
+    PROBE2(limalloc, segment_unmap, size, seg_map_get(seg));
+    
+    seg_map_range(seg, size, 0);
+    if (!livm_unmap(seg, size)) {
+        munmap(seg, size);
     }
+    __atomic_sub_fetch(&mapped_bytes, size, __ATOMIC_RELAXED);
+}
+
+/* Fault in every page of a fresh segment, so first touches do not trap */
+static
+void
+populate_segment(void* seg, size_t size)
+{
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(seg, size, MADV_POPULATE_WRITE) == 0) {
+        return;
+    }
+#endif
     
-    FISRT_RUN = 0;
+    // older kernels, write to every page
+    for (size_t off = 0; off < size; off += PAGE_SIZE) {
+        ((volatile char*)seg)[off] = 0;
+    }
 }
 
 
@@ -103,6 +456,54 @@ arena_trylock(arena* arena_ptr)
     return pthread_mutex_trylock(&(arena_ptr->lock)) == 0;
 }
 
+/* Lock the given arena, waits on a held lock are counted and traced.
+ Returns true if the lock was held by another thread */
+static
+int
+arena_lock(arena* arena_ptr)
+{
+    assert(arena_ptr != NULL);
+    
+    if (arena_trylock(arena_ptr)) {
+        arena_ptr->lock_count += 1;
+        return 0;
+    }
+    
+    PROBE1(limalloc, lock_wait, (int)(arena_ptr - arenas));
+    
+    long start = now_ns();
+    pthread_mutex_lock(&(arena_ptr->lock));
+    long waited = now_ns() - start;
+    
+    PROBE2(limalloc, lock_acquired, (int)(arena_ptr - arenas), waited);
+    
+    arena_ptr->lock_count += 1;
+    arena_ptr->lock_waits += 1;
+    arena_ptr->wait_ns    += waited;
+    return 1;
+}
+
+
+/* Lock the thread arena */
+static
+void
+__lock_arena()
+{
+    assert(__arena != NULL);
+    int waited = arena_lock(__arena);
+    __arena_held = 1;
+    
+    // judge the contention of the arena over a window of locks
+    __lock_count += 1;
+    __lock_waits += waited;
+    if (__lock_count == MIGRATE_WINDOW) {
+        __migrate = __lock_waits >= MIGRATE_WAITS
+                    && __atomic_load_n(&(li_config.migrate), __ATOMIC_RELAXED);
+        __lock_count = 0;
+        __lock_waits = 0;
+    }
+}
+
 
 /* Unlock the thread arena */
 static
@@ -110,6 +511,7 @@ void
 __unlock_arena()
 {
     assert(__arena != NULL);
+    __arena_held = 0;
     pthread_mutex_unlock(&(__arena->lock));
 }
 
@@ -119,172 +521,254 @@ static
 void
 __assign_arena()
 {
-    // go through the arena array and find unlocked arena, assign thread to it
-    for (int aa = 0; aa < ARENA_COUNT; ++aa) {
-        
-        arena* curr = &(arenas[aa]);
-        if (arena_trylock(curr)) {
-            __arena = curr;
-            assert(__arena != NULL);
+    pthread_once(&init_once, limalloc_init);
+    
+    pthread_mutex_lock(&arenas_lock);
+    arenas_started = 1;
+    int count = li_config.arena_count;
+    
+    // prefer orphaned arena, its memory is ready to use
+    arena* best = NULL;
+    for (int aa = 0; aa < count; ++aa) {
+        if (arenas[aa].orphaned) {
+            best = &(arenas[aa]);
             break;
         }
     }
+    
+    // otherwise share the arena with the fewest threads, the least
+    // contended one of those
+    if (best == NULL) {
+        best = &(arenas[0]);
+        for (int aa = 1; aa < count; ++aa) {
+            arena* curr = &(arenas[aa]);
+            if (curr->threads < best->threads
+                || (curr->threads == best->threads
+                    && __atomic_load_n(&(curr->lock_waits), __ATOMIC_RELAXED)
+                       < __atomic_load_n(&(best->lock_waits), __ATOMIC_RELAXED))) {
+                best = curr;
+            }
+        }
+    }
+    
+    best->threads += 1;
+    __atomic_store_n(&(best->orphaned), 0, __ATOMIC_RELAXED);
+    
+    pthread_mutex_unlock(&arenas_lock);
+    
+    PROBE2(limalloc, arena_assign, (int)(best - arenas), best->threads);
+    
+    __arena = best;
+    assert(__arena != NULL);
+    
+    // release the arena when the thread exits
+    pthread_setspecific(thread_key, __arena);
 }
 
-
-
-/* ============================= BUCKET ==================================== */
-/* Chooses bucket for the allocation and assigns it to global __bucket */
+/* Move the thread off its contended arena to one with fewer threads,
+ adding an arena if all of them are as busy. The thread cache moves along,
+ when it is flushed, chunks from segments of the old arena go to the
+ remote queue of that arena, as for any segment another arena owns */
 static
 void
-__choose_bucket(size_t size)
+__migrate_arena()
 {
-    assert(size >= CHUNK_SIZE);
     assert(__arena != NULL);
+    assert(!__arena_held);
     
-    // traverse through buckets untill you find apropriate size
-    for (int bb = 1; bb < 11; ++bb) {
-        
-        bucket* curr = &(__arena->buckets[bb]);
-        if (size <= curr->chunk_size) {
-            __bucket = curr;
-            assert(__bucket != NULL);
-            return;
+    __migrate = 0;
+    
+    pthread_mutex_lock(&arenas_lock);
+    int count = li_config.arena_count;
+    
+    // only an arena that ends up less loaded than the current one helps
+    arena* best = NULL;
+    for (int aa = 0; aa < count; ++aa) {
+        arena* curr = &(arenas[aa]);
+        if (curr->threads + 1 < __arena->threads
+            && (best == NULL || curr->threads < best->threads)) {
+            best = curr;
         }
     }
     
-    // otherwise, big bucket is chosen
-    __bucket = &(__arena->buckets[0]);
-    assert(__bucket != NULL);
+    // every arena is shared as much, grow the arena count
+    size_t arena_max = __atomic_load_n(&(li_config.arena_max), __ATOMIC_RELAXED);
+    if (best == NULL && __arena->threads > 1
+        && count < LI_ARENA_MAX && (size_t)count < arena_max) {
+        best = &(arenas[count]);
+        __atomic_store_n(&(li_config.arena_count), count + 1, __ATOMIC_RELEASE);
+    }
+    
+    if (best != NULL) {
+        __arena->threads -= 1;
+        best->threads += 1;
+        __atomic_store_n(&(best->orphaned), 0, __ATOMIC_RELAXED);
+        arena_migrations += 1;
+    }
+    
+    pthread_mutex_unlock(&arenas_lock);
+    
+    if (best == NULL) {
+        return;
+    }
+    
+    PROBE2(limalloc, arena_migrate, (int)(__arena - arenas), (int)(best - arenas));
+    
+    __arena = best;
+    __bucket = NULL;
+    pthread_setspecific(thread_key, __arena);
 }
 
-/* Finds original bucket of the chunk, and assigns it to the __bucket */
+
+/* Load the configuration and create the key used for the thread exit hook */
 static
 void
-__find_bucket(chunk* ptr)
+limalloc_init()
 {
-    assert(__arena != NULL);
+    lictl_init();
     
-    char* char_ptr = (char*)ptr;
+    int rv = pthread_key_create(&thread_key, thread_exit);
+    assert(rv == 0);
     
-    for (int bb = 1; bb < BUCKET_COUNT; ++bb) {
-        
-        bucket* curr = &(__arena->buckets[bb]);
-        
-        page* curr_page = curr->page_head;
-        while (curr_page != NULL) {
-            
-            chunk* start = (chunk*)curr_page;
-            chunk* end = (chunk*)((char*)curr_page + MEM_PAGE_SIZE);
-            
-            if (ptr > start && ptr < end) {
-                __bucket = curr;
-                return;
-            }
-            
-            curr_page = curr_page->next;
-        }
+    // LIMALLOC_CONF asked for warm arenas
+    if (li_config.prewarm_bytes > 0 || li_config.reserve_bytes > 0) {
+        limalloc_prewarm(li_config.prewarm_bytes);
     }
-    
-    // otherwise it is a big allocation
-    __bucket = &(__arena->buckets[0]);
 }
 
 
-/* ============================ SLICING ==================================== */
-/* Slice of a chunk from the first block in the bucket,
- push the rest into either block list or chunk list */
+/* Thread exit hook, flush thread state and release the arena */
 static
-chunk*
-block_slice()
+void
+thread_exit(void* arena_ptr)
 {
-    assert(__bucket != NULL);
-    assert(__arena != NULL);
-    assert(__bucket->block_head != NULL);
-    
-    chunk* ptr          = (chunk*)__bucket->block_head;
-    block* old_block    = __bucket->block_head;
-
-    int old_block_size  = old_block->size;
-    int chunk_size      = __bucket->chunk_size;
-    int new_size        = old_block_size - chunk_size;
+    assert(arena_ptr == __arena);
     
+    liregion_purge();
+    licache_thread_exit();
+    liepoch_thread_exit();
     
-    // after slicing, new block is too small
-    if (new_size < chunk_size) {
-        __bucket->block_head = old_block->next;
+    for (int bb = 1; bb < LI_BUCKET_COUNT; ++bb) {
+        short_retire(&(__short[bb]));
     }
-     
-    // after slicing, new block is a chunk
-    else if (new_size == chunk_size) {
-        __bucket->block_head = old_block->next;
-        __bucket->chunk_head = (chunk*)(((char*)old_block) + chunk_size);
+    
+    // give the thread cache back to the arena
+    __lock_arena();
+    for (int bb = 1; bb < LI_BUCKET_COUNT; ++bb) {
+        __flush_bin(bb, 0);
     }
+    __unlock_arena();
     
-    // after slicing, new block is a smaller block
-    else {
-        __bucket->block_head = (block*)(((char*)old_block) + chunk_size);
-        __bucket->block_head->size = new_size;
+    // arena without threads can be adopted with all of its memory
+    pthread_mutex_lock(&arenas_lock);
+    __arena->threads -= 1;
+    if (__arena->threads == 0) {
+        __atomic_store_n(&(__arena->orphaned), 1, __ATOMIC_RELAXED);
     }
-
-    return ptr;
+    pthread_mutex_unlock(&arenas_lock);
+    
+    __arena = NULL;
+    __bucket = NULL;
 }
 
 
-
-/* ============================ BIG ALLOCATION ============================= */
-/* Try to pop big block from the bucket */
+/* Prepend the singly-linked list src to dst, both start with next pointer */
 static
-chunk*
-pop_big_block(size_t size)
+void
+list_splice(void** dst, void** src)
 {
-    assert(size >= BLOCK_SIZE);
-    assert(__bucket != NULL);
-    assert(__arena != NULL);
-    
-    chunk* user_ptr = NULL;
-    block* ptr = NULL;
-    block* head = __bucket->block_head;
-    
-    // bucket is empty, head is NULL
-    if (head == NULL) {
-        return NULL;
+    if (*src == NULL) {
+        return;
     }
     
-    // head can be used
-    if (size <= head->size) {
-        ptr = head;
-        __bucket->block_head = head->next;
-        user_ptr = (chunk*)(((char*)ptr) + OVERHEAD_SIZE);
-        return user_ptr;
+    void** tail = *src;
+    while (*tail != NULL) {
+        tail = *tail;
     }
     
-    // traverse through the list of blocks to find big enough block
-    block* prev = NULL;
-    block* curr = head;
-    while (curr != NULL && size > curr->size) {
-        prev = curr;
-        curr = curr->next;
-    }
+    *tail = *dst;
+    *dst = *src;
+    *src = NULL;
+}
+
+
+/* Move free memory of bucket bb from orphaned arenas into the thread arena,
+ the thread arena is locked. Returns true if anything was adopted */
+static
+int
+__adopt_orphans(int bb)
+{
+    assert(__arena != NULL);
     
-    assert(prev != NULL);
+    int found = 0;
+    bucket* dst = &(__arena->buckets[bb]);
     
-    // chunk was found
-    if (curr != NULL) {
+    int count = __atomic_load_n(&(li_config.arena_count), __ATOMIC_ACQUIRE);
+    for (int aa = 0; aa < count; ++aa) {
+        
+        arena* curr = &(arenas[aa]);
+        if (curr == __arena || !__atomic_load_n(&(curr->orphaned), __ATOMIC_RELAXED)) {
+            continue;
+        }
+        
+        // never wait on another arena while holding our own
+        if (!arena_trylock(curr)) {
+            continue;
+        }
+        
+        if (curr->orphaned) {
+            // chunks freed to the orphan by other threads come along
+            drain_remote(curr);
+            
+            bucket* src = &(curr->buckets[bb]);
+            found |= src->chunk_head != NULL || src->cur != NULL;
+            
+            list_splice((void**)&(dst->chunk_head), (void**)&(src->chunk_head));
+            
+            // segments change owner along with their empty counts
+            for (page* seg = src->page_head; seg != NULL; seg = seg->next) {
+                seg->owner = __arena;
+                if (seg->empty) {
+                    curr->empty_count -= 1;
+                    __arena->empty_count += 1;
+                }
+            }
+            list_splice((void**)&(dst->page_head), (void**)&(src->page_head));
+            
+            // take over fresh space of the orphan if we have none, its
+            // segment is ours now, so the orphan can not carve it further
+            if (dst->cur == NULL && src->cur != NULL) {
+                dst->cur = src->cur;
+                dst->end = src->end;
+                dst->cur_dirty = src->cur_dirty;
+            }
+            src->cur = NULL;
+            src->end = NULL;
+        }
         
-        // cut out the found block
-        prev->next = curr->next;
-        ptr = curr;
+        pthread_mutex_unlock(&(curr->lock));
     }
     
-    // cast bucket into chunk for the user
-    if (ptr != NULL) {
-        user_ptr = (chunk*)(((char*)ptr) + OVERHEAD_SIZE);
-    }
+    return found;
+}
+
+
+
+/* ============================= BUCKET ==================================== */
+/* Chooses bucket for the allocation and assigns it to global __bucket */
+static
+void
+__choose_bucket(size_t size)
+{
+    assert(size >= CHUNK_SIZE);
+    assert(__arena != NULL);
     
-    return user_ptr;
+    __bucket = &(__arena->buckets[li_bucket_index(size)]);
+    assert(__bucket != NULL);
 }
 
+
+/* ============================ BIG ALLOCATION ============================= */
 /* Allocate big block of teh given size */
 static
 chunk*
@@ -292,21 +776,27 @@ allocate_big_block(size_t size)
 {
     assert(size >= BLOCK_SIZE);
     
-    // calc number of pages to allocate
-    int page_count = div_up(size, PAGE_SIZE);
+    // calc number of pages to allocate, including the size header
+    size_t page_count = div_up(size + OVERHEAD_SIZE, PAGE_SIZE);
     
     // calc allocation size
     size_t alloc_size = page_count * PAGE_SIZE;
     
-    // allocate block
-    block* ptr = mmap(NULL, alloc_size,
-                      PROT_READ | PROT_WRITE,
-                      MAP_PRIVATE | MAP_ANONYMOUS,
-                      -1, 0);
-    assert(ptr != MAP_FAILED);
+    lipressure_check(alloc_size);
+    
+    // allocate block, an extent from the cache may be bigger
+    int fresh;
+    block* ptr = extent_map(alloc_size, &alloc_size, &fresh);
+    
+    __atomic_add_fetch(&mapped_bytes, alloc_size, __ATOMIC_RELAXED);
     
-    // add size info to start of the block
-    ptr->size = size;
+    PROBE3(limalloc, big_map, alloc_size, fresh, (int)(__arena - arenas));
+    
+    // fresh mapping is zeroed by the kernel
+    __dirty = fresh ? 0 : SIZE_MAX;
+    
+    // add usable size info to start of the block
+    ptr->size = alloc_size - OVERHEAD_SIZE;
     
     // cast bucket into chunk for the user
     chunk* user_ptr = (chunk*)(((char*)ptr) + OVERHEAD_SIZE);
@@ -316,233 +806,1703 @@ allocate_big_block(size_t size)
 
 
 
-/* ========================== STANDART ALLOCATION ========================== */
-/* Pop chunk of standart bucket size */
+/* ============================ MEDIUM ALLOCATION ========================== */
+/* Medium segment holding ptr */
 static
-chunk*
-pop_chunk()
+medium_seg*
+medium_seg_of(void* ptr)
 {
-    assert(__bucket != NULL);
-    assert(__arena != NULL);
-    
-    chunk* ptr = NULL;
-    
-    // there are free chunks in the bucket
-    if (__bucket->chunk_head != NULL) {
-        // get the first one in the list
-        ptr = __bucket->chunk_head;
-        __bucket->chunk_head = __bucket->chunk_head->next;
-        return ptr;
-    }
-    
-    // there are free blocks in the bucket
-    if (__bucket->block_head != NULL) {
-        // slice a chunk of the first block in the list
-        ptr = block_slice();
-        return ptr;
-    }
-    
-    // nothing was found
-    return ptr;
+    return (medium_seg*)((uintptr_t)ptr & ~(uintptr_t)(LI_MEDIUM_SEGMENT_SIZE - 1));
 }
 
-/* Allocates new block of free space, returns the first chunk */
+/* Record page count and state of the run at its first and last page */
 static
-chunk*
-allocate_page()
+void
+medium_set_run(medium_seg* seg, size_t start, size_t pages, int free)
 {
-    assert(__bucket != NULL);
-    assert(__arena != NULL);
-    assert(__bucket->block_head == NULL);
+    size_t last = start + pages - 1;
+    
+    seg->run_pages[start] = pages;
+    seg->run_pages[last]  = pages;
+    seg->run_free[start]  = free;
+    seg->run_free[last]   = free;
+}
+
+/* Add the free run to the run lists of the locked arena */
+static
+void
+medium_push(arena* arena_ptr, medium_seg* seg, size_t start, size_t pages)
+{
+    medium_set_run(seg, start, pages, 1);
     
-    // allocate block
-    page* ptr = mmap(NULL, MEM_PAGE_SIZE,
-                      PROT_READ | PROT_WRITE,
-                      MAP_PRIVATE | MAP_ANONYMOUS,
-                      -1, 0);
-    assert(ptr != MAP_FAILED);
+    // list node is written to the first page of the run
+    seg->touched = (seg->touched > start + 1) ? seg->touched : start + 1;
     
-    // add page to the list of pages
-    if (__bucket->page_head == NULL) {
-        __bucket->page_head = ptr;
+    int cls = (pages < LI_MEDIUM_CLASSES) ? pages : LI_MEDIUM_CLASSES - 1;
+    medium_run* run = (medium_run*)(((char*)seg) + start * PAGE_SIZE);
+    
+    run->prev = NULL;
+    run->next = arena_ptr->medium_free[cls];
+    if (run->next != NULL) {
+        run->next->prev = run;
+    }
+    arena_ptr->medium_free[cls] = run;
+    arena_ptr->medium_mask[cls / 64] |= (uint64_t)1 << (cls % 64);
+}
+
+/* Take the free run starting at start out of the run lists */
+static
+void
+medium_remove(arena* arena_ptr, medium_seg* seg, size_t start)
+{
+    size_t pages = seg->run_pages[start];
+    int cls = (pages < LI_MEDIUM_CLASSES) ? pages : LI_MEDIUM_CLASSES - 1;
+    medium_run* run = (medium_run*)(((char*)seg) + start * PAGE_SIZE);
+    
+    if (run->prev != NULL) {
+        run->prev->next = run->next;
     }
     else {
-        __bucket->page_head->next = ptr;
+        arena_ptr->medium_free[cls] = run->next;
+    }
+    if (run->next != NULL) {
+        run->next->prev = run->prev;
+    }
+    
+    if (arena_ptr->medium_free[cls] == NULL) {
+        arena_ptr->medium_mask[cls / 64] &= ~((uint64_t)1 << (cls % 64));
+    }
+}
+
+/* First run list from cls up that is not empty, -1 if there is none */
+static
+int
+medium_find(arena* arena_ptr, int cls)
+{
+    int word = cls / 64;
+    uint64_t bits = arena_ptr->medium_mask[word] & (~(uint64_t)0 << (cls % 64));
+    
+    while (bits == 0) {
+        if (++word == MEDIUM_MASK_WORDS) {
+            return -1;
+        }
+        bits = arena_ptr->medium_mask[word];
     }
     
-    block* block_ptr = (block*)(((char*)ptr) + sizeof(page));
+    return word * 64 + __builtin_ctzll(bits);
+}
+
+/* Add a medium segment to the thread arena, the spare one if it has it */
+static
+void
+__medium_segment()
+{
+    assert(__arena != NULL);
     
-    // add size and next to start of the block
-    block_ptr->size = MEM_PAGE_SIZE - sizeof(page);
-    block_ptr->next = NULL;
+    medium_seg* seg = __arena->medium_spare;
     
-    // add block to the list of blocks
-    if (__bucket->block_head == NULL) {
-        __bucket->block_head = block_ptr;
+    if (seg != NULL) {
+        __arena->medium_spare = NULL;
     }
     else {
-        block_ptr->next = block_ptr->next;
-        __bucket->block_head = block_ptr;
+        seg = (medium_seg*)map_segment(LI_MEDIUM_SEGMENT_SIZE, MEDIUM_CLASS);
+        seg_map_range(seg, LI_MEDIUM_SEGMENT_SIZE, MEDIUM_CLASS);
+        
+        // the header takes the first page
+        seg->owner      = __arena;
+        seg->used_pages = 0;
+        seg->touched    = 1;
+        __arena->medium_count += 1;
     }
     
-    // slice a chunk of the first block in the list
-    chunk* user_ptr = block_slice();
+    medium_push(__arena, seg, 1, LI_MEDIUM_PAGES - 1);
+}
+
+/* Carve a run of pages for the medium allocation from the locked arena */
+static
+chunk*
+__medium_alloc(size_t size)
+{
+    assert(__arena != NULL);
+    assert(sizeof(medium_seg) <= PAGE_SIZE);
+    
+    size_t pages = div_up(size, PAGE_SIZE);
+    assert(pages < LI_MEDIUM_CLASSES);
     
-    return user_ptr;
+    int cls = medium_find(__arena, pages);
+    if (cls < 0) {
+        __medium_segment();
+        cls = medium_find(__arena, pages);
+    }
+    assert(cls >= 0);
+    
+    medium_run* run = __arena->medium_free[cls];
+    medium_seg* seg = medium_seg_of(run);
+    size_t start = ((char*)run - (char*)seg) / PAGE_SIZE;
+    size_t have  = seg->run_pages[start];
+    
+    medium_remove(__arena, seg, start);
+    
+    // pages from touched on were never written to
+    size_t dirty = (seg->touched > start) ? seg->touched - start : 0;
+    dirty = (dirty < pages) ? dirty : pages;
+    __dirty = dirty * PAGE_SIZE;
+    
+    if (seg->touched < start + pages) {
+        seg->touched = start + pages;
+    }
+    
+    // give the tail back to the lists
+    if (have > pages) {
+        medium_push(__arena, seg, start + pages, have - pages);
+    }
+    medium_set_run(seg, start, pages, 0);
+    seg->used_pages += pages;
+    
+    return (chunk*)run;
+}
+
+/* Keep the empty segment as the spare of the locked arena or unmap it */
+static
+void
+medium_release(arena* arena_ptr, medium_seg* seg)
+{
+    if (arena_ptr->medium_spare == NULL) {
+        arena_ptr->medium_spare = seg;
+        return;
+    }
+    
+    arena_ptr->medium_count -= 1;
+    unmap_segment(seg, LI_MEDIUM_SEGMENT_SIZE);
+}
+
+/* Free the medium run, coalescing it with its free neighbours */
+static
+void
+medium_free(chunk* ptr)
+{
+    medium_seg* seg = medium_seg_of(ptr);
+    arena* owner = seg->owner;
+    
+    size_t start = ((char*)ptr - (char*)seg) / PAGE_SIZE;
+    
+    arena_lock(owner);
+    
+    size_t pages = seg->run_pages[start];
+    assert(!seg->run_free[start]);
+    seg->used_pages -= pages;
+    
+    // merge with the following run
+    size_t next = start + pages;
+    if (next < LI_MEDIUM_PAGES && seg->run_free[next]) {
+        medium_remove(owner, seg, next);
+        pages += seg->run_pages[next];
+    }
+    
+    // merge with the preceding run, its page count is at its last page
+    if (start > 1 && seg->run_free[start - 1]) {
+        size_t prev = start - seg->run_pages[start - 1];
+        medium_remove(owner, seg, prev);
+        pages += start - prev;
+        start = prev;
+    }
+    
+    if (seg->used_pages == 0) {
+        assert(start == 1 && pages == LI_MEDIUM_PAGES - 1);
+        medium_set_run(seg, start, pages, 1);
+        medium_release(owner, seg);
+    }
+    else {
+        medium_push(owner, seg, start, pages);
+    }
+    
+    pthread_mutex_unlock(&(owner->lock));
 }
 
+/* Usable size of the medium allocation */
+static
+size_t
+medium_size(chunk* ptr)
+{
+    medium_seg* seg = medium_seg_of(ptr);
+    size_t start = ((char*)ptr - (char*)seg) / PAGE_SIZE;
+    return seg->run_pages[start] * PAGE_SIZE;
+}
 
 
 
-/* ============================= MALLOC ==================================== */
-/* Pop chunk from the bucket or allocate new page */
+/* ========================== STANDART ALLOCATION ========================== */
+/* Pop chunk of standart bucket size */
 static
 chunk*
-get_chunk(size_t size)
+pop_chunk()
 {
-    assert(__arena != NULL);
     assert(__bucket != NULL);
-    assert(size >= CHUNK_SIZE);
+    assert(__arena != NULL);
     
     chunk* ptr = NULL;
     
-    // big allocation
-    if (__bucket->chunk_size == 0) {
-        ptr = pop_big_block(size);
-        
-        if (ptr == NULL) {
-            ptr = allocate_big_block(size);
-        }
+    // there are free chunks in the bucket
+    if (__bucket->chunk_head != NULL) {
+        // get the first one in the list
+        ptr = __bucket->chunk_head;
+        __bucket->chunk_head = __bucket->chunk_head->next;
+        __seg_take(ptr);
+        __dirty = SIZE_MAX;
+        return ptr;
     }
     
-    // standart allocation
-    else {
-        ptr = pop_chunk();
-
-        if (ptr == NULL) {
-            ptr = allocate_page();
-        }
+    // there is fresh space left in the current segment
+    if (__bucket->cur != NULL) {
+        ptr = bump_chunk();
     }
     
     return ptr;
 }
 
-
-/* Allocate requested number of bytes on heap */
-void*
-limalloc(size_t size)
+/* Carve the next chunk off the fresh space of the current segment */
+static
+chunk*
+bump_chunk()
 {
-    assert(size > 0);
-        
-    // initialize malloc structures at first run
-    if (FISRT_RUN) init_malloc();
-    
-    // make sure arena is assigned to the current thread
-    if (__arena == NULL) __assign_arena();
-    assert(__arena != NULL);
+    assert(__bucket != NULL);
+    assert(__bucket->cur != NULL);
     
-    // make sure size at least CHUNK_SIZE
-    size = (size < CHUNK_SIZE) ? CHUNK_SIZE : size;
+    chunk* ptr = (chunk*)__bucket->cur;
+    __bucket->cur += __bucket->chunk_size;
+    page_of(ptr)->live += 1;
     
-    // choose apropriate bucket for the allocation
-    __choose_bucket(size);
-    assert(__bucket != NULL);
+    // fresh space was never written to, recycled space was
+    __dirty = __bucket->cur_dirty ? SIZE_MAX : 0;
     
-    // get a pointer to the chunk
-    chunk* ptr = get_chunk(size);
+    // not enough room left for another chunk
+    if (__bucket->cur + __bucket->chunk_size > __bucket->end) {
+        __bucket->cur = NULL;
+        __bucket->end = NULL;
+    }
     
     return ptr;
 }
 
+/* Segment of a chunk of a standard bucket */
+static
+page*
+page_of(void* ptr)
+{
+    return (page*)((uintptr_t)ptr & ~(MEM_PAGE_SIZE - 1));
+}
 
-
-/* ============================= FREE ====================================== */
-/* Free given chunk */
+/* Count the chunk leaving a free list of the locked arena. Chunks of other
+ arenas are counted by their owner, only the lock holder touches them */
 static
 void
-free_chunk(chunk* ptr)
+__seg_take(chunk* ptr)
 {
-    assert(ptr != NULL);
-    assert(__arena != NULL);
-    assert(__bucket != NULL);
+    page* seg = page_of(ptr);
+    if (seg->owner != __arena) {
+        return;
+    }
     
-    // big allocation
-    if (__bucket->chunk_size == 0) {
-        
-        block* block_ptr = (block*)(((char*)ptr) - OVERHEAD_SIZE);
-        block_ptr->next = __bucket->block_head;
-        __bucket->block_head = block_ptr;
+    if (seg->live++ == 0 && seg->empty) {
+        seg->empty = 0;
+        __arena->empty_count -= 1;
+    }
+}
+
+/* Count the chunk returning to a free list of the locked arena, a segment
+ left without live chunks can be reclaimed unless it is still carved */
+static
+void
+seg_give(arena* arena_ptr, bucket* bucket_ptr, chunk* ptr)
+{
+    page* seg = page_of(ptr);
+    if (seg->owner != arena_ptr) {
+        return;
     }
     
-    // standart allocation
-    else {
-        // add chunk to the chunk list of the bucket
-        ptr->next = __bucket->chunk_head;
-        __bucket->chunk_head = ptr;
+    assert(seg->live > 0);
+    seg->live -= 1;
+    
+    if (seg->live == 0
+        && (bucket_ptr->cur == NULL || page_of(bucket_ptr->cur) != seg)) {
+        seg->empty = 1;
+        arena_ptr->empty_count += 1;
     }
 }
 
-/* Free the givsen item from memory */
+/* Count the chunk returning to a free list of the thread arena */
+static
 void
-lifree(chunk* ptr)
+__seg_give(bucket* bucket_ptr, chunk* ptr)
 {
-    assert(ptr != NULL);
-    assert(__arena != NULL);
-    assert(__bucket != NULL);
+    seg_give(__arena, bucket_ptr, ptr);
+}
+
+/* Push a list of chunks freed by another arena to the remote queue of
+ their owner, without its lock */
+static
+void
+remote_push(arena* owner, chunk* head, chunk* tail, size_t count)
+{
+    tail->next = __atomic_load_n(&(owner->remote), __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&(owner->remote), &(tail->next), head, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    
+    __atomic_add_fetch(&(owner->remote_frees), count, __ATOMIC_RELAXED);
+    PROBE2(limalloc, remote_push, (int)(owner - arenas), count);
+}
+
+/* Move the chunks of the remote queue of the locked arena to its buckets,
+ where they count against their segments again. Returns the count moved */
+static
+size_t
+drain_remote(arena* arena_ptr)
+{
+    if (__atomic_load_n(&(arena_ptr->remote), __ATOMIC_RELAXED) == NULL) {
+        return 0;
+    }
     
-    // find the original bucket of the chunk
-    __find_bucket(ptr);
+    chunk* ptr = __atomic_exchange_n(&(arena_ptr->remote), NULL, __ATOMIC_ACQUIRE);
+    size_t count = 0;
     
-    // free chunk
-    free_chunk(ptr);
+    while (ptr != NULL) {
+        chunk* next = ptr->next;
+        bucket* bucket_ptr = &(arena_ptr->buckets[seg_map_get(ptr)]);
+        
+        ptr->next = bucket_ptr->chunk_head;
+        bucket_ptr->chunk_head = ptr;
+        seg_give(arena_ptr, bucket_ptr, ptr);
+        
+        count += 1;
+        ptr = next;
+    }
+    
+    PROBE2(limalloc, remote_drain, (int)(arena_ptr - arenas), count);
+    return count;
 }
 
+/* Take a prefaulted segment out of the reserve of the locked arena */
+static
+page*
+__reserve_take()
+{
+    assert(__arena != NULL);
+    
+    page* seg = __arena->reserve;
+    if (seg != NULL) {
+        __arena->reserve = seg->next;
+        __arena->reserve_count -= 1;
+    }
+    return seg;
+}
 
+/* Take an empty segment out of the pool of the locked arena */
+static
+page*
+__pool_take()
+{
+    assert(__arena != NULL);
+    
+    page* seg = __arena->pool;
+    if (seg != NULL) {
+        __arena->pool = seg->next;
+        __arena->pool_count -= 1;
+    }
+    return seg;
+}
 
-/* ============================= REALLOC =================================== */
-/* Reallocate the prev with new size */
-void*
-lirealloc(chunk* prev_ptr, size_t new_size)
+/* Move the empty segments of every bucket of the locked arena to its pool,
+ dropping their chunks from the free lists. Returns the number moved */
+static
+int
+reclaim_segments(arena* arena_ptr)
 {
-    assert(prev_ptr != NULL);
-    assert(new_size > 0);
+    int found = 0;
     
-    // find the original bucket of the chunk
-    __find_bucket(prev_ptr);
+    for (int bb = 1; bb < 2 * LI_BUCKET_COUNT; ++bb) {
+        bucket* bucket_ptr = &(arena_ptr->buckets[bb]);
+        if (bucket_ptr->chunk_size == 0) {
+            continue;
+        }
+        
+        // chunks of other arenas keep their segment from being empty
+        chunk** link = &(bucket_ptr->chunk_head);
+        while (*link != NULL) {
+            if (page_of(*link)->empty) {
+                *link = (*link)->next;
+            }
+            else {
+                link = &((*link)->next);
+            }
+        }
+        
+        page** seg_link = &(bucket_ptr->page_head);
+        while (*seg_link != NULL) {
+            page* seg = *seg_link;
+            if (!seg->empty) {
+                seg_link = &(seg->next);
+                continue;
+            }
+            
+            *seg_link = seg->next;
+            seg->empty = 0;
+            arena_ptr->empty_count -= 1;
+            
+            seg->next = arena_ptr->pool;
+            arena_ptr->pool = seg;
+            arena_ptr->pool_count += 1;
+            found += 1;
+        }
+    }
     
-    // prev size of the allocation
-    size_t prev_size;
+    assert(arena_ptr->empty_count == 0);
+    return found;
+}
+
+/* Unmap pooled segments of the locked arena above the pool limit */
+static
+void
+trim_pool(arena* arena_ptr)
+{
+    size_t pool_max = __atomic_load_n(&(li_config.pool_max), __ATOMIC_RELAXED);
     
-    // big allocation
-    if (__bucket->chunk_size == 0) {
-        block* block_ptr = (block*)(((char*)prev_ptr) - OVERHEAD_SIZE);
-        prev_size = block_ptr->size;
+    while ((size_t)arena_ptr->pool_count > pool_max) {
+        page* seg = arena_ptr->pool;
+        arena_ptr->pool = seg->next;
+        arena_ptr->pool_count -= 1;
+        unmap_segment(seg, MEM_PAGE_SIZE);
     }
+}
+
+/* Allocates new block of free space, returns the first chunk */
+static
+chunk*
+allocate_page()
+{
+    assert(__bucket != NULL);
+    assert(__arena != NULL);
+    assert(__bucket->cur == NULL);
+    assert(sizeof(page) <= SEG_HEADER_SIZE);
     
-    // standart allocation
-    else {
-        prev_size = __bucket->chunk_size;
+    int bb = __bucket - __arena->buckets;
+    
+    // empty segments of any bucket first, their pages are resident
+    if (__arena->pool == NULL && __arena->empty_count > 0) {
+        reclaim_segments(__arena);
     }
+    page* ptr = __pool_take();
+    int dirty = ptr != NULL;
+    trim_pool(__arena);
     
-    // check if there is enough space in the curr chunk
-    // if there is, return it back
-    if (prev_size >= new_size) {
-        return prev_ptr;
+    // then the reserve, and only then the system
+    if (ptr == NULL) {
+        ptr = __reserve_take();
+    }
+    if (ptr == NULL) {
+        ptr = map_segment(MEM_PAGE_SIZE, bb);
     }
+    seg_map_set(ptr, bb);
     
-    // NOTE: assuming realloc is used on vectors a lot,
-    // it makes sense to give more space on first reallocation,
-    // so that in future, malloc won't need to allocate new space
-    new_size = (new_size < PAGE_SIZE) ? PAGE_SIZE : new_size;
+    ptr->owner = __arena;
+    ptr->live  = 0;
+    ptr->empty = 0;
     
-    // if there isn't enough space allocate new space
-    chunk* new_ptr = limalloc(new_size);
+    // add page to the list of pages
+    ptr->next = __bucket->page_head;
+    __bucket->page_head = ptr;
     
-    // copy memory from old ptr to new_ptr
-    memcpy(prev_ptr, new_ptr, prev_size);
+    // the rest of the segment is carved on demand
+    __bucket->cur = ((char*)ptr) + SEG_HEADER_SIZE;
+    __bucket->end = ((char*)ptr) + MEM_PAGE_SIZE;
+    __bucket->cur_dirty = dirty;
     
-    // free the old chunk
-    lifree(prev_ptr);
+    return bump_chunk();
+}
+
+
+
+
+/* ============================= THREAD CACHE ============================== */
+/* Refill the thread bin of __bucket from the arena, returns one more chunk */
+static
+chunk*
+__refill_bin(int bb)
+{
+    assert(__arena != NULL);
+    assert(__bucket == &(__arena->buckets[bb]));
     
-    return new_ptr;
+    tbin* bin = &(__tcache.bins[bb]);
+    size_t chunk_size = __bucket->chunk_size;
+    
+    // fill with about the same amount of bytes for every bucket
+    size_t fill_size = __atomic_load_n(&(li_config.tcache_fill_size), __ATOMIC_RELAXED);
+    size_t fill = fill_size / chunk_size;
+    fill = (fill < 1) ? 1 : fill;
+    fill = (fill > TCACHE_FILL) ? TCACHE_FILL : fill;
+    
+    PROBE3(limalloc, refill, bb, fill, (int)(__arena - arenas));
+    
+    for (size_t ii = 1; ii < fill; ++ii) {
+        chunk* ptr = get_chunk(chunk_size);
+        ptr->next = bin->head;
+        bin->head = ptr;
+        bin->count += 1;
+    }
+    
+    // chunk for the caller goes last, so __dirty describes it
+    return get_chunk(chunk_size);
+}
+
+/* Move chunks from the thread bin to the locked arena until keep are left */
+static
+void
+__flush_bin(int bb, int keep)
+{
+    assert(__arena != NULL);
+    
+    tbin* bin = &(__tcache.bins[bb]);
+    bucket* bucket_ptr = &(__arena->buckets[bb]);
+    
+    if (bin->count > keep) {
+        PROBE3(limalloc, flush, bb, bin->count - keep, (int)(__arena - arenas));
+    }
+    
+    // chunks of other arenas are gathered per owner for its remote queue
+    arena*  owner = NULL;
+    chunk*  remote_head = NULL;
+    chunk*  remote_tail = NULL;
+    size_t  remote_count = 0;
+    
+    while (bin->count > keep) {
+        chunk* ptr = bin->head;
+        bin->head = ptr->next;
+        bin->count -= 1;
+        
+        arena* seg_owner = page_of(ptr)->owner;
+        if (seg_owner == __arena) {
+            ptr->next = bucket_ptr->chunk_head;
+            bucket_ptr->chunk_head = ptr;
+            __seg_give(bucket_ptr, ptr);
+            continue;
+        }
+        
+        if (seg_owner != owner && remote_head != NULL) {
+            remote_push(owner, remote_head, remote_tail, remote_count);
+            remote_head = NULL;
+            remote_count = 0;
+        }
+        
+        if (remote_head == NULL) {
+            remote_tail = ptr;
+        }
+        owner = seg_owner;
+        ptr->next = remote_head;
+        remote_head = ptr;
+        remote_count += 1;
+    }
+    
+    if (remote_head != NULL) {
+        remote_push(owner, remote_head, remote_tail, remote_count);
+    }
+}
+
+
+
+/* ============================= TRANSFER CACHE ============================ */
+/* Move count chunks of the thread bin to a free slot of the transfer cache
+ as one batch, returns false if every slot is taken */
+static
+int
+transfer_put(int bb, int count)
+{
+    assert(count > 0);
+    
+    size_t depth = __atomic_load_n(&(li_config.transfer_depth), __ATOMIC_RELAXED);
+    chunk** slots = transfer[bb];
+    
+    // find a free slot before cutting the batch
+    size_t ss = 0;
+    while (ss < depth && __atomic_load_n(&(slots[ss]), __ATOMIC_RELAXED) != NULL) {
+        ++ss;
+    }
+    if (ss == depth) {
+        if (depth > 0) {
+            __atomic_add_fetch(&transfer_spills, 1, __ATOMIC_RELAXED);
+        }
+        return 0;
+    }
+    
+    tbin* bin = &(__tcache.bins[bb]);
+    chunk* head = bin->head;
+    chunk* tail = head;
+    for (int ii = 1; ii < count; ++ii) {
+        tail = tail->next;
+    }
+    
+    chunk* rest = tail->next;
+    tail->next = NULL;
+    ((transfer_batch*)head)->count = count;
+    
+    for (; ss < depth; ++ss) {
+        chunk* empty = NULL;
+        if (__atomic_compare_exchange_n(&(slots[ss]), &empty, head, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            bin->head = rest;
+            bin->count -= count;
+            PROBE2(limalloc, transfer_put, bb, count);
+            return 1;
+        }
+    }
+    
+    // other threads took the free slots first
+    tail->next = rest;
+    __atomic_add_fetch(&transfer_spills, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Take a batch of bucket bb from the transfer cache into the empty thread
+ bin, returns one chunk of it or NULL if there is none */
+static
+chunk*
+transfer_get(int bb)
+{
+    tbin* bin = &(__tcache.bins[bb]);
+    assert(bin->head == NULL);
+    
+    chunk** slots = transfer[bb];
+    
+    for (int ss = 0; ss < LI_TRANSFER_SLOTS; ++ss) {
+        if (__atomic_load_n(&(slots[ss]), __ATOMIC_RELAXED) == NULL) {
+            continue;
+        }
+        
+        chunk* head = __atomic_exchange_n(&(slots[ss]), NULL, __ATOMIC_ACQUIRE);
+        if (head == NULL) {
+            continue;
+        }
+        
+        size_t count = ((transfer_batch*)head)->count;
+        PROBE2(limalloc, transfer_get, bb, count);
+        
+        bin->head = head->next;
+        bin->count = count - 1;
+        return head;
+    }
+    
+    return NULL;
+}
+
+/* Empty the transfer cache into the thread bins, so a flush can give the
+ chunks back to the arenas owning them */
+static
+void
+transfer_drain()
+{
+    for (int bb = 1; bb < LI_BUCKET_COUNT; ++bb) {
+        tbin* bin = &(__tcache.bins[bb]);
+        
+        for (int ss = 0; ss < LI_TRANSFER_SLOTS; ++ss) {
+            if (__atomic_load_n(&(transfer[bb][ss]), __ATOMIC_RELAXED) == NULL) {
+                continue;
+            }
+            
+            chunk* head = __atomic_exchange_n(&(transfer[bb][ss]), NULL,
+                                              __ATOMIC_ACQUIRE);
+            if (head == NULL) {
+                continue;
+            }
+            
+            size_t count = ((transfer_batch*)head)->count;
+            chunk* tail = head;
+            while (tail->next != NULL) {
+                tail = tail->next;
+            }
+            
+            tail->next = bin->head;
+            bin->head = head;
+            bin->count += count;
+        }
+    }
+}
+
+
+
+/* ============================= SHORT LIVED =============================== */
+/* Start carving chunks of bucket bb from an empty short lived segment */
+static
+void
+__short_open(short_run* run, int bb)
+{
+    assert(__arena != NULL);
+    
+    __lock_arena();
+    if (__arena->pool == NULL && __arena->empty_count > 0) {
+        reclaim_segments(__arena);
+    }
+    short_seg* seg = (short_seg*)__pool_take();
+    trim_pool(__arena);
+    
+    // reserved segments are as fresh as mapped ones
+    run->fresh = seg == NULL;
+    if (seg == NULL) {
+        seg = (short_seg*)__reserve_take();
+    }
+    __unlock_arena();
+    
+    if (seg == NULL) {
+        seg = (short_seg*)map_segment(MEM_PAGE_SIZE, SHORT_CLASS + bb);
+    }
+    
+    // pooled segments may change their bucket
+    seg_map_set(seg, SHORT_CLASS + bb);
+    
+    seg->next  = NULL;
+    seg->owner = __arena;
+    seg->live  = SHORT_BIAS;
+    
+    run->seg   = seg;
+    run->cur   = ((char*)seg) + SHORT_HEADER_SIZE;
+    run->end   = ((char*)seg) + MEM_PAGE_SIZE;
+    run->count = 0;
+}
+
+/* Stop carving from the segment of the run, it is released once empty */
+static
+void
+short_retire(short_run* run)
+{
+    short_seg* seg = run->seg;
+    if (seg == NULL) {
+        return;
+    }
+    
+    // replace the bias with the number of chunks handed out
+    size_t live = __atomic_add_fetch(&(seg->live), run->count - SHORT_BIAS,
+                                     __ATOMIC_ACQ_REL);
+    if (live == 0) {
+        short_release(seg);
+    }
+    
+    run->seg = NULL;
+    run->cur = NULL;
+    run->end = NULL;
+}
+
+/* Return the empty segment to the pool of its arena or to the system */
+static
+void
+short_release(short_seg* seg)
+{
+    arena* owner = seg->owner;
+    
+    arena_lock(owner);
+    size_t pool_max = __atomic_load_n(&(li_config.pool_max), __ATOMIC_RELAXED);
+    if ((size_t)owner->pool_count < pool_max) {
+        seg->next = (short_seg*)owner->pool;
+        owner->pool = (page*)seg;
+        owner->pool_count += 1;
+        seg = NULL;
+    }
+    pthread_mutex_unlock(&(owner->lock));
+    
+    if (seg != NULL) {
+        unmap_segment(seg, MEM_PAGE_SIZE);
+    }
+}
+
+/* Allocate a short lived chunk, chunks freed from a segment are not reused
+ until all of them are freed and the segment is recycled as a whole */
+static
+chunk*
+short_alloc(size_t size)
+{
+    int bb = li_bucket_index(size);
+    assert(bb != 0);
+    
+    short_run* run = &(__short[bb]);
+    size_t chunk_size = li_class_sizes[bb];
+    
+    if (run->cur == NULL || run->cur + chunk_size > run->end) {
+        short_retire(run);
+        __short_open(run, bb);
+    }
+    
+    chunk* ptr = (chunk*)run->cur;
+    run->cur += chunk_size;
+    run->count += 1;
+    
+    __dirty = run->fresh ? 0 : SIZE_MAX;
+    
+    return ptr;
+}
+
+
+
+/* ============================= MALLOC ==================================== */
+/* Pop chunk from the bucket or allocate new page */
+static
+chunk*
+get_chunk(size_t size)
+{
+    assert(__arena != NULL);
+    assert(__bucket != NULL);
+    assert(size >= CHUNK_SIZE);
+    
+    chunk* ptr = NULL;
+    
+    // medium allocation, a run of pages from a shared segment
+    if (__bucket->chunk_size == 0 && size <= LI_MEDIUM_MAX_SIZE) {
+        ptr = __medium_alloc(size);
+    }
+    
+    // big allocation, freed blocks are reused through the extent cache
+    else if (__bucket->chunk_size == 0) {
+        ptr = allocate_big_block(size);
+    }
+    
+    // standart allocation
+    else {
+        ptr = pop_chunk();
+        
+        // chunks other threads freed back to us, then memory left by
+        // exited threads, before mapping more
+        if (ptr == NULL && drain_remote(__arena) > 0) {
+            ptr = pop_chunk();
+        }
+        if (ptr == NULL && __adopt_orphans(__bucket - __arena->buckets)) {
+            ptr = pop_chunk();
+        }
+
+        if (ptr == NULL) {
+            ptr = allocate_page();
+        }
+    }
+    
+    return ptr;
+}
+
+
+/* Allocate requested number of bytes on heap */
+void*
+limalloc(size_t size)
+{
+    assert(size > 0);
+    
+    if (__builtin_expect(--__tcache.sample_left < 0, 0)) {
+        lihist_sample(size);
+    }
+    
+    // make sure size at least CHUNK_SIZE
+    size = (size < CHUNK_SIZE) ? CHUNK_SIZE : size;
+    
+    // try the thread cache first, the same as limalloc_inline
+    int bb = li_bucket_index(size);
+    tbin* bin = &(__tcache.bins[bb]);
+    
+    if (bin->head != NULL) {
+        chunk* ptr = bin->head;
+        bin->head = ptr->next;
+        bin->count -= 1;
+        __dirty = SIZE_MAX;
+        return ptr;
+    }
+    
+    // make sure arena is assigned to the current thread, the first one
+    // loads the class table
+    if (__arena == NULL) {
+        __assign_arena();
+        bb = li_bucket_index(size);
+    }
+    if (__migrate) __migrate_arena();
+    assert(__arena != NULL);
+    
+    // a batch freed by another thread saves the trip through the arena
+    if (bb != 0) {
+        chunk* ptr = transfer_get(bb);
+        if (ptr != NULL) {
+            __dirty = SIZE_MAX;
+            return ptr;
+        }
+    }
+    
+    // choose apropriate bucket for the allocation
+    __choose_bucket(size);
+    assert(__bucket != NULL);
+    
+    chunk* ptr = NULL;
+    
+    __lock_arena();
+    
+    // big allocations bypass the thread cache
+    if (bb == 0) {
+        ptr = get_chunk(size);
+    }
+    else {
+        ptr = __refill_bin(bb);
+    }
+    
+    __unlock_arena();
+    
+    lipressure_notify();
+    
+    return ptr;
+}
+
+
+
+/* ============================= FREE ====================================== */
+/* Free given chunk */
+static
+void
+free_chunk(chunk* ptr)
+{
+    assert(ptr != NULL);
+    assert(__arena != NULL);
+    assert(__bucket != NULL);
+    assert(__bucket->chunk_size != 0);
+    
+    // add chunk to the chunk list of the bucket
+    ptr->next = __bucket->chunk_head;
+    __bucket->chunk_head = ptr;
+    __seg_give(__bucket, ptr);
+}
+
+/* Free the givsen item from memory */
+void
+lifree(chunk* ptr)
+{
+    assert(ptr != NULL);
+    
+    // thread cache must be flushed at exit, so even free binds an arena
+    if (__arena == NULL) __assign_arena();
+    assert(__arena != NULL);
+    
+    int bb = seg_map_get(ptr);
+    
+    // medium run goes back to the arena owning its segment
+    if (bb == MEDIUM_CLASS) {
+        medium_free(ptr);
+        return;
+    }
+    
+    // short lived chunk only counts down the live chunks of its segment
+    if (bb >= SHORT_CLASS) {
+        short_seg* seg = (short_seg*)((uintptr_t)ptr & ~(MEM_PAGE_SIZE - 1));
+        if (__atomic_sub_fetch(&(seg->live), 1, __ATOMIC_ACQ_REL) == 0) {
+            short_release(seg);
+        }
+        return;
+    }
+    
+    // long lived chunk goes straight back to its bucket, or to the remote
+    // queue of the arena owning its segment
+    if (bb >= LONG_CLASS) {
+        arena* owner = page_of(ptr)->owner;
+        if (owner != __arena) {
+            remote_push(owner, ptr, ptr, 1);
+            return;
+        }
+        
+        __lock_arena();
+        __bucket = &(__arena->buckets[bb]);
+        free_chunk(ptr);
+        __unlock_arena();
+        return;
+    }
+    
+    // standard chunk goes to the thread cache
+    if (bb != 0) {
+        tbin* bin = &(__tcache.bins[bb]);
+        ptr->next = bin->head;
+        bin->head = ptr;
+        bin->count += 1;
+        
+        // thread cache is full, hand half of it to the transfer cache and
+        // give it back to the arena only when that is full too
+        int max = __atomic_load_n(&(li_config.tcache_max), __ATOMIC_RELAXED);
+        if (bin->count > max) {
+            if (transfer_put(bb, bin->count - max / 2)) {
+                return;
+            }
+            if (__migrate) __migrate_arena();
+            __lock_arena();
+            __flush_bin(bb, max / 2);
+            __unlock_arena();
+        }
+        return;
+    }
+    
+    // big block goes back to the extent cache, which limits and decays it
+    block* block_ptr = (block*)(((char*)ptr) - OVERHEAD_SIZE);
+    size_t size = block_ptr->size + OVERHEAD_SIZE;
+    
+    extent_unmap(block_ptr, size);
+    __atomic_sub_fetch(&mapped_bytes, size, __ATOMIC_RELAXED);
+}
+
+
+
+/* ============================= REALLOC =================================== */
+/* Reallocate the prev with new size */
+void*
+lirealloc(chunk* prev_ptr, size_t new_size)
+{
+    assert(prev_ptr != NULL);
+    assert(new_size > 0);
+    
+    // prev size of the allocation, from the class of its segment
+    int cls = seg_map_get(prev_ptr);
+    size_t prev_size = class_chunk_size(cls);
+    
+    // medium allocation
+    if (cls == MEDIUM_CLASS) {
+        prev_size = medium_size(prev_ptr);
+    }
+    
+    // big allocation
+    else if (prev_size == 0) {
+        block* block_ptr = (block*)(((char*)prev_ptr) - OVERHEAD_SIZE);
+        prev_size = block_ptr->size;
+    }
+    
+    // check if there is enough space in the curr chunk
+    // if there is, return it back
+    if (prev_size >= new_size) {
+        return prev_ptr;
+    }
+    
+    // NOTE: assuming realloc is used on vectors a lot,
+    // it makes sense to give more space on first reallocation,
+    // so that in future, malloc won't need to allocate new space
+    new_size = (new_size < PAGE_SIZE) ? PAGE_SIZE : new_size;
+    
+    // if there isn't enough space allocate new space
+    chunk* new_ptr = limalloc(new_size);
+    
+    PROBE3(limalloc, realloc_copy, prev_size, new_size, cls);
+    
+    // copy memory from old ptr to new_ptr
+    memcpy(new_ptr, prev_ptr, prev_size);
+    
+    // free the old chunk
+    lifree(prev_ptr);
+    
+    return new_ptr;
+}
+
+
+
+/* ============================= CALLOC ==================================== */
+/* Allocate zeroed memory for count items of the given size */
+void*
+licalloc(size_t count, size_t size)
+{
+    // count * size does not fit into size_t
+    if (size != 0 && count > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    
+    size_t total = count * size;
+    total = (total == 0) ? 1 : total;
+    
+    chunk* ptr = limalloc(total);
+    
+    // zero only what was written since the memory was mapped,
+    // untouched pages stay unfaulted
+    size_t dirty = (__dirty < total) ? __dirty : total;
+    if (dirty > 0) {
+        memset(ptr, 0, dirty);
+    }
+    
+    return ptr;
+}
+
+
+
+/* ============================= FLAGS ===================================== */
+/* Allocate with lifetime hints, conflicting hints are ignored */
+void*
+limalloc_flags(size_t size, int flags)
+{
+    assert(size > 0);
+    
+    size = (size < CHUNK_SIZE) ? CHUNK_SIZE : size;
+    int bb = li_bucket_index(size);
+    int lifetime = flags & (LI_SHORT_LIVED | LI_LONG_LIVED);
+    
+    chunk* ptr = NULL;
+    
+    // big blocks are mapped one by one, hints make no difference to them
+    if (bb == 0 || (lifetime != LI_SHORT_LIVED && lifetime != LI_LONG_LIVED)) {
+        ptr = limalloc(size);
+    }
+    else {
+        if (__arena == NULL) {
+            __assign_arena();
+            bb = li_bucket_index(size);
+        }
+        assert(__arena != NULL);
+        
+        if (lifetime == LI_SHORT_LIVED) {
+            ptr = short_alloc(size);
+        }
+        else {
+            __lock_arena();
+            __bucket = &(__arena->buckets[LONG_CLASS + bb]);
+            ptr = get_chunk(size);
+            __unlock_arena();
+        }
+        
+        lipressure_notify();
+    }
+    
+    if (flags & LI_ZERO) {
+        size_t dirty = (__dirty < size) ? __dirty : size;
+        if (dirty > 0) {
+            memset(ptr, 0, dirty);
+        }
+    }
+    
+    return ptr;
+}
+
+
+
+/* ============================= SEGMENTS ================================== */
+/* Map a segment of the given size for use outside of the buckets */
+void*
+lisegment_map(size_t size)
+{
+    assert(size > 0);
+    assert(size % PAGE_SIZE == 0);
+
+    lipressure_check(size);
+
+    int fresh;
+    void* ptr = extent_map(size, NULL, &fresh);
+
+    __atomic_add_fetch(&mapped_bytes, size, __ATOMIC_RELAXED);
+
+    lipressure_notify();
+
+    return ptr;
+}
+
+/* Give a segment from lisegment_map back, through the extent cache */
+void
+lisegment_unmap(void* ptr, size_t size)
+{
+    assert(ptr != NULL);
+    assert(size % PAGE_SIZE == 0);
+
+    extent_unmap(ptr, size);
+    __atomic_sub_fetch(&mapped_bytes, size, __ATOMIC_RELAXED);
+}
+
+
+
+/* ============================= PURGE ===================================== */
+/* Give free memory of the locked arena back to the system */
+static
+size_t
+purge_arena(arena* arena_ptr)
+{
+    size_t released = 0;
+    
+    // unmap the spare medium segment, drop pages of free medium runs
+    if (arena_ptr->medium_spare != NULL) {
+        arena_ptr->medium_count -= 1;
+        unmap_segment(arena_ptr->medium_spare, LI_MEDIUM_SEGMENT_SIZE);
+        arena_ptr->medium_spare = NULL;
+        released += LI_MEDIUM_SEGMENT_SIZE;
+    }
+    for (int cc = 1; cc < LI_MEDIUM_CLASSES; ++cc) {
+        for (medium_run* run = arena_ptr->medium_free[cc]; run != NULL; run = run->next) {
+            medium_seg* seg = medium_seg_of(run);
+            size_t start = ((char*)run - (char*)seg) / PAGE_SIZE;
+            size_t pages = seg->run_pages[start];
+            
+            // the first page keeps the list node
+            if (pages > 1) {
+                madvise(((char*)run) + PAGE_SIZE, (pages - 1) * PAGE_SIZE, MADV_DONTNEED);
+                released += (pages - 1) * PAGE_SIZE;
+            }
+        }
+    }
+    
+    // unmap empty segments, of the pool and of the buckets
+    drain_remote(arena_ptr);
+    reclaim_segments(arena_ptr);
+    while (arena_ptr->pool != NULL) {
+        page* seg = arena_ptr->pool;
+        arena_ptr->pool = seg->next;
+        unmap_segment(seg, MEM_PAGE_SIZE);
+        released += MEM_PAGE_SIZE;
+    }
+    arena_ptr->pool_count = 0;
+    
+    // the reserve is kept, it is there to spare the fast path a mapping
+    
+    // drop whole pages inside free chunks, keeping their next pointer
+    for (int bb = 1; bb < 2 * LI_BUCKET_COUNT; ++bb) {
+        bucket* bucket_ptr = &(arena_ptr->buckets[bb]);
+        if (bucket_ptr->chunk_size <= PAGE_SIZE) {
+            continue;
+        }
+        
+        for (chunk* ptr = bucket_ptr->chunk_head; ptr != NULL; ptr = ptr->next) {
+            uintptr_t start = ((uintptr_t)ptr + CHUNK_SIZE + PAGE_SIZE - 1)
+                              & ~(PAGE_SIZE - 1);
+            uintptr_t end   = ((uintptr_t)ptr + bucket_ptr->chunk_size)
+                              & ~(PAGE_SIZE - 1);
+            
+            if (end > start) {
+                madvise((void*)start, end - start, MADV_DONTNEED);
+                released += end - start;
+            }
+        }
+    }
+    
+    PROBE2(limalloc, arena_purge, (int)(arena_ptr - arenas), released);
+    
+    return released;
+}
+
+/* Give free memory of all arenas back to the system, returns bytes released */
+size_t
+lipurge()
+{
+    size_t released = 0;
+    
+    PROBE0(limalloc, purge_start);
+    
+    // called from a mapping path that already holds the thread arena
+    int held = __arena_held;
+    
+    // flush the thread cache and the transfer cache, so their chunks are
+    // purged too
+    if (__arena != NULL) {
+        transfer_drain();
+        if (!held) __lock_arena();
+        for (int bb = 1; bb < LI_BUCKET_COUNT; ++bb) {
+            __flush_bin(bb, 0);
+        }
+        if (!held) __unlock_arena();
+    }
+    
+    int count = __atomic_load_n(&(li_config.arena_count), __ATOMIC_ACQUIRE);
+    for (int aa = 0; aa < count; ++aa) {
+        arena* curr = &(arenas[aa]);
+        
+        if (held && curr == __arena) {
+            released += purge_arena(curr);
+            continue;
+        }
+        
+        // never wait on another arena while holding our own
+        if (held && !arena_trylock(curr)) {
+            continue;
+        }
+        if (!held) {
+            arena_lock(curr);
+        }
+        
+        released += purge_arena(curr);
+        pthread_mutex_unlock(&(curr->lock));
+    }
+    
+    released += liregion_purge();
+    released += extent_purge();
+    
+    PROBE1(limalloc, purge_done, released);
+    
+    return released;
+}
+
+/* Bytes currently mapped by the allocator, including the extent cache */
+size_t
+limapped()
+{
+    return __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED) + extent_cached();
+}
+
+
+
+/* ============================= PREWARM =================================== */
+/* Map a prefaulted segment of bucket bb for the arena and put all of its
+ chunks on the free list. Mapping happens with the arena unlocked */
+static
+void
+carve_segment(arena* arena_ptr, int bb)
+{
+    bucket* bucket_ptr = &(arena_ptr->buckets[bb]);
+    size_t chunk_size = bucket_ptr->chunk_size;
+    size_t count = (MEM_PAGE_SIZE - SEG_HEADER_SIZE) / chunk_size;
+    
+    page* seg = map_segment(MEM_PAGE_SIZE, bb);
+    seg_map_set(seg, bb);
+    populate_segment(seg, MEM_PAGE_SIZE);
+    
+    // chain the chunks in address order
+    char* first = ((char*)seg) + SEG_HEADER_SIZE;
+    for (size_t ii = 0; ii + 1 < count; ++ii) {
+        ((chunk*)(first + ii * chunk_size))->next =
+            (chunk*)(first + (ii + 1) * chunk_size);
+    }
+    chunk* last = (chunk*)(first + (count - 1) * chunk_size);
+    
+    // not counted as empty until first used, a reclaim would
+    // hand prewarmed memory to another bucket
+    seg->owner = arena_ptr;
+    seg->live  = 0;
+    seg->empty = 0;
+    
+    arena_lock(arena_ptr);
+    seg->next = bucket_ptr->page_head;
+    bucket_ptr->page_head = seg;
+    last->next = bucket_ptr->chunk_head;
+    bucket_ptr->chunk_head = (chunk*)first;
+    pthread_mutex_unlock(&(arena_ptr->lock));
+}
+
+/* Top up the reserve of empty prefaulted segments of the arena to reserve
+ bytes. Returns bytes mapped */
+static
+size_t
+fill_reserve(arena* arena_ptr, size_t reserve)
+{
+    size_t mapped = 0;
+    
+    arena_lock(arena_ptr);
+    size_t want = (reserve + MEM_PAGE_SIZE - 1) / MEM_PAGE_SIZE;
+    size_t have = arena_ptr->reserve_count;
+    pthread_mutex_unlock(&(arena_ptr->lock));
+    
+    // empty segments stay class 0 until a bucket takes them
+    for (; have < want; ++have) {
+        page* seg = map_segment(MEM_PAGE_SIZE, 0);
+        populate_segment(seg, MEM_PAGE_SIZE);
+        
+        arena_lock(arena_ptr);
+        seg->next = arena_ptr->reserve;
+        arena_ptr->reserve = seg;
+        arena_ptr->reserve_count += 1;
+        pthread_mutex_unlock(&(arena_ptr->lock));
+        
+        mapped += MEM_PAGE_SIZE;
+    }
+    
+    return mapped;
+}
+
+/* Map prefaulted segments for the arena: bytes of pre-carved free chunks for
+ every bucket in the classes mask, and a reserve of empty segments up to
+ reserve bytes. Returns bytes mapped */
+static
+size_t
+prewarm_arena(arena* arena_ptr, size_t bytes, size_t classes, size_t reserve)
+{
+    size_t mapped = 0;
+    
+    for (int bb = 1; bb < LI_BUCKET_COUNT && bytes > 0; ++bb) {
+        if (!(classes & ((size_t)1 << bb))) {
+            continue;
+        }
+        
+        size_t chunk_size = arena_ptr->buckets[bb].chunk_size;
+        size_t count = (MEM_PAGE_SIZE - SEG_HEADER_SIZE) / chunk_size;
+        size_t seg_count = div_up(bytes, count * chunk_size);
+        
+        for (size_t ss = 0; ss < seg_count; ++ss) {
+            carve_segment(arena_ptr, bb);
+            mapped += MEM_PAGE_SIZE;
+        }
+    }
+    
+    return mapped + fill_reserve(arena_ptr, reserve);
+}
+
+/* Prewarm every arena with bytes_per_class of free chunks for the buckets
+ in prewarm.classes and top up their reserves to reserve.bytes, so the first
+ allocations take neither mmap calls nor page faults. Returns bytes mapped */
+size_t
+limalloc_prewarm(size_t bytes_per_class)
+{
+    lictl_init();
+    
+    size_t classes = __atomic_load_n(&(li_config.prewarm_classes), __ATOMIC_RELAXED);
+    size_t reserve = __atomic_load_n(&(li_config.reserve_bytes), __ATOMIC_RELAXED);
+    
+    size_t mapped = 0;
+    size_t count = liarena_count();
+    for (size_t aa = 0; aa < count; ++aa) {
+        mapped += prewarm_arena(&(arenas[aa]), bytes_per_class, classes, reserve);
+    }
+    
+    lipressure_notify();
+    
+    return mapped;
+}
+
+
+
+/* ============================= CONTROL =================================== */
+/* Set the number of arenas, only before the first thread is bound to one.
+ Returns 0 on success, -1 if the arenas are in use or count is out of range */
+int
+liarena_set_count(size_t count)
+{
+    if (count < 1 || count > LI_ARENA_MAX) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&arenas_lock);
+    int ok = !arenas_started;
+    if (ok) {
+        li_config.arena_count = count;
+    }
+    pthread_mutex_unlock(&arenas_lock);
+    
+    return ok ? 0 : -1;
+}
+
+/* Replace the power of two chunk sizes of the standard buckets with count
+ sizes, multiples of LI_CLASS_STEP in increasing order, the last one
+ LI_MAX_BUCKET_SIZE. Only before the first thread is bound to an arena.
+ Returns 0 on success, -1 if the arenas are in use or the table is bad */
+int
+liarena_set_classes(const size_t* sizes, int count)
+{
+    if (count < 1 || count > LI_BUCKET_COUNT - 1
+        || sizes[count - 1] != LI_MAX_BUCKET_SIZE) {
+        return -1;
+    }
+    for (int ii = 0; ii < count; ++ii) {
+        if (sizes[ii] == 0 || sizes[ii] % LI_CLASS_STEP != 0
+            || (ii > 0 && sizes[ii] <= sizes[ii - 1])) {
+            return -1;
+        }
+    }
+    
+    pthread_mutex_lock(&arenas_lock);
+    int ok = !arenas_started;
+    if (ok) {
+        // buckets past the table are never chosen
+        for (int bb = 1; bb < LI_BUCKET_COUNT; ++bb) {
+            li_class_sizes[bb] = sizes[(bb <= count) ? bb - 1 : count - 1];
+        }
+        
+        int bb = 1;
+        for (int ss = 0; ss < LI_CLASS_SLOTS; ++ss) {
+            while (ss * LI_CLASS_STEP > li_class_sizes[bb]) {
+                ++bb;
+            }
+            li_class_index[ss] = bb;
+        }
+        
+        for (int aa = 0; aa < LI_ARENA_MAX; ++aa) {
+            for (int bb = 1; bb < LI_BUCKET_COUNT; ++bb) {
+                arenas[aa].buckets[bb].chunk_size = li_class_sizes[bb];
+                arenas[aa].buckets[LONG_CLASS + bb].chunk_size = li_class_sizes[bb];
+            }
+        }
+        
+        __atomic_store_n(&li_classes_custom, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&arenas_lock);
+    
+    return ok ? 0 : -1;
+}
+
+/* Number of arenas in use, grows when threads leave contended arenas */
+size_t
+liarena_count()
+{
+    return __atomic_load_n(&(li_config.arena_count), __ATOMIC_ACQUIRE);
+}
+
+/* Number of times a thread moved off a contended arena */
+size_t
+liarena_migrations()
+{
+    pthread_mutex_lock(&arenas_lock);
+    size_t migrations = arena_migrations;
+    pthread_mutex_unlock(&arenas_lock);
+    return migrations;
+}
+
+/* Index of the arena of the current thread, -1 if it has none yet */
+int
+liarena_index()
+{
+    return (__arena == NULL) ? -1 : (int)(__arena - arenas);
+}
+
+/* Collect the usage of the arena, chunks in thread caches are not counted */
+void
+liarena_stats_get(int idx, liarena_stats* stats)
+{
+    assert(idx >= 0 && idx < LI_ARENA_MAX);
+    
+    arena* arena_ptr = &(arenas[idx]);
+    memset(stats, 0, sizeof(*stats));
+    
+    pthread_mutex_lock(&(arena_ptr->lock));
+    
+    stats->threads    = arena_ptr->threads;
+    stats->orphaned   = arena_ptr->orphaned;
+    stats->pool       = arena_ptr->pool_count;
+    stats->empty_segments = arena_ptr->empty_count;
+    stats->lock_count = arena_ptr->lock_count;
+    stats->lock_waits = arena_ptr->lock_waits;
+    stats->wait_ns    = arena_ptr->wait_ns;
+    stats->reserve    = arena_ptr->reserve_count;
+    stats->remote_frees = __atomic_load_n(&(arena_ptr->remote_frees), __ATOMIC_RELAXED);
+    
+    stats->medium_segments = arena_ptr->medium_count;
+    if (arena_ptr->medium_spare != NULL) {
+        stats->medium_free_bytes = (LI_MEDIUM_PAGES - 1) * PAGE_SIZE;
+    }
+    for (int cc = 1; cc < LI_MEDIUM_CLASSES; ++cc) {
+        for (medium_run* run = arena_ptr->medium_free[cc]; run != NULL; run = run->next) {
+            medium_seg* seg = medium_seg_of(run);
+            size_t start = ((char*)run - (char*)seg) / PAGE_SIZE;
+            stats->medium_free_bytes += seg->run_pages[start] * PAGE_SIZE;
+        }
+    }
+    
+    for (int bb = 0; bb < 2 * LI_BUCKET_COUNT; ++bb) {
+        bucket* bucket_ptr = &(arena_ptr->buckets[bb]);
+        libucket_stats* out = &(stats->buckets[bb]);
+        
+        out->chunk_size = bucket_ptr->chunk_size;
+        
+        for (page* pp = bucket_ptr->page_head; pp != NULL; pp = pp->next) {
+            out->segments += 1;
+        }
+        for (chunk* cc = bucket_ptr->chunk_head; cc != NULL; cc = cc->next) {
+            out->free_chunks += 1;
+            out->free_bytes += bucket_ptr->chunk_size;
+        }
+        if (bucket_ptr->cur != NULL) {
+            out->fresh_bytes = bucket_ptr->end - bucket_ptr->cur;
+        }
+    }
+    
+    pthread_mutex_unlock(&(arena_ptr->lock));
+}
+
+/* Give free memory of one arena back to the system, returns bytes released */
+size_t
+liarena_purge(int idx)
+{
+    assert(idx >= 0 && idx < LI_ARENA_MAX);
+    
+    // chunks cached by this thread belong to its arena
+    if (&(arenas[idx]) == __arena) {
+        litcache_flush();
+    }
+    
+    pthread_mutex_lock(&(arenas[idx].lock));
+    size_t released = purge_arena(&(arenas[idx]));
+    pthread_mutex_unlock(&(arenas[idx].lock));
+    
+    return released;
+}
+
+/* Drain the remote queue of the arena unless its lock is busy, returns the
+ count of chunks moved to its buckets */
+size_t
+liarena_drain(int idx)
+{
+    assert(idx >= 0 && idx < LI_ARENA_MAX);
+    
+    arena* arena_ptr = &(arenas[idx]);
+    if (__atomic_load_n(&(arena_ptr->remote), __ATOMIC_RELAXED) == NULL
+        || !arena_trylock(arena_ptr)) {
+        return 0;
+    }
+    
+    size_t count = drain_remote(arena_ptr);
+    pthread_mutex_unlock(&(arena_ptr->lock));
+    
+    return count;
+}
+
+/* Carve a prefaulted segment for every bucket of the arena in use that has
+ no free chunks and less than low_bytes of fresh space left, and top up its
+ reserve to reserve.bytes. Returns bytes mapped */
+size_t
+liarena_refill(int idx, size_t low_bytes)
+{
+    assert(idx >= 0 && idx < LI_ARENA_MAX);
+    
+    arena* arena_ptr = &(arenas[idx]);
+    size_t classes = 0;
+    
+    arena_lock(arena_ptr);
+    for (int bb = 1; bb < LI_BUCKET_COUNT; ++bb) {
+        bucket* bucket_ptr = &(arena_ptr->buckets[bb]);
+        size_t fresh = (bucket_ptr->cur == NULL) ? 0
+                       : (size_t)(bucket_ptr->end - bucket_ptr->cur);
+        
+        if (bucket_ptr->page_head != NULL && bucket_ptr->chunk_head == NULL
+            && fresh < low_bytes) {
+            classes |= (size_t)1 << bb;
+        }
+    }
+    pthread_mutex_unlock(&(arena_ptr->lock));
+    
+    size_t reserve = __atomic_load_n(&(li_config.reserve_bytes), __ATOMIC_RELAXED);
+    size_t mapped = prewarm_arena(arena_ptr, 1, classes, reserve);
+    
+    if (mapped > 0) {
+        PROBE2(limalloc, arena_refill, idx, mapped);
+        lipressure_notify();
+    }
+    
+    return mapped;
+}
+
+/* Lock count of the arena, unchanged while the arena sits idle */
+size_t
+liarena_activity(int idx)
+{
+    assert(idx >= 0 && idx < LI_ARENA_MAX);
+    return __atomic_load_n(&(arenas[idx].lock_count), __ATOMIC_RELAXED);
+}
+
+/* Collect the usage of the transfer cache. A batch may be taken while it
+ is counted, so its chunks are not looked at */
+void
+litransfer_stats_get(litransfer_stats* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    
+    for (int bb = 1; bb < LI_BUCKET_COUNT; ++bb) {
+        for (int ss = 0; ss < LI_TRANSFER_SLOTS; ++ss) {
+            if (__atomic_load_n(&(transfer[bb][ss]), __ATOMIC_RELAXED) != NULL) {
+                stats->batches += 1;
+            }
+        }
+    }
+    
+    stats->spills = __atomic_load_n(&transfer_spills, __ATOMIC_RELAXED);
+}
+
+/* Give the thread cache of the current thread back to its arena */
+void
+litcache_flush()
+{
+    if (__arena == NULL) {
+        return;
+    }
+    
+    __lock_arena();
+    for (int bb = 1; bb < LI_BUCKET_COUNT; ++bb) {
+        __flush_bin(bb, 0);
+    }
+    __unlock_arena();
 }
@@ -4,6 +4,48 @@
 #ifndef limalloc_h
 #define limalloc_h
 
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* Size of a segment mapped from the system */
+#define LI_SEGMENT_SIZE (1024 * 1024)
+
+/* Most address space reserved for segments */
+#define LI_VM_RESERVE_MAX ((size_t)64 << 30)
+
+/* Most arenas a process can be configured with */
+#define LI_ARENA_MAX 64
+
+/* Number of buckets, bucket 0 holds big allocations */
+#define LI_BUCKET_COUNT 11
+
+/* Batches of freed chunks the transfer cache holds per bucket */
+#define LI_TRANSFER_SLOTS 16
+
+/* Biggest allocation served by a standard bucket */
+#define LI_MAX_BUCKET_SIZE 8192
+
+/* Standard sizes are looked up in steps of 16 bytes */
+#define LI_CLASS_STEP 16
+#define LI_CLASS_SLOTS (LI_MAX_BUCKET_SIZE / LI_CLASS_STEP + 1)
+
+/* Segment medium allocations are carved from as runs of pages */
+#define LI_MEDIUM_SEGMENT_SIZE (4 * 1024 * 1024)
+#define LI_MEDIUM_PAGES (LI_MEDIUM_SEGMENT_SIZE / 4096)
+
+/* Biggest medium allocation, bigger ones are mapped on their own */
+#define LI_MEDIUM_MAX_SIZE (1024 * 1024)
+
+/* Free run lists of an arena, one per page count, the last one holds
+ all runs of at least LI_MEDIUM_MAX_SIZE */
+#define LI_MEDIUM_CLASSES (LI_MEDIUM_MAX_SIZE / 4096 + 1)
+
+/* Allocation flags, lifetime hints keep their chunks in separate segments */
+#define LI_SHORT_LIVED  0x1
+#define LI_LONG_LIVED   0x2
+#define LI_ZERO         0x4
+
 /* Chunk of memory with specific size */
 typedef struct chunk {
     struct chunk*   next;
@@ -12,30 +54,383 @@ typedef struct chunk {
 /* Block of memory with variable size */
 typedef struct block {
     size_t          size;
-    struct block*   next;
 } block;
 
-/* Page represents big part of memory */
+struct arena;
+
+/* Page represents big part of memory. Segments of standard buckets count
+ their chunks outside the free lists of their owner, an empty one can be
+ given to any other bucket */
 typedef struct page {
     struct page*    next;
+    struct arena*   owner;
+    uint32_t        live;
+    uint32_t        empty;
 } page;
 
-/* Bucket to store memory of same size */
+/* Bucket to store memory of same size, chunks are carved from the
+ space between cur and end, recycled chunks go to the chunk list. The
+ space is dirty when it comes from a recycled segment */
 typedef struct bucket {
     chunk*  chunk_head;
-    block*  block_head;
     page*   page_head;
     size_t  chunk_size;
+    char*   cur;
+    char*   end;
+    int     cur_dirty;
 } bucket;
 
-/* Allocation arena for each thread */
+struct medium_seg;
+
+/* Free run of pages in a medium segment, lives in its first page */
+typedef struct medium_run {
+    struct medium_run*  next;
+    struct medium_run*  prev;
+} medium_run;
+
+/* Allocation arena, shared by the threads bound to it. Long lived chunks
+ have their own buckets after the default ones. Lock counters are updated
+ under the lock, waits count the acquisitions that found it held. Chunks
+ of the arena freed by threads of other arenas are pushed to remote
+ without the lock and drained into the buckets under it */
 typedef struct arena {
-    pthread_mutex_t lock;
-    bucket buckets[11];
+    pthread_mutex_t     lock;
+    bucket              buckets[2 * LI_BUCKET_COUNT];
+    int                 threads;
+    int                 orphaned;
+    page*               pool;
+    int                 pool_count;
+    int                 empty_count;
+    medium_run*         medium_free[LI_MEDIUM_CLASSES];
+    uint64_t            medium_mask[(LI_MEDIUM_CLASSES + 63) / 64];
+    struct medium_seg*  medium_spare;
+    int                 medium_count;
+    size_t              lock_count;
+    size_t              lock_waits;
+    size_t              wait_ns;
+    page*               reserve;
+    int                 reserve_count;
+    chunk*              remote;
+    size_t              remote_frees;
 } arena;
 
+/* Segment of short lived chunks, recycled whole once all of them are freed */
+typedef struct short_seg {
+    struct short_seg*   next;
+    arena*              owner;
+    size_t              live;
+} short_seg;
+
+/* Segment of medium runs. Page counts and free flags of the runs are
+ kept at their first and last page, the header takes the first page */
+typedef struct medium_seg {
+    arena*              owner;
+    size_t              used_pages;
+    size_t              touched;
+    uint16_t            run_pages[LI_MEDIUM_PAGES];
+    uint8_t             run_free[LI_MEDIUM_PAGES];
+} medium_seg;
+
+/* Free chunks of one bucket cached by a thread */
+typedef struct tbin {
+    chunk*  head;
+    int     count;
+} tbin;
+
+/* Thread cache in front of the arena */
+typedef struct tcache {
+    tbin    bins[LI_BUCKET_COUNT];
+    long    sample_left;
+} tcache;
+
+extern __thread tcache __tcache __attribute__((tls_model("initial-exec")));
+
 void* limalloc(size_t size);
 void  lifree(chunk* ptr);
 void* lirealloc(chunk* prev_ptr, size_t new_size);
+void* licalloc(size_t count, size_t size);
+void* limalloc_flags(size_t size, int flags);
+
+void* lisegment_map(size_t size);
+void  lisegment_unmap(void* ptr, size_t size);
+
+size_t lipurge();
+size_t limapped();
+size_t limalloc_prewarm(size_t bytes_per_class);
+
+
+/* ============================= VIRTUAL MEMORY ============================ */
+/* Range segments are carved from, base is NULL until it is reserved */
+extern char*  li_vm_base;
+extern size_t li_vm_size;
+
+/* Usage of the reserved range */
+typedef struct livm_stats {
+    size_t  reserved;
+    size_t  used;
+    size_t  committed;
+    size_t  free_bytes;
+    size_t  fallbacks;
+    size_t  merges;
+    size_t  decommit_fails;
+} livm_stats;
+
+void*  livm_map(size_t size);
+int    livm_unmap(void* ptr, size_t size);
+void   livm_stats_get(livm_stats* stats);
+
+
+/* ============================= PRESSURE ================================== */
+typedef void (*lipressure_cb)(size_t mapped, size_t limit, void* arg);
+
+void   lipressure_set_limit(size_t bytes);
+size_t lipressure_limit();
+int    lipressure_cgroup(const char* dir);
+int    lipressure_register(lipressure_cb cb, void* arg);
+void   lipressure_check(size_t size);
+void   lipressure_notify();
+
+
+/* ============================= CONTROL =================================== */
+/* Tunables, loaded from LIMALLOC_CONF at init and changed through lictl */
+typedef struct liconfig {
+    size_t  arena_count;
+    size_t  tcache_max;
+    size_t  tcache_fill_size;
+    size_t  pool_max;
+    size_t  stats_print;
+    size_t  arena_max;
+    size_t  migrate;
+    size_t  prewarm_bytes;
+    size_t  prewarm_classes;
+    size_t  reserve_bytes;
+    size_t  background;
+    size_t  background_interval_ms;
+    size_t  background_decay_ms;
+    size_t  background_low_bytes;
+    size_t  transfer_depth;
+    size_t  vm_reserve;
+    size_t  hist_sample;
+} liconfig;
+
+extern liconfig li_config;
+
+/* Usage of one bucket of an arena */
+typedef struct libucket_stats {
+    size_t  chunk_size;
+    size_t  segments;
+    size_t  free_chunks;
+    size_t  free_bytes;
+    size_t  fresh_bytes;
+} libucket_stats;
+
+/* Usage of an arena */
+typedef struct liarena_stats {
+    size_t          threads;
+    size_t          orphaned;
+    size_t          pool;
+    size_t          empty_segments;
+    size_t          medium_segments;
+    size_t          medium_free_bytes;
+    size_t          lock_count;
+    size_t          lock_waits;
+    size_t          wait_ns;
+    size_t          reserve;
+    size_t          remote_frees;
+    libucket_stats  buckets[2 * LI_BUCKET_COUNT];
+} liarena_stats;
+
+/* Usage of the transfer cache */
+typedef struct litransfer_stats {
+    size_t  batches;
+    size_t  spills;
+} litransfer_stats;
+
+int    liarena_set_count(size_t count);
+int    liarena_set_classes(const size_t* sizes, int count);
+size_t liarena_count();
+size_t liarena_migrations();
+int    liarena_index();
+void   liarena_stats_get(int idx, liarena_stats* stats);
+size_t liarena_purge(int idx);
+size_t liarena_drain(int idx);
+size_t liarena_refill(int idx, size_t low_bytes);
+size_t liarena_activity(int idx);
+void   litcache_flush();
+void   litransfer_stats_get(litransfer_stats* stats);
+
+int    libackground_start();
+void   libackground_stop();
+size_t libackground_wakeups();
+
+void   lictl_init();
+int    lictl(const char* name, void* oldp, size_t* oldlenp,
+             const void* newp, size_t newlen);
+void   lictl_dump(int fd);
+
+
+/* ============================= SIZE CLASSES ============================== */
+/* Chunk size of every bucket and the bucket of every 16 byte step, powers
+ of two unless a table was loaded at startup */
+extern size_t  li_class_sizes[LI_BUCKET_COUNT];
+extern uint8_t li_class_index[LI_CLASS_SLOTS];
+extern int     li_classes_custom;
+
+void   lihist_sample(size_t size);
+int    lihist_write(int fd);
+int    liclasses_load(const char* path);
+void   liclass_init();
+
+
+/* ============================= FAST PATH ================================= */
+/* Bucket index for the allocation size, 0 for big allocations. The class
+ table is filled for the powers of two as well, so there is no branch on
+ which table is loaded */
+static inline
+int
+li_bucket_index(size_t size)
+{
+    if (size > LI_MAX_BUCKET_SIZE) {
+        return 0;
+    }
+    return li_class_index[(size + LI_CLASS_STEP - 1) / LI_CLASS_STEP];
+}
+
+/* Allocation fast path, pops a chunk from the thread cache */
+static inline __attribute__((always_inline))
+void*
+limalloc_inline(size_t size)
+{
+    // constant big sizes never hit the thread cache
+    if (__builtin_constant_p(size) && size > LI_MAX_BUCKET_SIZE) {
+        return limalloc(size);
+    }
+
+    // a constant size reads a fixed slot of the class table
+    int bb = li_bucket_index(size);
+
+    tbin* bin = &(__tcache.bins[bb]);
+    chunk* ptr = bin->head;
+
+    if (__builtin_expect(ptr != NULL, 1)) {
+        bin->head = ptr->next;
+        bin->count -= 1;
+
+        // counts down to the next sampled size, limalloc counts misses
+        if (__builtin_expect(--__tcache.sample_left < 0, 0)) {
+            lihist_sample(size);
+        }
+        return ptr;
+    }
+
+    return limalloc(size);
+}
+
+
+/* ============================= REGIONS =================================== */
+/* Segment owned by a region, followed by bump space */
+typedef struct liregion_seg {
+    struct liregion_seg*    prev;
+    size_t                  size;
+} liregion_seg;
+
+/* Bump allocation region, lives at the start of its first segment */
+typedef struct liregion {
+    liregion_seg*   top;
+    char*           cur;
+    char*           end;
+    char*           base;
+} liregion;
+
+liregion* liregion_create();
+void*     liregion_alloc(liregion* region, size_t size);
+void*     liregion_mark(liregion* region);
+void      liregion_reset(liregion* region, void* mark);
+void      liregion_destroy(liregion* region);
+size_t    liregion_purge();
+
+
+/* ============================= CACHES ==================================== */
+#define LICACHE_MAG_SIZE 32
+
+/* Magazine, a stack of free objects of one cache */
+typedef struct licache_mag {
+    struct licache_mag* next;
+    int                 count;
+    void*               objs[LICACHE_MAG_SIZE];
+} licache_mag;
+
+/* Slab of objects of one cache */
+typedef struct licache_slab {
+    struct licache_slab*    next;
+    size_t                  size;
+} licache_slab;
+
+/* Cache of fixed size objects, lives at the start of its first slab */
+typedef struct licache {
+    pthread_mutex_t lock;
+    size_t          obj_size;
+    size_t          align;
+    void            (*ctor)(void* obj);
+    int             slot;
+    unsigned long   gen;
+    char*           cur;
+    char*           end;
+    licache_slab*   slabs;
+    licache_mag*    full;
+    licache_mag*    empty;
+} licache;
+
+licache* licache_create(size_t size, size_t align, void (*ctor)(void* obj));
+void*    licache_alloc(licache* cache);
+void     licache_free(licache* cache, void* ptr);
+void     licache_destroy(licache* cache);
+void     licache_thread_exit();
+
+
+/* ============================= EPOCHS ==================================== */
+void    liepoch_enter();
+void    liepoch_exit();
+void    lifree_deferred(void* ptr);
+size_t  liepoch_reclaim();
+size_t  liepoch_current();
+size_t  liepoch_pending();
+size_t  liepoch_reclaimed();
+void    liepoch_thread_exit();
+
+
+/* ============================= SHARED HEAPS ============================== */
+// state of a persistent heap once opened, 0 for a shared heap
+#define LISHM_CREATED    1
+#define LISHM_RESUMED    2
+#define LISHM_RECOVERED  3
+#define LISHM_RELOCATED  0x10
+
+struct shm_head;
+
+/* Mapping of a shared heap in this process, the heap itself is shared */
+typedef struct lishm {
+    int                 fd;
+    int                 state;
+    size_t              size;
+    char*               base;
+    struct shm_head*    head;
+} lishm;
+
+lishm*  lishm_create(const char* name, size_t size);
+lishm*  lishm_open(const char* name);
+lishm*  lishm_attach(int fd);
+void    lishm_detach(lishm* shm);
+int     lishm_unlink(const char* name);
+lishm*  lishm_persist(const char* path, size_t size, void* base);
+int     lishm_sync(lishm* shm);
+
+void*   lishm_alloc(lishm* shm, size_t size);
+void    lishm_free(lishm* shm, void* ptr);
+size_t  lishm_offset(lishm* shm, const void* ptr);
+void*   lishm_ptr(lishm* shm, size_t offset);
+void    lishm_set_root(lishm* shm, size_t offset);
+size_t  lishm_root(lishm* shm);
+size_t  lishm_used(lishm* shm);
 
 #endif /* limalloc_h */
@@ -0,0 +1,272 @@
+/*  LIMALLOC - lit malloc    */
+/*  by Oleksandr Litus       */
+
+/*  Memory pressure: a soft limit on mapped bytes and optional monitoring of
+    the cgroup v2 memory controller. Before mapping more memory over the
+    limit, or when the cgroup gets close to memory.high / memory.max or
+    reports memory stalls, the allocator flushes the thread cache, purges
+    free memory of the arenas and calls the registered callbacks. The limit
+    is soft, the mapping goes ahead afterwards. Callbacks run once the
+    allocator has dropped its locks, so they are free to release memory. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "limalloc.h"
+
+
+/* ============================= GLOBALS =================================== */
+#define CALLBACK_COUNT 8
+
+static const long    POLL_INTERVAL_NS = 100 * 1000 * 1000;
+static const double  PSI_THRESHOLD    = 10.0;
+static const size_t  HEADROOM_DIV     = 20;
+
+/* Registered pressure callback */
+typedef struct pressure_cb {
+    lipressure_cb   cb;
+    void*           arg;
+} pressure_cb;
+
+static size_t           limit_bytes = 0;
+
+static pthread_mutex_t  pressure_lock = PTHREAD_MUTEX_INITIALIZER;
+static pressure_cb      callbacks[CALLBACK_COUNT];
+static int              callback_count = 0;
+
+static char             cgroup_dir[PATH_MAX];
+static int              cgroup_on = 0;
+static long             cgroup_polled = 0;
+
+// set while the thread is handling pressure, purging may map nothing
+static __thread int     __in_pressure = 0;
+
+// pressure was seen under allocator locks, callbacks are due
+static __thread int     __notify_due   = 0;
+static __thread size_t  __notify_limit = 0;
+
+
+/* ============================= FUNCTIONS ================================= */
+static long   now_ns();
+static int    read_value(const char* name, size_t* value);
+static double read_psi();
+static int    cgroup_poll(size_t size, size_t* limit);
+
+void   lipressure_set_limit(size_t bytes);
+size_t lipressure_limit();
+int    lipressure_cgroup(const char* dir);
+int    lipressure_register(lipressure_cb cb, void* arg);
+void   lipressure_check(size_t size);
+void   lipressure_notify();
+
+
+
+/* ============================= UTILS ===================================== */
+/* Monotonic time in nanoseconds */
+static
+long
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+
+/* ============================= CGROUP ==================================== */
+/* Read a byte count from the cgroup file, "max" reads as no limit */
+static
+int
+read_value(const char* name, size_t* value)
+{
+    char path[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s/%s", cgroup_dir, name);
+
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+
+    char buf[64];
+    int ok = fgets(buf, sizeof(buf), file) != NULL;
+    fclose(file);
+
+    if (!ok) {
+        return 0;
+    }
+
+    *value = (strncmp(buf, "max", 3) == 0) ? SIZE_MAX
+                                             : strtoull(buf, NULL, 10);
+    return 1;
+}
+
+/* Read the share of time some tasks stalled on memory over the last 10s */
+static
+double
+read_psi()
+{
+    char path[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s/memory.pressure", cgroup_dir);
+
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return 0.0;
+    }
+
+    double avg10 = 0.0;
+    if (fscanf(file, "some avg10=%lf", &avg10) != 1) {
+        avg10 = 0.0;
+    }
+    fclose(file);
+
+    return avg10;
+}
+
+/* Check the cgroup at most once per interval, returns true under pressure */
+static
+int
+cgroup_poll(size_t size, size_t* limit)
+{
+    long now  = now_ns();
+    long last = __atomic_load_n(&cgroup_polled, __ATOMIC_RELAXED);
+
+    // only one thread polls per interval
+    if (now - last < POLL_INTERVAL_NS ||
+        !__atomic_compare_exchange_n(&cgroup_polled, &last, now, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    size_t current = 0;
+    size_t high    = SIZE_MAX;
+    size_t max     = SIZE_MAX;
+
+    if (!read_value("memory.current", &current)) {
+        return 0;
+    }
+    read_value("memory.high", &high);
+    read_value("memory.max", &max);
+
+    *limit = (high < max) ? high : max;
+
+    // keep some headroom below the limit
+    if (*limit != SIZE_MAX && current + size > *limit - *limit / HEADROOM_DIV) {
+        return 1;
+    }
+
+    return read_psi() >= PSI_THRESHOLD;
+}
+
+
+
+/* ============================= PRESSURE ================================== */
+/* Set the soft limit on mapped bytes, 0 removes it */
+void
+lipressure_set_limit(size_t bytes)
+{
+    __atomic_store_n(&limit_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/* Current soft limit on mapped bytes, 0 if there is none */
+size_t
+lipressure_limit()
+{
+    return __atomic_load_n(&limit_bytes, __ATOMIC_RELAXED);
+}
+
+/* Monitor the cgroup in dir, NULL for /sys/fs/cgroup.
+ Returns 0 on success, -1 if the directory has no memory controller */
+int
+lipressure_cgroup(const char* dir)
+{
+    dir = (dir == NULL) ? "/sys/fs/cgroup" : dir;
+
+    pthread_mutex_lock(&pressure_lock);
+
+    snprintf(cgroup_dir, sizeof(cgroup_dir), "%s", dir);
+
+    size_t current;
+    int ok = read_value("memory.current", &current);
+    __atomic_store_n(&cgroup_on, ok, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&pressure_lock);
+
+    return ok ? 0 : -1;
+}
+
+/* Register a callback called under memory pressure.
+ Returns 0 on success, -1 if there is no room left */
+int
+lipressure_register(lipressure_cb cb, void* arg)
+{
+    pthread_mutex_lock(&pressure_lock);
+
+    if (callback_count == CALLBACK_COUNT) {
+        pthread_mutex_unlock(&pressure_lock);
+        return -1;
+    }
+
+    callbacks[callback_count].cb  = cb;
+    callbacks[callback_count].arg = arg;
+    callback_count += 1;
+
+    pthread_mutex_unlock(&pressure_lock);
+    return 0;
+}
+
+/* Called before mapping size more bytes, handles pressure if there is any */
+void
+lipressure_check(size_t size)
+{
+    if (__in_pressure) {
+        return;
+    }
+
+    size_t limit = __atomic_load_n(&limit_bytes, __ATOMIC_RELAXED);
+    int over = limit != 0 && limapped() + size > limit;
+
+    if (!over && __atomic_load_n(&cgroup_on, __ATOMIC_ACQUIRE)) {
+        over = cgroup_poll(size, &limit);
+    }
+
+    if (!over) {
+        return;
+    }
+
+    __in_pressure = 1;
+    lipurge();
+    __in_pressure = 0;
+
+    __notify_due = 1;
+    __notify_limit = limit;
+}
+
+/* Call the callbacks if pressure was seen, with no allocator locks held */
+void
+lipressure_notify()
+{
+    if (!__notify_due || __in_pressure) {
+        return;
+    }
+
+    __notify_due = 0;
+    __in_pressure = 1;
+
+    pthread_mutex_lock(&pressure_lock);
+    int count = callback_count;
+    pressure_cb copy[CALLBACK_COUNT];
+    memcpy(copy, callbacks, sizeof(copy));
+    pthread_mutex_unlock(&pressure_lock);
+
+    for (int ii = 0; ii < count; ++ii) {
+        copy[ii].cb(limapped(), __notify_limit, copy[ii].arg);
+    }
+
+    __in_pressure = 0;
+}
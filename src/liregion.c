@@ -0,0 +1,236 @@
+/*  LIMALLOC - lit malloc    */
+/*  by Oleksandr Litus       */
+
+/*  Regions: bump allocation out of limalloc segments, released all at once.
+    Everything handed out by a region stays valid until the region is reset
+    past it or destroyed, there is no per-object free. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "limalloc.h"
+
+
+/* ============================= GLOBALS =================================== */
+#define REGION_POOL_MAX 8
+
+static const size_t  PAGE_SIZE        = 4096;
+static const size_t  SEG_SIZE         = LI_SEGMENT_SIZE;
+static const size_t  ALIGN_SIZE       = 16;
+
+// per-thread pool of standard segments released by regions
+static __thread liregion_seg*  __region_pool        = NULL;
+static __thread int            __region_pool_count  = 0;
+
+
+/* ============================= FUNCTIONS ================================= */
+static size_t align_up(size_t size, size_t align);
+static char*  seg_start(liregion_seg* seg);
+static char*  seg_end(liregion_seg* seg);
+
+static liregion_seg* seg_get(size_t size);
+static void          seg_put(liregion_seg* seg);
+static int           seg_contains(liregion_seg* seg, char* ptr);
+
+liregion* liregion_create();
+void*     liregion_alloc(liregion* region, size_t size);
+void*     liregion_mark(liregion* region);
+void      liregion_reset(liregion* region, void* mark);
+void      liregion_destroy(liregion* region);
+size_t    liregion_purge();
+
+
+
+/* ============================= UTILS ===================================== */
+/* Round size up to the multiple of align */
+static
+size_t
+align_up(size_t size, size_t align)
+{
+    return (size + align - 1) & ~(align - 1);
+}
+
+/* First usable byte of the segment */
+static
+char*
+seg_start(liregion_seg* seg)
+{
+    return ((char*)seg) + align_up(sizeof(liregion_seg), ALIGN_SIZE);
+}
+
+/* Byte right after the end of the segment */
+static
+char*
+seg_end(liregion_seg* seg)
+{
+    return ((char*)seg) + seg->size;
+}
+
+
+
+/* ============================= SEGMENT POOL ============================== */
+/* Get a segment with at least size usable bytes, reusing pooled ones */
+static
+liregion_seg*
+seg_get(size_t size)
+{
+    size_t need = align_up(sizeof(liregion_seg), ALIGN_SIZE) + size;
+
+    // standard segment, try the thread pool first
+    if (need <= SEG_SIZE) {
+        liregion_seg* seg = __region_pool;
+
+        if (seg != NULL) {
+            __region_pool = seg->prev;
+            __region_pool_count -= 1;
+            seg->prev = NULL;
+            return seg;
+        }
+
+        need = SEG_SIZE;
+    }
+
+    // oversized segment, rounded to the system page
+    else {
+        need = align_up(need, PAGE_SIZE);
+    }
+
+    liregion_seg* seg = lisegment_map(need);
+    seg->prev = NULL;
+    seg->size = need;
+
+    return seg;
+}
+
+/* Return the segment to the thread pool or to the system */
+static
+void
+seg_put(liregion_seg* seg)
+{
+    assert(seg != NULL);
+
+    if (seg->size == SEG_SIZE && __region_pool_count < REGION_POOL_MAX) {
+        seg->prev = __region_pool;
+        __region_pool = seg;
+        __region_pool_count += 1;
+        return;
+    }
+
+    lisegment_unmap(seg, seg->size);
+}
+
+/* Check if ptr points into the usable space of the segment */
+static
+int
+seg_contains(liregion_seg* seg, char* ptr)
+{
+    return ptr >= seg_start(seg) && ptr <= seg_end(seg);
+}
+
+
+
+/* ============================= REGION ==================================== */
+/* Create a new empty region */
+liregion*
+liregion_create()
+{
+    liregion_seg* seg = seg_get(sizeof(liregion));
+
+    // region header is the first allocation of its first segment
+    liregion* region = (liregion*)seg_start(seg);
+    region->top  = seg;
+    region->cur  = seg_start(seg) + align_up(sizeof(liregion), ALIGN_SIZE);
+    region->end  = seg_end(seg);
+    region->base = region->cur;
+
+    return region;
+}
+
+/* Bump allocate size bytes from the region */
+void*
+liregion_alloc(liregion* region, size_t size)
+{
+    assert(region != NULL);
+
+    size = (size == 0) ? ALIGN_SIZE : align_up(size, ALIGN_SIZE);
+
+    // fast path, enough space in the current segment
+    if (size <= (size_t)(region->end - region->cur)) {
+        void* ptr = region->cur;
+        region->cur += size;
+        return ptr;
+    }
+
+    // push a new segment on top of the region
+    liregion_seg* seg = seg_get(size);
+    seg->prev = region->top;
+    region->top = seg;
+
+    void* ptr = seg_start(seg);
+    region->cur = seg_start(seg) + size;
+    region->end = seg_end(seg);
+
+    return ptr;
+}
+
+/* Remember the current position of the region for a later reset */
+void*
+liregion_mark(liregion* region)
+{
+    assert(region != NULL);
+    return region->cur;
+}
+
+/* Free everything allocated after mark, or everything if mark is NULL */
+void
+liregion_reset(liregion* region, void* mark)
+{
+    assert(region != NULL);
+
+    char* pos = (mark == NULL) ? region->base : (char*)mark;
+
+    // release segments allocated after the mark was taken
+    while (!seg_contains(region->top, pos)) {
+        liregion_seg* seg = region->top;
+        region->top = seg->prev;
+        assert(region->top != NULL);
+        seg_put(seg);
+    }
+
+    region->cur = pos;
+    region->end = seg_end(region->top);
+}
+
+/* Release the region and all of its memory */
+void
+liregion_destroy(liregion* region)
+{
+    assert(region != NULL);
+
+    liregion_seg* seg = region->top;
+    while (seg != NULL) {
+        liregion_seg* prev = seg->prev;
+        seg_put(seg);
+        seg = prev;
+    }
+}
+
+/* Unmap the segment pool of the current thread, returns bytes released */
+size_t
+liregion_purge()
+{
+    size_t released = 0;
+
+    while (__region_pool != NULL) {
+        liregion_seg* seg = __region_pool;
+        __region_pool = seg->prev;
+        released += seg->size;
+        lisegment_unmap(seg, seg->size);
+    }
+    __region_pool_count = 0;
+
+    return released;
+}
@@ -0,0 +1,659 @@
+/*  LIMALLOC - lit malloc    */
+/*  by Oleksandr Litus       */
+
+/*  Shared heaps: a heap in a memfd or POSIX shared memory object, mapped by
+    several processes at once. The heap may sit at a different address in
+    every process, so everything stored inside it refers to other objects by
+    offset from the heap base. Blocks are powers of two, kept on per-class
+    free lists of offsets. A larger free block is split when its class runs
+    dry, blocks are never merged. All bookkeeping is guarded by a robust
+    process-shared mutex, so a process dying while holding it does not
+    stall the others, the next one to take the lock rebuilds the free lists
+    from the block headers.
+
+    A persistent heap is the same heap in a regular file, kept across
+    restarts. It is mapped back at the address it was created at when that
+    address is free. A clean flag in the header is cleared while the heap
+    is open, a heap found unclean is recovered by walking its blocks, which
+    tile the heap from the header to the top. */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "limalloc.h"
+
+
+/* ============================= GLOBALS =================================== */
+#define SHM_CLASS_COUNT 48
+
+static const uint64_t SHM_MAGIC        = 0x6c6973686d303031;
+static const uint32_t BLOCK_USED       = 0x75736564;
+static const uint32_t BLOCK_FREE       = 0x66726565;
+static const size_t   PAGE_SIZE        = 4096;
+static const size_t   MIN_HEAP_SIZE    = 64 * 1024;
+static const int      MIN_CLASS        = 5;
+
+/* Header at offset 0 of the heap, shared by all processes */
+typedef struct shm_head {
+    uint64_t        magic;
+    size_t          size;
+    uintptr_t       base;
+    uint64_t        clean;
+    pthread_mutex_t lock;
+    size_t          top;
+    size_t          root;
+    size_t          attached;
+    size_t          used;
+    size_t          free[SHM_CLASS_COUNT];
+} shm_head;
+
+/* Header in front of every block, the free list link follows it */
+typedef struct shm_block {
+    uint32_t    cls;
+    uint32_t    tag;
+    uint64_t    pad;
+} shm_block;
+
+
+/* ============================= FUNCTIONS ================================= */
+static size_t      align_up(size_t size, size_t align);
+static int         block_class(size_t size);
+static shm_block*  block_at(lishm* shm, size_t offset);
+static size_t*     block_link(shm_block* block);
+
+static void        shm_lock(lishm* shm);
+static void        shm_init_lock(lishm* shm);
+static void        shm_unlock(lishm* shm);
+static lishm*      shm_map(int fd, void* base);
+static void        shm_init(lishm* shm);
+static void        shm_sync(lishm* shm, size_t size);
+static void        shm_recover(lishm* shm);
+static size_t      __pop_block(lishm* shm, int cls);
+static void        __push_block(lishm* shm, size_t offset, int cls);
+
+lishm*  lishm_create(const char* name, size_t size);
+lishm*  lishm_open(const char* name);
+lishm*  lishm_attach(int fd);
+void    lishm_detach(lishm* shm);
+int     lishm_unlink(const char* name);
+lishm*  lishm_persist(const char* path, size_t size, void* base);
+int     lishm_sync(lishm* shm);
+
+void*   lishm_alloc(lishm* shm, size_t size);
+void    lishm_free(lishm* shm, void* ptr);
+size_t  lishm_offset(lishm* shm, const void* ptr);
+void*   lishm_ptr(lishm* shm, size_t offset);
+void    lishm_set_root(lishm* shm, size_t offset);
+size_t  lishm_root(lishm* shm);
+size_t  lishm_used(lishm* shm);
+
+
+
+/* ============================= UTILS ===================================== */
+/* Round size up to the multiple of align */
+static
+size_t
+align_up(size_t size, size_t align)
+{
+    return (size + align - 1) & ~(align - 1);
+}
+
+/* Class of the block serving size bytes, blocks are 1 << class bytes */
+static
+int
+block_class(size_t size)
+{
+    size_t need = size + sizeof(shm_block);
+    int cls = 64 - __builtin_clzl(need - 1);
+    return (cls < MIN_CLASS) ? MIN_CLASS : cls;
+}
+
+/* Block at the offset from the heap base */
+static
+shm_block*
+block_at(lishm* shm, size_t offset)
+{
+    assert(offset >= sizeof(shm_head) && offset < shm->size);
+    return (shm_block*)(shm->base + offset);
+}
+
+/* Free list link of a free block, stored right after its header */
+static
+size_t*
+block_link(shm_block* block)
+{
+    return (size_t*)(block + 1);
+}
+
+
+
+/* ============================= LOCKING =================================== */
+/* Lock the heap, recovering the lock if its holder died */
+static
+void
+shm_lock(lishm* shm)
+{
+    int rv = pthread_mutex_lock(&(shm->head->lock));
+
+    // owner died halfway through a change of the lists or counters, the
+    // block headers are always consistent. Blocks it held stay used
+    if (rv == EOWNERDEAD) {
+        shm_recover(shm);
+        pthread_mutex_consistent(&(shm->head->lock));
+        rv = 0;
+    }
+
+    assert(rv == 0);
+}
+
+/* Initialize the robust process-shared lock of the heap */
+static
+void
+shm_init_lock(lishm* shm)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&(shm->head->lock), &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+/* Unlock the heap */
+static
+void
+shm_unlock(lishm* shm)
+{
+    pthread_mutex_unlock(&(shm->head->lock));
+}
+
+
+
+/* ============================= MAPPING =================================== */
+/* Map the heap behind fd, at base if that range is free. Returns NULL
+ on failure */
+static
+lishm*
+shm_map(int fd, void* base)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < MIN_HEAP_SIZE) {
+        return NULL;
+    }
+
+    size_t size = st.st_size;
+    int flags = MAP_SHARED | ((base != NULL) ? MAP_FIXED_NOREPLACE : 0);
+    char* raw = mmap(base, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+
+    // range is taken, the heap is relocatable so map it anywhere
+    if (raw == MAP_FAILED && base != NULL) {
+        raw = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+
+    lishm* shm = limalloc(sizeof(lishm));
+    shm->fd    = fd;
+    shm->size  = size;
+    shm->base  = raw;
+    shm->head  = (shm_head*)raw;
+    shm->state = 0;
+
+    return shm;
+}
+
+/* Lay out an empty heap over the mapping, magic is published last */
+static
+void
+shm_init(lishm* shm)
+{
+    shm_head* head = shm->head;
+    shm_init_lock(shm);
+
+    head->size     = shm->size;
+    head->base     = (uintptr_t)shm->base;
+    head->clean    = 0;
+    head->top      = align_up(sizeof(shm_head), 1 << MIN_CLASS);
+    head->root     = 0;
+    head->attached = 1;
+    head->used     = 0;
+    memset(head->free, 0, sizeof(head->free));
+
+    // attaching processes check the magic, publish it last
+    __atomic_store_n(&(head->magic), SHM_MAGIC, __ATOMIC_RELEASE);
+}
+
+/* Create a shared heap of size bytes. With name NULL the heap is an
+ anonymous memfd, shared by fork or by passing its fd. Otherwise it is a
+ new POSIX shared memory object other processes can open by name */
+lishm*
+lishm_create(const char* name, size_t size)
+{
+    size = align_up((size < MIN_HEAP_SIZE) ? MIN_HEAP_SIZE : size, PAGE_SIZE);
+
+    int fd = (name == NULL) ? memfd_create("lishm", MFD_CLOEXEC)
+                            : shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (ftruncate(fd, size) != 0) {
+        close(fd);
+        if (name != NULL) shm_unlink(name);
+        return NULL;
+    }
+
+    lishm* shm = shm_map(fd, NULL);
+    if (shm == NULL) {
+        close(fd);
+        if (name != NULL) shm_unlink(name);
+        return NULL;
+    }
+
+    shm_init(shm);
+    return shm;
+}
+
+/* Open the shared heap created under name by another process */
+lishm*
+lishm_open(const char* name)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    lishm* shm = lishm_attach(fd);
+    if (shm == NULL) {
+        close(fd);
+    }
+
+    return shm;
+}
+
+/* Attach to the shared heap behind fd, the heap takes over the fd.
+ Returns NULL if fd does not hold a shared heap */
+lishm*
+lishm_attach(int fd)
+{
+    lishm* shm = shm_map(fd, NULL);
+    if (shm == NULL) {
+        return NULL;
+    }
+
+    if (__atomic_load_n(&(shm->head->magic), __ATOMIC_ACQUIRE) != SHM_MAGIC ||
+        shm->head->size != shm->size) {
+        munmap(shm->base, shm->size);
+        lifree((chunk*)shm);
+        return NULL;
+    }
+
+    shm_lock(shm);
+    shm->head->attached += 1;
+    shm_unlock(shm);
+
+    return shm;
+}
+
+/* Unmap the heap from this process. The memory stays valid for the other
+ processes, it is released when the last one detaches. A persistent heap
+ is written back and marked clean first */
+void
+lishm_detach(lishm* shm)
+{
+    assert(shm != NULL);
+
+    shm_lock(shm);
+    shm->head->attached -= 1;
+    shm_unlock(shm);
+
+    if (shm->state != 0) {
+        shm_sync(shm, shm->size);
+        shm->head->clean = 1;
+        shm_sync(shm, PAGE_SIZE);
+    }
+
+    munmap(shm->base, shm->size);
+    close(shm->fd);
+    lifree((chunk*)shm);
+}
+
+/* Remove the name of a named heap, attached processes keep their mapping */
+int
+lishm_unlink(const char* name)
+{
+    return shm_unlink(name) == 0 ? 0 : errno;
+}
+
+
+
+/* ============================= PERSISTENCE =============================== */
+/* Write the first size bytes of the heap back to its file */
+static
+void
+shm_sync(lishm* shm, size_t size)
+{
+    int rv = msync(shm->base, size, MS_SYNC);
+    assert(rv == 0);
+}
+
+/* Rebuild the free lists and counters of a heap that was not closed
+ cleanly or whose lock holder died, under lock. Blocks tile the heap up to top, each header gives the size and
+ state of its block. A block split or popped when the process died still
+ carries the header of the block it came from, so it is found whole */
+static
+void
+shm_recover(lishm* shm)
+{
+    shm_head* head = shm->head;
+
+    memset(head->free, 0, sizeof(head->free));
+    head->used = 0;
+
+    size_t offset = align_up(sizeof(shm_head), 1 << MIN_CLASS);
+    while (offset < head->top) {
+        shm_block* block = block_at(shm, offset);
+        size_t size = (size_t)1 << block->cls;
+
+        // a torn header ends the walk, the rest is given up
+        if (block->cls < MIN_CLASS || block->cls >= SHM_CLASS_COUNT ||
+            offset + size > head->top ||
+            (block->tag != BLOCK_USED && block->tag != BLOCK_FREE)) {
+            head->top = offset;
+            break;
+        }
+
+        if (block->tag == BLOCK_FREE) {
+            __push_block(shm, offset, block->cls);
+        }
+        else {
+            head->used += size;
+        }
+
+        offset += size;
+    }
+}
+
+/* Open the persistent heap in the file at path, creating it with size
+ bytes if it does not exist. The heap is mapped at base, or at the address
+ it was first mapped at, when that range is free. Only one process may have
+ the file open, NULL is returned if another one has */
+lishm*
+lishm_persist(const char* path, size_t size, void* base)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    // new file, or one that never got its header written: the creator
+    // may have died between ftruncate and shm_init, which leaves the file
+    // full size with a zeroed header
+    shm_head old;
+    int fresh = (size_t)st.st_size < sizeof(shm_head)
+                || pread(fd, &old, sizeof(old), 0) != sizeof(old)
+                || old.magic == 0;
+    if (fresh) {
+        size = align_up((size < MIN_HEAP_SIZE) ? MIN_HEAP_SIZE : size, PAGE_SIZE);
+        if (ftruncate(fd, size) != 0) {
+            close(fd);
+            return NULL;
+        }
+    }
+
+    // the header remembers where the heap was mapped
+    else if (base == NULL && old.magic == SHM_MAGIC) {
+        base = (void*)old.base;
+    }
+
+    lishm* shm = shm_map(fd, base);
+    if (shm == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    shm_head* head = shm->head;
+
+    if (fresh) {
+        shm_init(shm);
+        shm->state = LISHM_CREATED;
+    }
+    else if (head->magic != SHM_MAGIC || head->size != shm->size) {
+        munmap(shm->base, shm->size);
+        close(fd);
+        lifree((chunk*)shm);
+        return NULL;
+    }
+    else {
+        // the file is ours alone, the lock may still be held by the dead
+        shm_init_lock(shm);
+
+        if (head->clean) {
+            shm->state = LISHM_RESUMED;
+        }
+        else {
+            shm_recover(shm);
+            shm->state = LISHM_RECOVERED;
+        }
+    }
+
+    if (head->base != (uintptr_t)shm->base) {
+        shm->state |= LISHM_RELOCATED;
+    }
+
+    // a crash from here on is found by the next open
+    head->base     = (uintptr_t)shm->base;
+    head->attached = 1;
+    head->clean    = 0;
+    shm_sync(shm, PAGE_SIZE);
+
+    return shm;
+}
+
+/* Write a persistent heap back to its file, returns 0 or an errno value */
+int
+lishm_sync(lishm* shm)
+{
+    assert(shm != NULL);
+    return msync(shm->base, shm->size, MS_SYNC) == 0 ? 0 : errno;
+}
+
+
+
+/* ============================= BLOCKS ==================================== */
+/* Pop a block of the class, splitting a bigger one if needed, and mark it
+ used, under lock. Every step leaves headers a walk of the heap can follow,
+ a block only moves into the walk once its header is written. Returns 0 if
+ the heap has no block to give */
+static
+size_t
+__pop_block(lishm* shm, int cls)
+{
+    shm_head* head = shm->head;
+
+    size_t offset = head->free[cls];
+    if (offset != 0) {
+        shm_block* block = block_at(shm, offset);
+        head->free[cls] = *block_link(block);
+        block->tag = BLOCK_USED;
+        return offset;
+    }
+
+    // carve from the untouched end of the heap, blocks stay size aligned
+    size_t size = (size_t)1 << cls;
+    size_t top  = align_up(head->top, size);
+    if (top + size <= head->size) {
+        // gap left by the alignment goes to the free lists
+        while (head->top < top) {
+            int gap = __builtin_ctzl(head->top);
+            if (head->top + ((size_t)1 << gap) > top) {
+                gap = 63 - __builtin_clzl(top - head->top);
+            }
+            __push_block(shm, head->top, gap);
+            __atomic_store_n(&(head->top), head->top + ((size_t)1 << gap),
+                             __ATOMIC_RELEASE);
+        }
+
+        shm_block* block = block_at(shm, top);
+        block->cls = cls;
+        block->tag = BLOCK_USED;
+        __atomic_store_n(&(head->top), top + size, __ATOMIC_RELEASE);
+        return top;
+    }
+
+    // split the smallest bigger free block, halves go to the lists below
+    for (int cc = cls + 1; cc < SHM_CLASS_COUNT; ++cc) {
+        offset = head->free[cc];
+        if (offset == 0) {
+            continue;
+        }
+
+        shm_block* block = block_at(shm, offset);
+        head->free[cc] = *block_link(block);
+
+        // the halves are skipped by a walk until the class shrinks
+        while (cc > cls) {
+            cc -= 1;
+            __push_block(shm, offset + ((size_t)1 << cc), cc);
+        }
+
+        block->cls = cls;
+        __atomic_store_n(&(block->tag), BLOCK_USED, __ATOMIC_RELEASE);
+        return offset;
+    }
+
+    return 0;
+}
+
+/* Push a free block on the list of its class, under lock */
+static
+void
+__push_block(lishm* shm, size_t offset, int cls)
+{
+    shm_block* block = block_at(shm, offset);
+    block->cls = cls;
+    block->tag = BLOCK_FREE;
+
+    *block_link(block) = shm->head->free[cls];
+    shm->head->free[cls] = offset;
+}
+
+/* Allocate size bytes from the shared heap, NULL if it is full */
+void*
+lishm_alloc(lishm* shm, size_t size)
+{
+    assert(shm != NULL);
+
+    // bigger than the biggest class, also keeps size + header from wrapping
+    if (size > ((size_t)1 << (SHM_CLASS_COUNT - 1)) - sizeof(shm_block)) {
+        return NULL;
+    }
+
+    int cls = block_class(size);
+
+    shm_lock(shm);
+    size_t offset = __pop_block(shm, cls);
+    if (offset != 0) {
+        shm->head->used += (size_t)1 << cls;
+    }
+    shm_unlock(shm);
+
+    if (offset == 0) {
+        return NULL;
+    }
+
+    return block_at(shm, offset) + 1;
+}
+
+/* Free memory of the shared heap, from any attached process */
+void
+lishm_free(lishm* shm, void* ptr)
+{
+    assert(shm != NULL);
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    shm_block* block = ((shm_block*)ptr) - 1;
+    assert(block->tag == BLOCK_USED);
+
+    int cls = block->cls;
+    size_t offset = (char*)block - shm->base;
+
+    shm_lock(shm);
+    __push_block(shm, offset, cls);
+    shm->head->used -= (size_t)1 << cls;
+    shm_unlock(shm);
+}
+
+
+
+/* ============================= OFFSETS =================================== */
+/* Offset of ptr from the heap base, 0 for NULL. Offsets are the same in
+ every process and are what should be stored inside the heap */
+size_t
+lishm_offset(lishm* shm, const void* ptr)
+{
+    if (ptr == NULL) {
+        return 0;
+    }
+
+    assert((char*)ptr > shm->base && (char*)ptr < shm->base + shm->size);
+    return (char*)ptr - shm->base;
+}
+
+/* Pointer to the offset in this process, NULL for 0 */
+void*
+lishm_ptr(lishm* shm, size_t offset)
+{
+    if (offset == 0) {
+        return NULL;
+    }
+
+    assert(offset < shm->size);
+    return shm->base + offset;
+}
+
+/* Publish the offset of the object other processes should start from */
+void
+lishm_set_root(lishm* shm, size_t offset)
+{
+    __atomic_store_n(&(shm->head->root), offset, __ATOMIC_RELEASE);
+}
+
+/* Offset of the published root object, 0 if there is none */
+size_t
+lishm_root(lishm* shm)
+{
+    return __atomic_load_n(&(shm->head->root), __ATOMIC_ACQUIRE);
+}
+
+/* Bytes of the heap taken by live blocks, headers included */
+size_t
+lishm_used(lishm* shm)
+{
+    shm_lock(shm);
+    size_t used = shm->head->used;
+    shm_unlock(shm);
+    return used;
+}
@@ -0,0 +1,212 @@
+// The Collatz conjecture:
+//
+// If we start with some number n and iterate the following:
+// - If x is even, n -> n/2
+// - If x is odd,  n -> 3*n + 1
+// We'll eventually get to 1.
+
+// This program searches for the largest number of steps that
+// this takes for numbers from 2 to a provided TOP number.
+
+// Same work as list_main.c, with the lists in regions:
+//  - every thread has a region, tasks are taken in batches of
+//    BATCH numbers.
+//  - the lists of a batch, with the copies list_main.c frees after
+//    every pass, stay in the region until the batch is done and the
+//    region is reset to its mark, so no cell is ever freed on its own.
+//  - the check of every list is a nested mark inside the batch,
+//    reset as soon as it is done.
+//  - every REGION_TASKS numbers the region is destroyed and created
+//    again, its segments come back from the pool of the thread.
+// Resets must hand the marked memory out again, and a new region
+// must start in the segment the destroyed one started in.
+
+#include <stdio.h>
+#include <pthread.h>
+#include <assert.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include "xmalloc.h"
+
+#define THREADS 4
+#define BATCH 64
+#define REGION_TASKS 4096
+
+long* steps;
+long data_top = 0;
+long next_task = 1;
+
+long resets = 0;
+long bad = 0;
+
+// Linked list cell, as in list.h
+typedef struct cell {
+    long         item;
+    struct cell* rest;
+} cell;
+
+long
+collatz_step(long n)
+{
+    if (n % 2 == 0) {
+        return n/2;
+    }
+    else {
+        return 3*n + 1;
+    }
+}
+
+cell*
+rcons(xregion* region, long item, cell* rest)
+{
+    cell* xs = xregion_alloc(region, sizeof(cell));
+    xs->item = item;
+    xs->rest = rest;
+    return xs;
+}
+
+cell*
+rcopy_list(xregion* region, cell* xs)
+{
+    if (xs == 0) {
+        return 0;
+    }
+
+    cell* ys = rcopy_list(region, xs->rest);
+    return rcons(region, xs->item, ys);
+}
+
+long
+count_list(cell* xs)
+{
+    long nn = 0;
+    while (xs) {
+        nn++;
+        xs = xs->rest;
+    }
+    return nn;
+}
+
+cell*
+iterate(xregion* region, cell* xs)
+{
+    long vv = 0;
+    for (int jj = 0; vv != 1 && jj < 50; ++jj) {
+        vv = collatz_step(xs->item);
+        xs = rcons(region, vv, xs);
+    }
+    return xs;
+}
+
+// steps of the number, its lists stay in the region
+long
+run_task(xregion* region, long ii, long* my_bad)
+{
+    cell* xs = rcons(region, ii, 0);
+    while (xs->item > 1) {
+        xs = iterate(region, rcopy_list(region, xs));
+    }
+
+    // count a copy, then check the reset hands its memory out again
+    void* check_mark = xregion_mark(region);
+    void* probe = xregion_alloc(region, sizeof(cell));
+    long nn = count_list(rcopy_list(region, xs));
+    xregion_reset(region, check_mark);
+    if (xregion_alloc(region, sizeof(cell)) != probe) {
+        *my_bad += 1;
+    }
+    if (nn != count_list(xs)) {
+        *my_bad += 1;
+    }
+
+    return nn - 1;
+}
+
+void*
+worker(void* _arg)
+{
+    xregion* region = xregion_create();
+    void* first = xregion_mark(region);
+    long done = 0;
+    long my_resets = 0;
+    long my_bad = 0;
+
+    for (;;) {
+        long lo = __atomic_fetch_add(&next_task, BATCH, __ATOMIC_RELAXED);
+        if (lo >= data_top) {
+            break;
+        }
+        long hi = (lo + BATCH < data_top) ? lo + BATCH : data_top;
+
+        void* batch_mark = xregion_mark(region);
+        for (long ii = lo; ii < hi; ++ii) {
+            steps[ii] = run_task(region, ii, &my_bad);
+        }
+        xregion_reset(region, batch_mark);
+        my_resets += 1;
+
+        done += hi - lo;
+        if (done >= REGION_TASKS) {
+            xregion_destroy(region);
+            region = xregion_create();
+            if (xregion_mark(region) != first) {
+                my_bad += 1;
+            }
+            done = 0;
+        }
+    }
+
+    xregion_destroy(region);
+
+    __atomic_add_fetch(&resets, my_resets, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bad, my_bad, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    pthread_t threads[THREADS];
+    int rv;
+
+    if (argc != 2) {
+        printf("Usage:\n");
+        printf("\t%s TOP\n", argv[0]);
+        return 1;
+    }
+
+    data_top = atol(argv[1]);
+
+    steps = xmalloc(data_top * sizeof(long));
+    for (long ii = 0; ii < data_top; ++ii) {
+        steps[ii] = -1;
+    }
+
+    for (int ii = 0; ii < THREADS; ++ii) {
+        rv = pthread_create(&(threads[ii]), 0, worker, 0);
+        assert(rv == 0);
+    }
+
+    for (int ii = 0; ii < THREADS; ++ii) {
+        rv = pthread_join(threads[ii], 0);
+        assert(rv == 0);
+    }
+
+    long max_v = 0;
+    long max_s = 0;
+
+    for (long ii = 0; ii < data_top; ++ii) {
+        if (steps[ii] > max_s) {
+            max_v = ii;
+            max_s = steps[ii];
+        }
+    }
+
+    printf("Max steps is at %ld: %ld steps\n", max_v, max_s);
+    printf("regions: %ld batch resets, %ld bad\n", resets, bad);
+
+    xfree(steps);
+
+    return 0;
+}
@@ -0,0 +1,302 @@
+/*  LIMALLOC - lit malloc    */
+/*  by Oleksandr Litus       */
+
+/*  Virtual memory: one range of address space reserved at the first
+    segment map, PROT_NONE and MAP_NORESERVE, so it costs neither memory nor
+    commit charge. Segments are carved from it aligned to their size and
+    committed with mprotect when handed out, committed neighbours merge into
+    one mapping. A freed segment is decommitted by mapping PROT_NONE over it
+    and kept for reuse, 1 MB segments split free 4 MB ones before the range
+    grows and four free 1 MB segments of one aligned 4 MB slot merge back
+    into it. Segments live in their own slot of a flat table, so the class of
+    a pointer is an index instead of a tree walk. Once the range is full, or
+    if it could not be reserved, callers map segments on their own. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "limalloc.h"
+#include "probe.h"
+
+
+/* ============================= GLOBALS =================================== */
+#define SEG_SHIFT   20
+
+static const size_t  SEG_SIZE         = (size_t)1 << SEG_SHIFT;
+static const size_t  BIG_SIZE         = LI_MEDIUM_SEGMENT_SIZE;
+
+// free segments by size, 1 MB and 4 MB
+enum { FREE_SMALL, FREE_BIG, FREE_LISTS };
+
+// read without a lock, set once before the first segment is handed out
+char*   li_vm_base = NULL;
+size_t  li_vm_size = 0;
+
+static pthread_mutex_t  vm_lock = PTHREAD_MUTEX_INITIALIZER;
+static int              vm_tried = 0;
+
+// offset of the part of the range never handed out
+static size_t           vm_top = 0;
+
+// free lists link slots by index both ways, slot + 1 so 0 ends a list
+static uint32_t         free_heads[FREE_LISTS];
+static uint32_t         free_next[LI_VM_RESERVE_MAX >> SEG_SHIFT];
+static uint32_t         free_prev[LI_VM_RESERVE_MAX >> SEG_SHIFT];
+static size_t           free_counts[FREE_LISTS];
+
+// free 1 MB segments in every aligned 4 MB slot
+static uint8_t          group_free[LI_VM_RESERVE_MAX / LI_MEDIUM_SEGMENT_SIZE];
+
+static size_t           committed = 0;
+static size_t           fallbacks = 0;
+static size_t           merges = 0;
+static size_t           decommit_fails = 0;
+
+
+/* ============================= FUNCTIONS ================================= */
+static void   __reserve();
+static void   __push(int list, size_t off);
+static void   __unlink(int list, uint32_t slot);
+static size_t __pop(int list);
+static void*  __carve(size_t size);
+
+void*  livm_map(size_t size);
+int    livm_unmap(void* ptr, size_t size);
+void   livm_stats_get(livm_stats* stats);
+
+
+
+/* ============================= RANGE ===================================== */
+/* Reserve the range, aligned to the biggest segment, under lock */
+static
+void
+__reserve()
+{
+    vm_tried = 1;
+
+    size_t size = __atomic_load_n(&(li_config.vm_reserve), __ATOMIC_RELAXED);
+    size = (size > LI_VM_RESERVE_MAX) ? LI_VM_RESERVE_MAX : size;
+    size &= ~(BIG_SIZE - 1);
+    if (size == 0) {
+        return;
+    }
+
+    char* raw = mmap(NULL, size + BIG_SIZE, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED) {
+        return;
+    }
+
+    char* base = (char*)(((uintptr_t)raw + BIG_SIZE - 1) & ~(BIG_SIZE - 1));
+    if (base > raw) {
+        munmap(raw, base - raw);
+    }
+    munmap(base + size, raw + BIG_SIZE - base);
+
+    __atomic_store_n(&li_vm_size, size, __ATOMIC_RELAXED);
+    __atomic_store_n(&li_vm_base, base, __ATOMIC_RELEASE);
+
+    PROBE1(limalloc, vm_reserve, size);
+}
+
+/* Add the free segment at offset off to a list. The last free 1 MB
+ segment of a 4 MB slot takes the other three off the small list and the
+ slot goes to the big one, under lock */
+static
+void
+__push(int list, size_t off)
+{
+    uint32_t slot = off >> SEG_SHIFT;
+
+    if (list == FREE_SMALL && ++group_free[off / BIG_SIZE] == BIG_SIZE / SEG_SIZE) {
+        uint32_t first = (off & ~(BIG_SIZE - 1)) >> SEG_SHIFT;
+        for (uint32_t ss = first; ss < first + BIG_SIZE / SEG_SIZE; ++ss) {
+            if (ss != slot) {
+                __unlink(FREE_SMALL, ss);
+            }
+        }
+        group_free[off / BIG_SIZE] = 0;
+        merges += 1;
+
+        list = FREE_BIG;
+        slot = first;
+    }
+
+    free_next[slot] = free_heads[list];
+    free_prev[slot] = 0;
+    if (free_heads[list] != 0) {
+        free_prev[free_heads[list] - 1] = slot + 1;
+    }
+    free_heads[list] = slot + 1;
+    free_counts[list] += 1;
+}
+
+/* Take the free segment in slot off its list, under lock */
+static
+void
+__unlink(int list, uint32_t slot)
+{
+    uint32_t next = free_next[slot];
+    uint32_t prev = free_prev[slot];
+
+    if (prev == 0) {
+        free_heads[list] = next;
+    }
+    else {
+        free_next[prev - 1] = next;
+    }
+    if (next != 0) {
+        free_prev[next - 1] = prev;
+    }
+
+    free_counts[list] -= 1;
+    if (list == FREE_SMALL) {
+        group_free[((size_t)slot << SEG_SHIFT) / BIG_SIZE] -= 1;
+    }
+}
+
+/* Take a free segment from a list, returns its offset or SIZE_MAX, under
+ lock */
+static
+size_t
+__pop(int list)
+{
+    uint32_t head = free_heads[list];
+    if (head == 0) {
+        return SIZE_MAX;
+    }
+
+    __unlink(list, head - 1);
+    return (size_t)(head - 1) << SEG_SHIFT;
+}
+
+/* Find size bytes of the range, reusing free segments first, returns NULL
+ if the range is full, under lock */
+static
+void*
+__carve(size_t size)
+{
+    int list = (size == BIG_SIZE) ? FREE_BIG : FREE_SMALL;
+
+    size_t off = __pop(list);
+
+    // split a free big segment before growing
+    if (off == SIZE_MAX && list == FREE_SMALL) {
+        off = __pop(FREE_BIG);
+        if (off != SIZE_MAX) {
+            for (size_t rest = SEG_SIZE; rest < BIG_SIZE; rest += SEG_SIZE) {
+                __push(FREE_SMALL, off + rest);
+            }
+        }
+    }
+
+    if (off == SIZE_MAX) {
+        // the slots skipped to align a big segment stay usable
+        size_t top = (vm_top + size - 1) & ~(size - 1);
+        if (top + size > li_vm_size) {
+            return NULL;
+        }
+        for (; vm_top < top; vm_top += SEG_SIZE) {
+            __push(FREE_SMALL, vm_top);
+        }
+
+        off = top;
+        vm_top = top + size;
+    }
+
+    return li_vm_base + off;
+}
+
+
+
+/* ============================= SEGMENTS ================================== */
+/* Commit a segment of 1 MB or LI_MEDIUM_SEGMENT_SIZE from the range,
+ aligned to its size. Returns NULL if it has to be mapped elsewhere */
+void*
+livm_map(size_t size)
+{
+    assert(size == SEG_SIZE || size == BIG_SIZE);
+
+    pthread_mutex_lock(&vm_lock);
+    if (!vm_tried) {
+        __reserve();
+    }
+
+    char* ptr = (li_vm_base == NULL) ? NULL : __carve(size);
+    if (ptr == NULL) {
+        fallbacks += 1;
+    }
+    pthread_mutex_unlock(&vm_lock);
+
+    if (ptr == NULL) {
+        return NULL;
+    }
+
+    if (mprotect(ptr, size, PROT_READ | PROT_WRITE) != 0) {
+        // out of commit charge, the caller's mmap will fail the same way
+        pthread_mutex_lock(&vm_lock);
+        __push((size == BIG_SIZE) ? FREE_BIG : FREE_SMALL, ptr - li_vm_base);
+        fallbacks += 1;
+        pthread_mutex_unlock(&vm_lock);
+        return NULL;
+    }
+
+    __atomic_add_fetch(&committed, size, __ATOMIC_RELAXED);
+    return ptr;
+}
+
+/* Decommit a segment of the range and keep its addresses for reuse.
+ Returns false if ptr is not in the range */
+int
+livm_unmap(void* ptr, size_t size)
+{
+    char* base = __atomic_load_n(&li_vm_base, __ATOMIC_ACQUIRE);
+    if (base == NULL || (size_t)((char*)ptr - base) >= li_vm_size) {
+        return 0;
+    }
+
+    assert(size == SEG_SIZE || size == BIG_SIZE);
+
+    // one call drops the pages and the commit charge. Splitting a mapping
+    // can fail at the map count limit, then only the pages are dropped and
+    // the segment stays accessible until it is handed out again
+    void* rv = mmap(ptr, size, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+                    -1, 0);
+    int failed = (rv == MAP_FAILED);
+    if (failed) {
+        madvise(ptr, size, MADV_DONTNEED);
+    }
+
+    pthread_mutex_lock(&vm_lock);
+    decommit_fails += failed;
+    __push((size == BIG_SIZE) ? FREE_BIG : FREE_SMALL, (char*)ptr - base);
+    pthread_mutex_unlock(&vm_lock);
+
+    __atomic_sub_fetch(&committed, size, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/* Collect the usage of the range */
+void
+livm_stats_get(livm_stats* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_lock(&vm_lock);
+    stats->reserved  = li_vm_size;
+    stats->used      = vm_top;
+    stats->free_bytes = free_counts[FREE_SMALL] * SEG_SIZE
+                        + free_counts[FREE_BIG] * BIG_SIZE;
+    stats->fallbacks = fallbacks;
+    stats->merges    = merges;
+    stats->decommit_fails = decommit_fails;
+    pthread_mutex_unlock(&vm_lock);
+
+    stats->committed = __atomic_load_n(&committed, __ATOMIC_RELAXED);
+}
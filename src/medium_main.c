@@ -0,0 +1,132 @@
+// Round trip test for medium allocations.
+//
+// A single thread keeps LIVE buffers of 10 KB to 510 KB alive and
+// replaces a random one COUNT times. Every buffer is filled with a
+// pattern of its own that must still be there when it is freed, or
+// when it is grown or shrunk with xrealloc, so runs that overlap or
+// lose their data after a merge show up as bad buffers. The peak of the
+// mapped bytes shows whether freed runs were merged and reused.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "xmalloc.h"
+
+#define LIVE     64
+#define MIN_SIZE (10 * 1024)
+#define MAX_SIZE (510 * 1024)
+
+typedef struct buffer {
+    long*   data;
+    size_t  size;
+    long    seed;
+} buffer;
+
+unsigned long state = 88172645463325252UL;
+
+unsigned long
+next_rand()
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+size_t
+mapped_kb()
+{
+    size_t mapped = 0;
+    size_t len = sizeof(mapped);
+    xmallctl("stats.mapped", &mapped, &len, NULL, 0);
+    return mapped / 1024;
+}
+
+size_t
+rand_size()
+{
+    return MIN_SIZE + next_rand() % (MAX_SIZE - MIN_SIZE);
+}
+
+void
+fill(buffer* buf)
+{
+    long words = buf->size / sizeof(long);
+    for (long ii = 0; ii < words; ++ii) {
+        buf->data[ii] = buf->seed + ii;
+    }
+}
+
+// returns 1 if the first words words of the buffer hold its pattern
+int
+check(buffer* buf, size_t size)
+{
+    long words = size / sizeof(long);
+    for (long ii = 0; ii < words; ++ii) {
+        if (buf->data[ii] != buf->seed + ii) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 2) {
+        printf("Usage:\n");
+        printf("\t%s COUNT\n", argv[0]);
+        return 1;
+    }
+
+    long count = atol(argv[1]);
+    buffer bufs[LIVE];
+    long bad = 0;
+    long reallocs = 0;
+    size_t peak_kb = 0;
+
+    for (int ii = 0; ii < LIVE; ++ii) {
+        bufs[ii].size = rand_size();
+        bufs[ii].seed = ii << 20;
+        bufs[ii].data = xmalloc(bufs[ii].size);
+        fill(&(bufs[ii]));
+    }
+
+    for (long nn = 0; nn < count; ++nn) {
+        buffer* buf = &(bufs[next_rand() % LIVE]);
+        size_t size = rand_size();
+
+        // every fourth replacement resizes in place of free and malloc
+        if (nn % 4 == 0) {
+            size_t kept = (size < buf->size) ? size : buf->size;
+            buf->data = xrealloc(buf->data, size);
+            bad += !check(buf, kept);
+            reallocs += 1;
+        }
+        else {
+            bad += !check(buf, buf->size);
+            xfree(buf->data);
+            buf->data = xmalloc(size);
+        }
+
+        buf->size = size;
+        buf->seed = (nn + LIVE) << 20;
+        fill(buf);
+
+        size_t now_kb = mapped_kb();
+        peak_kb = (now_kb > peak_kb) ? now_kb : peak_kb;
+    }
+
+    for (int ii = 0; ii < LIVE; ++ii) {
+        bad += !check(&(bufs[ii]), bufs[ii].size);
+        xfree(bufs[ii].data);
+    }
+
+    printf("medium: %ld buffers, %ld reallocs, %ld bad\n",
+           count + LIVE, reallocs, bad);
+    printf("mapped: %zu KB at peak, live at most %d KB\n",
+           peak_kb, LIVE * MAX_SIZE / 1024);
+
+    return 0;
+}
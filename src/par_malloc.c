@@ -23,3 +23,232 @@ xrealloc(void* prev, size_t bytes)
     return lirealloc(prev, bytes);
     return 0;
 }
+
+void*
+xcalloc(size_t count, size_t bytes)
+{
+    return licalloc(count, bytes);
+}
+
+void*
+xmalloc_flags(size_t bytes, int flags)
+{
+    return limalloc_flags(bytes, flags);
+}
+
+size_t
+xmalloc_prewarm(size_t bytes_per_class)
+{
+    return limalloc_prewarm(bytes_per_class);
+}
+
+xregion*
+xregion_create()
+{
+    return (xregion*)liregion_create();
+}
+
+void*
+xregion_alloc(xregion* region, size_t bytes)
+{
+    return liregion_alloc((liregion*)region, bytes);
+}
+
+void*
+xregion_mark(xregion* region)
+{
+    return liregion_mark((liregion*)region);
+}
+
+void
+xregion_reset(xregion* region, void* mark)
+{
+    liregion_reset((liregion*)region, mark);
+}
+
+void
+xregion_destroy(xregion* region)
+{
+    liregion_destroy((liregion*)region);
+}
+
+xcache*
+xcache_create(size_t bytes, size_t align, void (*ctor)(void* obj))
+{
+    return (xcache*)licache_create(bytes, align, ctor);
+}
+
+void*
+xcache_alloc(xcache* cache)
+{
+    return licache_alloc((licache*)cache);
+}
+
+void
+xcache_free(xcache* cache, void* ptr)
+{
+    licache_free((licache*)cache, ptr);
+}
+
+void
+xcache_destroy(xcache* cache)
+{
+    licache_destroy((licache*)cache);
+}
+
+void
+xepoch_enter()
+{
+    liepoch_enter();
+}
+
+void
+xepoch_exit()
+{
+    liepoch_exit();
+}
+
+void
+xfree_deferred(void* ptr)
+{
+    lifree_deferred(ptr);
+}
+
+size_t
+xepoch_reclaim()
+{
+    return liepoch_reclaim();
+}
+
+xshm*
+xshm_create(const char* name, size_t bytes)
+{
+    return (xshm*)lishm_create(name, bytes);
+}
+
+xshm*
+xshm_open(const char* name)
+{
+    return (xshm*)lishm_open(name);
+}
+
+xshm*
+xshm_attach(int fd)
+{
+    return (xshm*)lishm_attach(fd);
+}
+
+void
+xshm_detach(xshm* shm)
+{
+    lishm_detach((lishm*)shm);
+}
+
+int
+xshm_unlink(const char* name)
+{
+    return lishm_unlink(name);
+}
+
+int
+xshm_fd(xshm* shm)
+{
+    return ((lishm*)shm)->fd;
+}
+
+void*
+xshm_alloc(xshm* shm, size_t bytes)
+{
+    return lishm_alloc((lishm*)shm, bytes);
+}
+
+void
+xshm_free(xshm* shm, void* ptr)
+{
+    lishm_free((lishm*)shm, ptr);
+}
+
+size_t
+xshm_offset(xshm* shm, const void* ptr)
+{
+    return lishm_offset((lishm*)shm, ptr);
+}
+
+void*
+xshm_ptr(xshm* shm, size_t offset)
+{
+    return lishm_ptr((lishm*)shm, offset);
+}
+
+void
+xshm_set_root(xshm* shm, size_t offset)
+{
+    lishm_set_root((lishm*)shm, offset);
+}
+
+size_t
+xshm_root(xshm* shm)
+{
+    return lishm_root((lishm*)shm);
+}
+
+size_t
+xshm_used(xshm* shm)
+{
+    return lishm_used((lishm*)shm);
+}
+
+xshm*
+xshm_persist(const char* path, size_t bytes, void* base)
+{
+    return (xshm*)lishm_persist(path, bytes, base);
+}
+
+int
+xshm_sync(xshm* shm)
+{
+    return lishm_sync((lishm*)shm);
+}
+
+int
+xshm_state(xshm* shm)
+{
+    return ((lishm*)shm)->state;
+}
+
+void
+xmalloc_set_limit(size_t bytes)
+{
+    lipressure_set_limit(bytes);
+}
+
+int
+xmalloc_cgroup_monitor(const char* dir)
+{
+    return lipressure_cgroup(dir);
+}
+
+int
+xmalloc_pressure_register(xpressure_cb cb, void* arg)
+{
+    return lipressure_register(cb, arg);
+}
+
+size_t
+xmalloc_purge()
+{
+    return lipurge();
+}
+
+int
+xmallctl(const char* name, void* oldp, size_t* oldlenp,
+         const void* newp, size_t newlen)
+{
+    return lictl(name, oldp, oldlenp, newp, newlen);
+}
+
+void
+xmallctl_dump(int fd)
+{
+    lictl_dump(fd);
+}
@@ -0,0 +1,189 @@
+#ifndef PERFCTR_H
+#define PERFCTR_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// Hardware counters through perf_event_open, for the benchmark drivers.
+// Every counter is opened on its own, so a counter the machine or the
+// permissions do not allow is left out and the others still count.
+// pid 0 counts the calling thread only, a child pid with inherit set
+// counts the child and every thread it starts. Values are scaled up
+// when the kernel had to multiplex the counters. Drivers collect per
+// thread counters when PERFCTR_CSV names a file to append them to.
+
+#define PERFCTR_COUNT 5
+
+typedef struct perfctr {
+    int fds[PERFCTR_COUNT];
+} perfctr;
+
+// CSV column names, in the order of the values
+static const char* perfctr_names[PERFCTR_COUNT] = {
+    "instructions", "cycles", "cache_misses", "dtlb_misses", "page_faults"
+};
+
+static inline
+void
+perfctr_attr(int ii, struct perf_event_attr* attr)
+{
+    memset(attr, 0, sizeof(*attr));
+    attr->size = sizeof(*attr);
+    attr->type = PERF_TYPE_HARDWARE;
+
+    switch (ii) {
+    case 0:
+        attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+    case 1:
+        attr->config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+    case 2:
+        attr->config = PERF_COUNT_HW_CACHE_MISSES;
+        break;
+    case 3:
+        attr->type   = PERF_TYPE_HW_CACHE;
+        attr->config = PERF_COUNT_HW_CACHE_DTLB
+                       | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                       | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+    default:
+        attr->type   = PERF_TYPE_SOFTWARE;
+        attr->config = PERF_COUNT_SW_PAGE_FAULTS;
+        break;
+    }
+}
+
+// Open the counters disabled, returns how many could be opened
+static inline
+int
+perfctr_open(perfctr* pc, pid_t pid, int inherit)
+{
+    int opened = 0;
+
+    for (int ii = 0; ii < PERFCTR_COUNT; ++ii) {
+        struct perf_event_attr attr;
+        perfctr_attr(ii, &attr);
+        attr.disabled       = 1;
+        attr.inherit        = inherit;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv     = 1;
+        attr.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED
+                              | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        pc->fds[ii] = syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+        opened += pc->fds[ii] >= 0;
+    }
+
+    return opened;
+}
+
+static inline
+void
+perfctr_enable(perfctr* pc)
+{
+    for (int ii = 0; ii < PERFCTR_COUNT; ++ii) {
+        if (pc->fds[ii] >= 0) {
+            ioctl(pc->fds[ii], PERF_EVENT_IOC_RESET, 0);
+            ioctl(pc->fds[ii], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+// Stop counting and read the values, -1 for a counter that is missing
+static inline
+void
+perfctr_read(perfctr* pc, int64_t* vals)
+{
+    for (int ii = 0; ii < PERFCTR_COUNT; ++ii) {
+        vals[ii] = -1;
+        if (pc->fds[ii] < 0) {
+            continue;
+        }
+
+        ioctl(pc->fds[ii], PERF_EVENT_IOC_DISABLE, 0);
+
+        // value, time enabled, time running
+        uint64_t buf[3];
+        if (read(pc->fds[ii], buf, sizeof(buf)) != sizeof(buf) || buf[2] == 0) {
+            continue;
+        }
+        vals[ii] = (int64_t)((double)buf[0] * buf[1] / buf[2]);
+    }
+}
+
+static inline
+void
+perfctr_close(perfctr* pc)
+{
+    for (int ii = 0; ii < PERFCTR_COUNT; ++ii) {
+        if (pc->fds[ii] >= 0) {
+            close(pc->fds[ii]);
+            pc->fds[ii] = -1;
+        }
+    }
+}
+
+// Column names of perfctr_csv, a total and a per op column per counter
+static inline
+void
+perfctr_csv_header(FILE* file)
+{
+    for (int ii = 0; ii < PERFCTR_COUNT; ++ii) {
+        fprintf(file, ",%s,%s_per_op", perfctr_names[ii], perfctr_names[ii]);
+    }
+}
+
+// Counter columns of a CSV row, missing counters are left empty, and so
+// are the per op columns without an op count
+static inline
+void
+perfctr_csv(FILE* file, int64_t* vals, long ops)
+{
+    for (int ii = 0; ii < PERFCTR_COUNT; ++ii) {
+        if (vals[ii] < 0) {
+            fprintf(file, ",,");
+        }
+        else if (ops <= 0) {
+            fprintf(file, ",%ld,", (long)vals[ii]);
+        }
+        else {
+            fprintf(file, ",%ld,%.2f", (long)vals[ii], (double)vals[ii] / ops);
+        }
+    }
+}
+
+// Append the counters of one thread to the CSV file at path, with a
+// header row if the file is new. ops is the work the thread did
+static inline
+void
+perfctr_thread_csv(const char* path, const char* prog, long thread,
+                   long ops, int64_t* vals)
+{
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&lock);
+
+    int fresh = access(path, F_OK) != 0;
+    FILE* file = fopen(path, "a");
+    if (file != NULL) {
+        if (fresh) {
+            fprintf(file, "prog,thread,ops");
+            perfctr_csv_header(file);
+            fprintf(file, "\n");
+        }
+        fprintf(file, "%s,%ld,%ld", prog, thread, ops);
+        perfctr_csv(file, vals, ops);
+        fprintf(file, "\n");
+        fclose(file);
+    }
+
+    pthread_mutex_unlock(&lock);
+}
+
+#endif
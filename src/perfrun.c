@@ -0,0 +1,136 @@
+// Hardware counters around a benchmark run.
+//
+// Runs PROG ARGS with the counters of perfctr.h attached to it and to
+// every thread it starts, and appends one CSV row to FILE, or prints
+// it to stderr without -o:
+//
+//   prog,args,ops,wall_s,exit,instructions,instructions_per_op,...
+//
+// OPS is the unit of work counters are divided by, the TOP of a
+// collatz run for example, without -n the per op columns are left
+// empty. The header row is written when the file is new. Counters the
+// kernel does not allow, as with a strict perf_event_paranoid or inside
+// most containers, are left empty and the run goes on.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "perfctr.h"
+
+double
+now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char* argv[])
+{
+    const char* out_path = NULL;
+    long ops = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "+o:n:")) != -1) {
+        switch (opt) {
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'n':
+            ops = atol(optarg);
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+
+    if (optind >= argc) {
+        printf("Usage:\n");
+        printf("\t%s [-o FILE] [-n OPS] PROG [ARGS...]\n", argv[0]);
+        return 1;
+    }
+
+    // the child waits on the pipe until its counters are attached
+    int go[2];
+    if (pipe(go) != 0) {
+        perror("pipe");
+        return 1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+
+    if (pid == 0) {
+        char cc;
+        close(go[1]);
+        if (read(go[0], &cc, 1) != 1) {
+            _exit(127);
+        }
+        close(go[0]);
+        execv(argv[optind], &(argv[optind]));
+        perror(argv[optind]);
+        _exit(127);
+    }
+
+    close(go[0]);
+
+    perfctr pc;
+    if (perfctr_open(&pc, pid, 1) == 0) {
+        fprintf(stderr, "perfrun: no counters available, timing only\n");
+    }
+    perfctr_enable(&pc);
+
+    double start = now_s();
+    if (write(go[1], "g", 1) != 1) {
+        perror("write");
+    }
+    close(go[1]);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    double wall = now_s() - start;
+
+    int64_t vals[PERFCTR_COUNT];
+    perfctr_read(&pc, vals);
+    perfctr_close(&pc);
+
+    int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+    FILE* out = stderr;
+    if (out_path != NULL) {
+        int fresh = access(out_path, F_OK) != 0;
+        out = fopen(out_path, "a");
+        if (out == NULL) {
+            perror(out_path);
+            return 1;
+        }
+        if (fresh) {
+            fprintf(out, "prog,args,ops,wall_s,exit");
+            perfctr_csv_header(out);
+            fprintf(out, "\n");
+        }
+    }
+
+    fprintf(out, "%s,", argv[optind]);
+    for (int ii = optind + 1; ii < argc; ++ii) {
+        fprintf(out, "%s%s", (ii == optind + 1) ? "" : " ", argv[ii]);
+    }
+    fprintf(out, ",%ld,%.3f,%d", ops, wall, code);
+    perfctr_csv(out, vals, ops);
+    fprintf(out, "\n");
+
+    if (out != stderr) {
+        fclose(out);
+    }
+
+    return code;
+}
@@ -0,0 +1,289 @@
+// Warm restart benchmark for persistent heaps.
+//
+// Keeps a cache of COUNT entries, a hash table of collatz step counts,
+// in a persistent heap in FILE. The first run builds the cache, later
+// runs reopen the file and check every entry instead of rebuilding.
+// Entries link to each other by heap offset, so the cache survives
+// the heap being mapped at another address.
+//
+// With "crash" the process exits without detaching, so the next run
+// has to recover the heap. With "kill" a new cache is built by several
+// threads, which also allocate and free scratch blocks of many sizes,
+// and the process kills itself halfway through, in the middle of
+// allocations. A run that recovers a heap adds the entries missing.
+// With "noinit" the file is left the way a process leaves it when it
+// dies after sizing a new file and before writing its header, the next
+// run has to build the heap in it.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "xmalloc.h"
+
+#define BUCKETS 4096
+#define KILL_THREADS 4
+
+typedef struct entry {
+    long    key;
+    long    steps;
+    size_t  next;
+    char    name[32];
+} entry;
+
+typedef struct cache {
+    long    count;
+    size_t  buckets[BUCKETS];
+} cache;
+
+double
+now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+long
+collatz_len(long xx)
+{
+    long steps = 0;
+    while (xx > 1) {
+        xx = (xx % 2 == 0) ? xx / 2 : 3 * xx + 1;
+        steps += 1;
+    }
+    return steps;
+}
+
+void*
+alloc_or_die(xshm* shm, size_t bytes)
+{
+    void* ptr = xshm_alloc(shm, bytes);
+    if (ptr == NULL) {
+        fprintf(stderr, "persistent heap is full\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+// a heap recovered wrong can link entries in a loop, no bucket holds
+// more than count of them
+int
+has_key(xshm* shm, cache* cc, long key)
+{
+    long hops = 0;
+    for (entry* ee = xshm_ptr(shm, cc->buckets[key % BUCKETS]); ee != NULL;
+         ee = xshm_ptr(shm, ee->next)) {
+        if (ee->key == key) {
+            return 1;
+        }
+        if (++hops > cc->count) {
+            fprintf(stderr, "entries link in a loop\n");
+            exit(1);
+        }
+    }
+    return 0;
+}
+
+// the entry is written before it is linked, so a crash never leaves a
+// half written entry in a bucket
+void
+insert(xshm* shm, cache* cc, long key)
+{
+    entry* ee = alloc_or_die(shm, sizeof(entry));
+
+    ee->key = key;
+    ee->steps = collatz_len(key);
+    snprintf(ee->name, sizeof(ee->name), "collatz-%ld", key);
+
+    ee->next = cc->buckets[key % BUCKETS];
+    __atomic_store_n(&(cc->buckets[key % BUCKETS]), xshm_offset(shm, ee),
+                     __ATOMIC_RELEASE);
+}
+
+cache*
+build(xshm* shm, long count)
+{
+    cache* cc = alloc_or_die(shm, sizeof(cache));
+    memset(cc, 0, sizeof(cache));
+    cc->count = count;
+    xshm_set_root(shm, xshm_offset(shm, cc));
+    return cc;
+}
+
+// add the keys from first to count, step apart, that are missing
+void
+fill(xshm* shm, cache* cc, long first, long step)
+{
+    for (long key = first; key <= cc->count; key += step) {
+        if (!has_key(shm, cc, key)) {
+            insert(shm, cc, key);
+        }
+    }
+}
+
+typedef struct kill_job {
+    xshm*   shm;
+    cache*  cc;
+    long    first;
+    long*   done;
+} kill_job;
+
+// a thread owns the buckets of its keys, BUCKETS is a multiple of the
+// thread count. Scratch blocks split and carve blocks of every class
+void*
+kill_thread(void* arg)
+{
+    kill_job* job = (kill_job*)arg;
+    void* scratch = NULL;
+
+    for (long key = job->first; key <= job->cc->count; key += KILL_THREADS) {
+        void* next = alloc_or_die(job->shm, 16 + (key * 37) % 4000);
+        insert(job->shm, job->cc, key);
+        xshm_free(job->shm, scratch);
+        scratch = next;
+
+        __atomic_add_fetch(job->done, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+// build with several threads and die once half the entries are in
+void
+build_and_kill(xshm* shm, long count)
+{
+    cache* cc = build(shm, count);
+    long done = 0;
+
+    pthread_t threads[KILL_THREADS];
+    kill_job jobs[KILL_THREADS];
+    for (int tt = 0; tt < KILL_THREADS; ++tt) {
+        jobs[tt] = (kill_job){ shm, cc, tt + 1, &done };
+        pthread_create(&(threads[tt]), NULL, kill_thread, &(jobs[tt]));
+    }
+
+    while (__atomic_load_n(&done, __ATOMIC_RELAXED) < count / 2) {
+        sched_yield();
+    }
+    kill(getpid(), SIGKILL);
+}
+
+// returns the number of entries found intact
+long
+check(xshm* shm, long* max_at, long* max_steps)
+{
+    cache* cc = xshm_ptr(shm, xshm_root(shm));
+    if (cc == NULL) {
+        return 0;
+    }
+
+    long good = 0;
+    long seen = 0;
+    char name[32];
+
+    for (int bb = 0; bb < BUCKETS; ++bb) {
+        for (entry* ee = xshm_ptr(shm, cc->buckets[bb]); ee != NULL;
+             ee = xshm_ptr(shm, ee->next)) {
+            if (++seen > cc->count) {
+                return -1;
+            }
+
+            snprintf(name, sizeof(name), "collatz-%ld", ee->key);
+            if (ee->steps != collatz_len(ee->key) || strcmp(name, ee->name)) {
+                continue;
+            }
+
+            good += 1;
+            if (ee->steps > *max_steps) {
+                *max_steps = ee->steps;
+                *max_at = ee->key;
+            }
+        }
+    }
+
+    return good == cc->count ? good : -1;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc < 3 || argc > 4
+        || (argc == 4 && strcmp(argv[3], "crash") && strcmp(argv[3], "kill")
+            && strcmp(argv[3], "noinit"))) {
+        printf("Usage:\n");
+        printf("\t%s FILE COUNT [crash|kill|noinit]\n", argv[0]);
+        return 1;
+    }
+
+    int kill_run = (argc == 4 && strcmp(argv[3], "kill") == 0);
+    long count = atol(argv[2]);
+    size_t bytes = sizeof(cache) * 2 + count * 128 + 1024 * 1024;
+
+    // scratch blocks of the threads, never merged once split
+    if (kill_run) {
+        bytes += KILL_THREADS * 1024 * 1024;
+    }
+
+    // a sized file of zeros, as xshm_persist leaves it before the header
+    if (argc == 4 && strcmp(argv[3], "noinit") == 0) {
+        int fd = open(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0 || ftruncate(fd, (bytes + 4095) & ~4095L) != 0) {
+            perror(argv[1]);
+            return 1;
+        }
+        close(fd);
+        return 0;
+    }
+
+    double start = now_ms();
+    xshm* shm = xshm_persist(argv[1], bytes, NULL);
+    double open_ms = now_ms() - start;
+
+    if (shm == NULL) {
+        perror("xshm_persist");
+        return 1;
+    }
+
+    int state = xshm_state(shm);
+    const char* how = (state & ~XSHM_RELOCATED) == XSHM_CREATED ? "built"
+                    : (state & ~XSHM_RELOCATED) == XSHM_RESUMED ? "resumed"
+                    : "recovered";
+
+    if ((state & ~XSHM_RELOCATED) == XSHM_CREATED && kill_run) {
+        build_and_kill(shm, count);
+    }
+
+    start = now_ms();
+    if ((state & ~XSHM_RELOCATED) == XSHM_CREATED) {
+        fill(shm, build(shm, count), 1, 1);
+    }
+    else if ((state & ~XSHM_RELOCATED) == XSHM_RECOVERED && xshm_root(shm) != 0) {
+        fill(shm, xshm_ptr(shm, xshm_root(shm)), 1, 1);
+    }
+    double build_ms = now_ms() - start;
+
+    long max_at = 0;
+    long max_steps = 0;
+    start = now_ms();
+    long good = check(shm, &max_at, &max_steps);
+    double check_ms = now_ms() - start;
+
+    printf("Max steps is at %ld: %ld steps\n", max_at, max_steps);
+    printf("%s%s: %ld entries, open %.2f ms, build %.2f ms, check %.2f ms\n",
+           how, (state & XSHM_RELOCATED) ? " and relocated" : "",
+           good, open_ms, build_ms, check_ms);
+
+    if (argc == 4) {
+        fflush(stdout);
+        _exit(good != count);
+    }
+
+    xshm_detach(shm);
+    return good != count;
+}
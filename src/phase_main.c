@@ -0,0 +1,69 @@
+// Phase benchmark for segment reuse across size classes.
+//
+// Every phase allocates LIVE_MB of objects of a single size, frees
+// them all and moves on to the next size. Only one phase is live at
+// a time, so the resident set should stay close to LIVE_MB no matter
+// how many sizes the program goes through.
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include "xmalloc.h"
+
+#define LIVE_MB 32
+#define ROUNDS  3
+
+static const size_t sizes[] = { 64, 512, 16, 2048, 128, 8192, 32, 1024 };
+
+long
+resident_kb()
+{
+    long pages = 0;
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (file == NULL) {
+        return 0;
+    }
+    if (fscanf(file, "%*s %ld", &pages) != 1) {
+        pages = 0;
+    }
+    fclose(file);
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+int
+main()
+{
+    long size_count = sizeof(sizes) / sizeof(sizes[0]);
+    long max_count = (LIVE_MB << 20) / sizes[2];
+    void** objs = xmalloc(max_count * sizeof(void*));
+    memset(objs, 0, max_count * sizeof(void*));
+
+    long base_kb = resident_kb();
+    long peak_kb = 0;
+
+    for (int rr = 0; rr < ROUNDS; ++rr) {
+        for (long ss = 0; ss < size_count; ++ss) {
+            long count = (LIVE_MB << 20) / sizes[ss];
+
+            for (long ii = 0; ii < count; ++ii) {
+                objs[ii] = xmalloc(sizes[ss]);
+                memset(objs[ii], 1, sizes[ss]);
+            }
+
+            long rss = resident_kb();
+            peak_kb = (rss > peak_kb) ? rss : peak_kb;
+
+            for (long ii = 0; ii < count; ++ii) {
+                xfree(objs[ii]);
+            }
+        }
+    }
+
+    printf("phases: live %d MB, peak %ld KB over %ld KB at start\n",
+           LIVE_MB, peak_kb - base_kb, base_kb);
+
+    xfree(objs);
+    return 0;
+}
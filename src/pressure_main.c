@@ -0,0 +1,186 @@
+// Test for the soft limit and the cgroup monitor.
+//
+// Big blocks are freed into the extent cache, which still counts as
+// mapped. Then a bigger block has to be mapped over the soft limit, or
+// while the cgroup monitor finds the group close to memory.max or
+// stalling on memory. Either way the allocator must purge the free
+// blocks and call the registered callback, with fewer bytes mapped than
+// before.
+//
+// The cgroup is faked with files in a temporary directory, the monitor
+// reads them at most once per 100 ms, so every step waits that long.
+// While the files look calm no callback may fire.
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include "xmalloc.h"
+
+#define BLOCKS     16
+#define BLOCK_SIZE (2 * 1024 * 1024)
+#define GROUP_MAX  (1024L * 1024 * 1024)
+#define POLL_WAIT  (150 * 1000)
+
+char dir[] = "/tmp/pressure.XXXXXX";
+
+long calls = 0;
+size_t last_mapped = 0;
+size_t last_limit = 0;
+
+void* held[4];
+int held_count = 0;
+
+void
+on_pressure(size_t mapped, size_t limit, void* arg)
+{
+    calls += 1;
+    last_mapped = mapped;
+    last_limit = limit;
+}
+
+size_t
+mapped_kb()
+{
+    size_t value = 0;
+    size_t size = sizeof(value);
+    xmallctl("stats.mapped", &value, &size, NULL, 0);
+    return value / 1024;
+}
+
+void
+write_file(const char* name, const char* text)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        exit(1);
+    }
+    fputs(text, file);
+    fclose(file);
+}
+
+void
+write_group(long current, double avg10)
+{
+    char text[128];
+
+    snprintf(text, sizeof(text), "%ld\n", current);
+    write_file("memory.current", text);
+
+    snprintf(text, sizeof(text),
+             "some avg10=%.2f avg60=0.00 avg300=0.00 total=0\n"
+             "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n", avg10);
+    write_file("memory.pressure", text);
+}
+
+// leave BLOCKS free big blocks in the extent cache
+void
+fill_cache()
+{
+    void* ptrs[BLOCKS];
+    for (int ii = 0; ii < BLOCKS; ++ii) {
+        ptrs[ii] = xmalloc(BLOCK_SIZE);
+        memset(ptrs[ii], 1, 4096);
+    }
+    for (int ii = 0; ii < BLOCKS; ++ii) {
+        xfree(ptrs[ii]);
+    }
+}
+
+// map a block none of the free ones fits, returns the callbacks it caused.
+// It is kept until the end, so a later step has to map its own
+long
+map_one()
+{
+    long before = calls;
+    held[held_count++] = xmalloc(4 * BLOCK_SIZE);
+    return calls - before;
+}
+
+// calm files first, then the given ones, returns the callbacks they caused
+long
+cgroup_step(long current, double avg10, size_t* before_kb, long* calm)
+{
+    write_group(1024 * 1024, 0.0);
+    usleep(POLL_WAIT);
+    long before = calls;
+    fill_cache();
+    *calm += calls - before;
+
+    write_group(current, avg10);
+    *before_kb = mapped_kb();
+    usleep(POLL_WAIT);
+    return map_one();
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 1) {
+        printf("Usage:\n");
+        printf("\t%s\n", argv[0]);
+        return 1;
+    }
+
+    long bad = 0;
+    xmalloc_pressure_register(on_pressure, NULL);
+
+    // soft limit: the free blocks already fill it
+    fill_cache();
+    size_t before_kb = mapped_kb();
+    xmalloc_set_limit(before_kb * 1024);
+    long limit_calls = map_one();
+    bad += last_limit != before_kb * 1024;
+    printf("limit: %ld callbacks, mapped %zu KB -> %zu KB\n",
+           limit_calls, before_kb, last_mapped / 1024);
+    bad += last_mapped / 1024 >= before_kb;
+    xmalloc_set_limit(0);
+
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    write_group(1024 * 1024, 0.0);
+    write_file("memory.high", "max\n");
+
+    char text[64];
+    snprintf(text, sizeof(text), "%ld\n", GROUP_MAX);
+    write_file("memory.max", text);
+
+    bad += xmalloc_cgroup_monitor("/nonexistent") != -1;
+    bad += xmalloc_cgroup_monitor(dir) != 0;
+
+    // near memory.max, then stalling with little in use
+    long calm = 0;
+    long max_calls = cgroup_step(GROUP_MAX - GROUP_MAX / 40, 0.0,
+                                 &before_kb, &calm);
+    bad += last_limit != GROUP_MAX;
+    bad += last_mapped / 1024 >= before_kb;
+
+    long psi_calls = cgroup_step(1024 * 1024, 50.0, &before_kb, &calm);
+    bad += last_mapped / 1024 >= before_kb;
+
+    printf("cgroup: %ld callbacks near memory.max, %ld on memory.pressure, "
+           "%ld when calm\n", max_calls, psi_calls, calm);
+    printf("pressure: %ld bad\n", bad);
+
+    for (int ii = 0; ii < held_count; ++ii) {
+        xfree(held[ii]);
+    }
+
+    const char* names[] = { "memory.current", "memory.high", "memory.max",
+                            "memory.pressure" };
+    for (int ii = 0; ii < 4; ++ii) {
+        char path[256];
+        snprintf(path, sizeof(path), "%s/%s", dir, names[ii]);
+        unlink(path);
+    }
+    rmdir(dir);
+
+    return 0;
+}
@@ -0,0 +1,31 @@
+/*  LIMALLOC - lit malloc    */
+/*  by Oleksandr Litus       */
+
+/*  USDT probes on the allocator slow paths. With <sys/sdt.h> available
+    every probe is a single nop plus an ELF note, bpftrace and perf attach
+    to them by provider and name. Without it, or with -DXMALLOC_NO_PROBES,
+    probes compile to nothing. Arguments must be free of side effects. */
+
+#ifndef probe_h
+#define probe_h
+
+#if !defined(XMALLOC_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define XMALLOC_PROBES 1
+#endif
+#endif
+
+#ifdef XMALLOC_PROBES
+#define PROBE0(provider, name)             DTRACE_PROBE(provider, name)
+#define PROBE1(provider, name, a)          DTRACE_PROBE1(provider, name, a)
+#define PROBE2(provider, name, a, b)       DTRACE_PROBE2(provider, name, a, b)
+#define PROBE3(provider, name, a, b, c)    DTRACE_PROBE3(provider, name, a, b, c)
+#else
+#define PROBE0(provider, name)             do { } while (0)
+#define PROBE1(provider, name, a)          do { } while (0)
+#define PROBE2(provider, name, a, b)       do { } while (0)
+#define PROBE3(provider, name, a, b, c)    do { } while (0)
+#endif
+
+#endif /* probe_h */
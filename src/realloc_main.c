@@ -0,0 +1,109 @@
+// Grow and shrink test for xrealloc.
+//
+// Keeps LIVE buffers and resizes a random one COUNT times. Sizes climb
+// from 8 bytes to 64 KB and back down, so buffers move between small
+// chunks and mappings of their own, both ways. Every buffer holds a
+// pattern of its own, the part that fits in both sizes must still be
+// there after the resize, at the address xrealloc returned.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "xmalloc.h"
+
+#define LIVE      16
+#define MAX_SHIFT 13
+
+typedef struct buffer {
+    unsigned char*  data;
+    size_t          size;
+    long            seed;
+} buffer;
+
+unsigned long state = 88172645463325252UL;
+
+unsigned long
+next_rand()
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// 8 bytes to 64 KB, with odd sizes in between
+size_t
+rand_size()
+{
+    size_t base = (size_t)8 << (next_rand() % (MAX_SHIFT + 1));
+    return base + next_rand() % base;
+}
+
+void
+fill(buffer* buf)
+{
+    for (size_t ii = 0; ii < buf->size; ++ii) {
+        buf->data[ii] = (unsigned char)(buf->seed + ii * 7);
+    }
+}
+
+// returns 1 if the first size bytes of the buffer hold its pattern
+int
+check(buffer* buf, size_t size)
+{
+    for (size_t ii = 0; ii < size; ++ii) {
+        if (buf->data[ii] != (unsigned char)(buf->seed + ii * 7)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 2 || atol(argv[1]) < 1) {
+        printf("Usage:\n");
+        printf("\t%s COUNT\n", argv[0]);
+        return 1;
+    }
+
+    long count = atol(argv[1]);
+    buffer bufs[LIVE];
+    long grows = 0;
+    long shrinks = 0;
+    long bad = 0;
+
+    for (int ii = 0; ii < LIVE; ++ii) {
+        bufs[ii].size = rand_size();
+        bufs[ii].seed = ii;
+        bufs[ii].data = xmalloc(bufs[ii].size);
+        fill(&(bufs[ii]));
+    }
+
+    for (long nn = 0; nn < count; ++nn) {
+        buffer* buf = &(bufs[next_rand() % LIVE]);
+        size_t size = rand_size();
+
+        size_t kept = (size < buf->size) ? size : buf->size;
+        grows += size > buf->size;
+        shrinks += size < buf->size;
+
+        buf->data = xrealloc(buf->data, size);
+        bad += buf->data == NULL || !check(buf, kept);
+
+        buf->size = size;
+        buf->seed = nn + LIVE;
+        fill(buf);
+    }
+
+    for (int ii = 0; ii < LIVE; ++ii) {
+        bad += !check(&(bufs[ii]), bufs[ii].size);
+        xfree(bufs[ii].data);
+    }
+
+    printf("realloc: %ld grows, %ld shrinks, %ld bad\n", grows, shrinks, bad);
+
+    return bad != 0;
+}
@@ -0,0 +1,209 @@
+// Multi-process test for shared heaps.
+//
+// Worker processes attach to an anonymous shared heap by fd, so the
+// heap sits at a different address in every one of them. Each worker
+// builds the collatz sequence of its numbers as linked lists inside
+// the heap and sends the offset of the list head to the parent over
+// a pipe. The parent walks and frees the lists. The parent then
+// builds lists the workers walk and free, so memory is allocated in
+// one process and freed in another both ways. Every block must be
+// back on the free lists at the end, and sizes past the biggest block
+// must be refused.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "xmalloc.h"
+
+#define HEAP_SIZE (64 * 1024 * 1024)
+
+typedef struct node {
+    long    value;
+    size_t  next;
+} node;
+
+long
+collatz_len(long xx)
+{
+    long steps = 0;
+    while (xx > 1) {
+        xx = (xx % 2 == 0) ? xx / 2 : 3 * xx + 1;
+        steps += 1;
+    }
+    return steps;
+}
+
+// list of the sequence starting at xx, returns the offset of the head
+size_t
+build(xshm* shm, long xx)
+{
+    size_t head = 0;
+    node* tail = NULL;
+
+    for (;;) {
+        node* nn = xshm_alloc(shm, sizeof(node));
+        if (nn == NULL) {
+            fprintf(stderr, "shared heap is full\n");
+            exit(1);
+        }
+        nn->value = xx;
+        nn->next = 0;
+
+        if (tail == NULL) {
+            head = xshm_offset(shm, nn);
+        }
+        else {
+            tail->next = xshm_offset(shm, nn);
+        }
+        tail = nn;
+
+        if (xx <= 1) {
+            return head;
+        }
+        xx = (xx % 2 == 0) ? xx / 2 : 3 * xx + 1;
+    }
+}
+
+// walk and free the list, returns its step count or -1 if it is broken
+long
+consume(xshm* shm, size_t head, long xx)
+{
+    long steps = -1;
+    node* nn = xshm_ptr(shm, head);
+
+    if (nn == NULL || nn->value != xx) {
+        return -1;
+    }
+
+    while (nn != NULL) {
+        node* next = xshm_ptr(shm, nn->next);
+        xshm_free(shm, nn);
+        steps += 1;
+        nn = next;
+    }
+
+    return steps;
+}
+
+// worker: send lists of its numbers, then consume the ones it gets
+int
+worker(int fd, int id, int workers, long top, int out, int in)
+{
+    // map the heap again, at an address of its own
+    xshm* shm = xshm_attach(dup(fd));
+    if (shm == NULL) {
+        return 1;
+    }
+
+    for (long xx = 1 + id; xx <= top; xx += workers) {
+        size_t head = build(shm, xx);
+        if (write(out, &head, sizeof(head)) != sizeof(head)) {
+            return 1;
+        }
+    }
+
+    int bad = 0;
+    for (long xx = 1 + id; xx <= top; xx += workers) {
+        size_t head;
+        if (read(in, &head, sizeof(head)) != sizeof(head)) {
+            return 1;
+        }
+        bad += consume(shm, head, xx) != collatz_len(xx);
+    }
+
+    xshm_detach(shm);
+    return bad != 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 3) {
+        printf("Usage:\n");
+        printf("\t%s TOP WORKERS\n", argv[0]);
+        return 1;
+    }
+
+    long top = atol(argv[1]);
+    int workers = atoi(argv[2]);
+
+    xshm* shm = xshm_create(NULL, HEAP_SIZE);
+    if (shm == NULL) {
+        perror("xshm_create");
+        return 1;
+    }
+
+    int* to_parent = xmalloc(2 * workers * sizeof(int));
+    int* to_child  = xmalloc(2 * workers * sizeof(int));
+    pid_t* pids    = xmalloc(workers * sizeof(pid_t));
+
+    for (int ww = 0; ww < workers; ++ww) {
+        if (pipe(to_parent + 2 * ww) != 0 || pipe(to_child + 2 * ww) != 0) {
+            perror("pipe");
+            return 1;
+        }
+
+        pids[ww] = fork();
+        if (pids[ww] == 0) {
+            exit(worker(xshm_fd(shm), ww, workers, top,
+                        to_parent[2 * ww + 1], to_child[2 * ww]));
+        }
+    }
+
+    // lists built by the workers are freed here
+    long bad = 0;
+    long max_steps = 0;
+    long max_at = 0;
+    for (int ww = 0; ww < workers; ++ww) {
+        for (long xx = 1 + ww; xx <= top; xx += workers) {
+            size_t head;
+            if (read(to_parent[2 * ww], &head, sizeof(head)) != sizeof(head)) {
+                perror("read");
+                return 1;
+            }
+
+            long steps = consume(shm, head, xx);
+            bad += steps != collatz_len(xx);
+            if (steps > max_steps) {
+                max_steps = steps;
+                max_at = xx;
+            }
+        }
+    }
+
+    // lists built here are freed by the workers
+    for (int ww = 0; ww < workers; ++ww) {
+        for (long xx = 1 + ww; xx <= top; xx += workers) {
+            size_t head = build(shm, xx);
+            if (write(to_child[2 * ww + 1], &head, sizeof(head)) != sizeof(head)) {
+                perror("write");
+                return 1;
+            }
+        }
+    }
+
+    for (int ww = 0; ww < workers; ++ww) {
+        int status;
+        waitpid(pids[ww], &status, 0);
+        bad += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    }
+
+    // sizes past the biggest block, even ones that wrap with the header
+    bad += xshm_alloc(shm, SIZE_MAX - 7) != NULL;
+    bad += xshm_alloc(shm, (size_t)1 << 62) != NULL;
+
+    printf("Max steps is at %ld: %ld steps\n", max_at, max_steps);
+    printf("%s: %ld bad, %zu bytes used\n",
+           bad == 0 && xshm_used(shm) == 0 ? "ok" : "FAIL",
+           bad, xshm_used(shm));
+
+    xshm_detach(shm);
+    xfree(pids);
+    xfree(to_child);
+    xfree(to_parent);
+    return bad != 0;
+}
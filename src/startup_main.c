@@ -0,0 +1,100 @@
+// Startup benchmark for arena prewarming.
+//
+// Times the first request of a fresh process against the steady
+// state. A request allocates objects of every bucket size, writes
+// them and frees them again. A cold process pays for segment
+// mappings and first-touch page faults in the first request.
+//
+// Run it as "warm" to call xmalloc_prewarm with BYTES per class
+// before the first request, or as "cold" to start without it.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "xmalloc.h"
+
+#define REQUESTS   50
+#define PER_SIZE   256
+#define SIZE_COUNT 10
+
+static const size_t sizes[SIZE_COUNT] = {
+    16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192
+};
+
+double
+now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+long
+minor_faults()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+void
+request(void** objs)
+{
+    for (int ss = 0; ss < SIZE_COUNT; ++ss) {
+        for (int ii = 0; ii < PER_SIZE; ++ii) {
+            void* ptr = xmalloc(sizes[ss]);
+            memset(ptr, ii, sizes[ss]);
+            objs[ss * PER_SIZE + ii] = ptr;
+        }
+    }
+
+    for (int ii = 0; ii < SIZE_COUNT * PER_SIZE; ++ii) {
+        xfree(objs[ii]);
+    }
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc < 2 || argc > 3 || (strcmp(argv[1], "warm") && strcmp(argv[1], "cold"))) {
+        printf("Usage:\n");
+        printf("\t%s warm|cold [BYTES]\n", argv[0]);
+        return 1;
+    }
+
+    int warm = strcmp(argv[1], "warm") == 0;
+    size_t bytes = (argc == 3) ? strtoull(argv[2], NULL, 10) : 2 * 1024 * 1024;
+
+    // a single thread allocates, keep the prewarm to one arena
+    size_t one = 1;
+    xmallctl("arenas.count", NULL, NULL, &one, sizeof(one));
+
+    static void* objs[SIZE_COUNT * PER_SIZE];
+
+    double start = now_us();
+    if (warm) {
+        xmalloc_prewarm(bytes);
+    }
+    double prewarm_us = now_us() - start;
+
+    long faults = minor_faults();
+    start = now_us();
+    request(objs);
+    double first_us = now_us() - start;
+    faults = minor_faults() - faults;
+
+    start = now_us();
+    for (int rr = 1; rr < REQUESTS; ++rr) {
+        request(objs);
+    }
+    double steady_us = (now_us() - start) / (REQUESTS - 1);
+
+    printf("%s: prewarm %.0f us, first request %.0f us (%ld faults), "
+           "steady request %.0f us\n",
+           argv[1], prewarm_us, first_us, faults, steady_us);
+
+    return 0;
+}
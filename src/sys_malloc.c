@@ -21,3 +21,9 @@ xrealloc(void* prev, size_t bytes)
 {
     return realloc(prev, bytes);
 }
+
+void*
+xcalloc(size_t count, size_t bytes)
+{
+    return calloc(count, bytes);
+}
@@ -0,0 +1,173 @@
+// Producer / consumer benchmark for the transfer cache.
+//
+// Each pair passes COUNT batches of BATCH small chunks, one at a time,
+// the producer allocates and stamps them, the consumer checks and frees
+// them. Freed chunks pile up in the consumer's thread cache. With the
+// transfer cache they reach the producer as whole batches, without it
+// they go back one by one through the remote queue of its arena.
+//
+// Run it as "on" with the transfer cache, "off" to set transfer.depth
+// to 0, or "background" for "on" with the background thread refilling
+// arenas at the same time.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <assert.h>
+#include <time.h>
+
+#include "xmalloc.h"
+
+#define RING      1
+#define BATCH     256
+#define OBJ_SIZE  64
+#define MAX_PAIRS 32
+
+typedef struct ring {
+    long**  slots[RING];
+    long    head;
+    long    tail;
+} ring;
+
+ring* rings;
+long count = 0;
+long bad = 0;
+
+double
+now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+size_t
+ctl_get(const char* name)
+{
+    size_t value = 0;
+    size_t len = sizeof(value);
+    xmallctl(name, &value, &len, NULL, 0);
+    return value;
+}
+
+void
+ctl_set(const char* name, size_t value)
+{
+    int rv = xmallctl(name, NULL, NULL, &value, sizeof(value));
+    assert(rv == 0);
+}
+
+void*
+producer(void* arg)
+{
+    ring* rr = &(rings[(long)arg]);
+
+    for (long ii = 0; ii < count; ++ii) {
+        long** batch = xmalloc(BATCH * sizeof(long*));
+        for (int jj = 0; jj < BATCH; ++jj) {
+            batch[jj] = xmalloc(OBJ_SIZE);
+            batch[jj][0] = ii * BATCH + jj;
+        }
+
+        while (ii - __atomic_load_n(&(rr->tail), __ATOMIC_ACQUIRE) >= RING) {
+            sched_yield();
+        }
+        rr->slots[ii % RING] = batch;
+        __atomic_store_n(&(rr->head), ii + 1, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+void*
+consumer(void* arg)
+{
+    ring* rr = &(rings[(long)arg]);
+    long my_bad = 0;
+
+    for (long ii = 0; ii < count; ++ii) {
+        while (__atomic_load_n(&(rr->head), __ATOMIC_ACQUIRE) <= ii) {
+            sched_yield();
+        }
+        long** batch = rr->slots[ii % RING];
+        __atomic_store_n(&(rr->tail), ii + 1, __ATOMIC_RELEASE);
+
+        for (int jj = 0; jj < BATCH; ++jj) {
+            my_bad += batch[jj][0] != ii * BATCH + jj;
+            xfree(batch[jj]);
+        }
+        xfree(batch);
+    }
+
+    __atomic_add_fetch(&bad, my_bad, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    int rv;
+
+    if (argc != 4 || (strcmp(argv[3], "on") && strcmp(argv[3], "off")
+                      && strcmp(argv[3], "background"))) {
+        printf("Usage:\n");
+        printf("\t%s COUNT PAIRS on|off|background\n", argv[0]);
+        return 1;
+    }
+
+    count = atol(argv[1]);
+    long pairs = atol(argv[2]);
+    if (count < 1 || pairs < 1 || pairs > MAX_PAIRS) {
+        printf("COUNT must be at least 1, PAIRS from 1 to %d\n", MAX_PAIRS);
+        return 1;
+    }
+
+    if (strcmp(argv[3], "off") == 0) {
+        ctl_set("transfer.depth", 0);
+    }
+    if (strcmp(argv[3], "background") == 0) {
+        ctl_set("background.interval_ms", 1);
+        ctl_set("background.enabled", 1);
+    }
+
+    rings = xcalloc(pairs, sizeof(ring));
+    pthread_t* threads = xmalloc(2 * pairs * sizeof(pthread_t));
+
+    double start = now_ms();
+
+    for (long ii = 0; ii < pairs; ++ii) {
+        rv = pthread_create(&(threads[2 * ii]), 0, producer, (void*)ii);
+        assert(rv == 0);
+        rv = pthread_create(&(threads[2 * ii + 1]), 0, consumer, (void*)ii);
+        assert(rv == 0);
+    }
+
+    for (long ii = 0; ii < 2 * pairs; ++ii) {
+        rv = pthread_join(threads[ii], 0);
+        assert(rv == 0);
+    }
+
+    double run_ms = now_ms() - start;
+
+    size_t remote = 0;
+    size_t arenas = ctl_get("arenas.count");
+    for (size_t aa = 0; aa < arenas; ++aa) {
+        char name[64];
+        snprintf(name, sizeof(name), "arena.%zu.remote_frees", aa);
+        remote += ctl_get(name);
+    }
+
+    size_t wakeups = ctl_get("background.wakeups");
+    ctl_set("background.enabled", 0);
+
+    printf("transfer: %ld chunks passed, %zu freed remotely, %zu spills, %ld bad\n",
+           pairs * count * BATCH, remote, ctl_get("transfer.spills"), bad);
+    printf("time: %.1f ms, %zu background wakeups\n", run_ms, wakeups);
+
+    xfree(threads);
+    xfree(rings);
+
+    return 0;
+}
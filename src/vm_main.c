@@ -0,0 +1,123 @@
+// Mapping count benchmark for the reserved address range.
+//
+// Allocates TOTAL_MB spread over every bucket size and a medium size,
+// and counts the mappings the process gained. Segments carved from the
+// reserved range merge into few mappings, segments mapped one by one
+// add one mapping each.
+//
+// Then everything is freed and purged, so the 1 MB segments of the
+// buckets go back to the range, where groups of four merge into 4 MB
+// slots. Medium segments allocated after that must reuse them without
+// growing the range.
+//
+// Run it as "reserve" with the range, or as "noreserve" to set
+// vm.reserve to 0 and map every segment on its own.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "xmalloc.h"
+
+#define TOTAL_MB    360
+#define MEDIUM_SIZE (64 * 1024)
+
+static const size_t sizes[] = {
+    16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, MEDIUM_SIZE
+};
+
+size_t
+ctl_get(const char* name)
+{
+    size_t value = 0;
+    size_t len = sizeof(value);
+    xmallctl(name, &value, &len, NULL, 0);
+    return value;
+}
+
+long
+mapping_count()
+{
+    FILE* file = fopen("/proc/self/maps", "r");
+    if (file == NULL) {
+        return 0;
+    }
+
+    long count = 0;
+    int cc;
+    while ((cc = fgetc(file)) != EOF) {
+        count += cc == '\n';
+    }
+    fclose(file);
+    return count;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 2 || (strcmp(argv[1], "reserve") && strcmp(argv[1], "noreserve"))) {
+        printf("Usage:\n");
+        printf("\t%s reserve|noreserve\n", argv[0]);
+        return 1;
+    }
+
+    if (strcmp(argv[1], "noreserve") == 0) {
+        size_t zero = 0;
+        int rv = xmallctl("vm.reserve", NULL, NULL, &zero, sizeof(zero));
+        assert(rv == 0);
+    }
+
+    long size_count = sizeof(sizes) / sizeof(sizes[0]);
+    size_t per_size = ((size_t)TOTAL_MB << 20) / size_count;
+
+    long total = 0;
+    for (long ss = 0; ss < size_count; ++ss) {
+        total += per_size / sizes[ss];
+    }
+
+    void** objs = xmalloc(total * sizeof(void*));
+    long start = mapping_count();
+
+    long kk = 0;
+    for (long ss = 0; ss < size_count; ++ss) {
+        for (size_t ii = 0; ii < per_size / sizes[ss]; ++ii) {
+            objs[kk] = xmalloc(sizes[ss]);
+            memset(objs[kk], 1, 16);
+            kk += 1;
+        }
+    }
+
+    long gained = mapping_count() - start;
+    size_t committed_kb = ctl_get("vm.committed") / 1024;
+
+    for (long ii = 0; ii < total; ++ii) {
+        xfree(objs[ii]);
+    }
+    xmalloc_purge();
+    size_t free_kb = ctl_get("vm.free") / 1024;
+
+    // medium segments only, out of the freed bucket segments
+    long medium = ((size_t)TOTAL_MB << 20) / 2 / MEDIUM_SIZE;
+    for (long ii = 0; ii < medium; ++ii) {
+        objs[ii] = xmalloc(MEDIUM_SIZE);
+        memset(objs[ii], 1, 16);
+    }
+    size_t reused_kb = free_kb - ctl_get("vm.free") / 1024;
+    long regained = mapping_count() - start;
+
+    for (long ii = 0; ii < medium; ++ii) {
+        xfree(objs[ii]);
+    }
+    xfree(objs);
+
+    printf("mappings: %ld new for %d MB, %ld after reuse\n",
+           gained, TOTAL_MB, regained);
+    printf("vm: %zu KB committed, %zu KB free after purge, %zu KB reused\n",
+           committed_kb, free_kb, reused_kb);
+    printf("vm: %zu merges, %zu fallbacks, %zu decommit fails\n",
+           ctl_get("vm.merges"), ctl_get("vm.fallbacks"),
+           ctl_get("vm.decommit_fails"));
+
+    return 0;
+}
@@ -6,5 +6,100 @@
 void* xmalloc(size_t bytes);
 void  xfree(void* ptr);
 void* xrealloc(void* prev, size_t bytes);
+void* xcalloc(size_t count, size_t bytes);
+
+/* Extensions below are provided by the par backend (limalloc) */
+
+/* Region: bump allocation released all at once by reset or destroy */
+typedef struct xregion xregion;
+
+xregion* xregion_create();
+void*    xregion_alloc(xregion* region, size_t bytes);
+void*    xregion_mark(xregion* region);
+void     xregion_reset(xregion* region, void* mark);
+void     xregion_destroy(xregion* region);
+
+/* Cache: fixed size objects of one type, constructed once and reused */
+typedef struct xcache xcache;
+
+xcache*  xcache_create(size_t bytes, size_t align, void (*ctor)(void* obj));
+void*    xcache_alloc(xcache* cache);
+void     xcache_free(xcache* cache, void* ptr);
+void     xcache_destroy(xcache* cache);
+
+/* Deferred free: readers enclose traversals of shared structures in
+   xepoch_enter and xepoch_exit instead of taking locks, writers free the
+   objects they unlink with xfree_deferred. The memory is reused once every
+   traversal that could have seen it is over */
+void     xepoch_enter();
+void     xepoch_exit();
+void     xfree_deferred(void* ptr);
+size_t   xepoch_reclaim();
+
+/* Shared heap: memory mapped by several processes, at a different address
+   in each. Objects inside it must link to each other by offset, converted
+   with xshm_offset and xshm_ptr. A heap without a name is shared by fork
+   or by passing xshm_fd, a named one is opened by name */
+typedef struct xshm xshm;
+
+xshm*    xshm_create(const char* name, size_t bytes);
+xshm*    xshm_open(const char* name);
+xshm*    xshm_attach(int fd);
+void     xshm_detach(xshm* shm);
+int      xshm_unlink(const char* name);
+int      xshm_fd(xshm* shm);
+void*    xshm_alloc(xshm* shm, size_t bytes);
+void     xshm_free(xshm* shm, void* ptr);
+size_t   xshm_offset(xshm* shm, const void* ptr);
+void*    xshm_ptr(xshm* shm, size_t offset);
+void     xshm_set_root(xshm* shm, size_t offset);
+size_t   xshm_root(xshm* shm);
+size_t   xshm_used(xshm* shm);
+
+/* Persistent heap: a shared heap kept in a file across restarts, opened by
+   one process at a time. xshm_detach writes it back and marks it clean.
+   xshm_state tells whether it was created, resumed after a clean detach or
+   recovered after a crash, and whether it moved from its old address */
+#define XSHM_CREATED    1
+#define XSHM_RESUMED    2
+#define XSHM_RECOVERED  3
+#define XSHM_RELOCATED  0x10
+
+xshm*    xshm_persist(const char* path, size_t bytes, void* base);
+int      xshm_sync(xshm* shm);
+int      xshm_state(xshm* shm);
+
+/* Memory pressure: soft limit on mapped bytes and cgroup v2 monitoring */
+typedef void (*xpressure_cb)(size_t mapped, size_t limit, void* arg);
+
+void     xmalloc_set_limit(size_t bytes);
+int      xmalloc_cgroup_monitor(const char* dir);
+int      xmalloc_pressure_register(xpressure_cb cb, void* arg);
+size_t   xmalloc_purge();
+
+/* Allocation flags: lifetime hints keep short and long lived objects in
+   separate segments, so segments of transient objects empty out whole */
+#define XM_SHORT_LIVED  0x1
+#define XM_LONG_LIVED   0x2
+#define XM_ZERO         0x4
+
+void*    xmalloc_flags(size_t bytes, int flags);
+
+/* Prewarm: map prefaulted free chunks of bytes_per_class for every class
+   in "prewarm.classes" and top up the "reserve.bytes" of empty segments,
+   so the first allocations after startup do not fault or call mmap */
+size_t   xmalloc_prewarm(size_t bytes_per_class);
+
+/* Control: read and set named values, such as "stats.allocated" or
+   "arena.0.purge", all values are size_t. Returns 0 or an errno value */
+int      xmallctl(const char* name, void* oldp, size_t* oldlenp,
+                  const void* newp, size_t newlen);
+void     xmallctl_dump(int fd);
+
+/* par backend inlines its allocation fast path into the callers */
+#ifdef XMALLOC_INLINE
+#include "limalloc.h"
+#define xmalloc(bytes) limalloc_inline(bytes)
+#endif
 
 #endif
@@ -4,7 +4,7 @@ use warnings FATAL => 'all';
 use POSIX ":sys_wait_h";
 
 use Time::HiRes qw(time);
-use Test::Simple tests => 13;
+use Test::Simple tests => 37;
 
 sub get_time {
     my $data = `cat time.tmp | grep ^real`;
@@ -53,6 +53,10 @@ ok($hw7_l =~ /at 97: 118 steps/, "list-hw7 100");
 my $hw7_v = run_prog("collatz-ivec-hw7", 100);
 ok($hw7_v =~ /at 97: 118 steps/, "ivec-hw7 100");
 
+my $realloc = run_prog("realloc-hw7", 1000);
+ok($realloc =~ /^realloc: [1-9]\d* grows, [1-9]\d* shrinks, 0 bad$/m,
+   "realloc-hw7 keeps buffer contents when growing and shrinking");
+
 my $par_v = run_prog("collatz-ivec-par", 1000);
 my $t_pv  = get_time();
 my $pv_ok = $par_v =~ /at 871: 178 steps/;
@@ -65,6 +69,180 @@ my $pl_ok = $par_l =~ /at 871: 178 steps/;
 ok($pl_ok, "list-par 1k");
 ok($pl_ok && $t_pl < $t_sl, "list-par beat system time");
 
+my $steal_v = run_prog("collatz-ivec-steal-par", "1000 8");
+ok($steal_v =~ /at 871: 178 steps/, "ivec-steal-par 1k, 8 threads");
+
+my $steal_l = run_prog("collatz-list-steal-par", "1000 8");
+ok($steal_l =~ /at 871: 178 steps/, "list-steal-par 1k, 8 threads");
+
+my $region = run_prog("collatz-list-region-par", 10000);
+ok($region =~ /at 6171: 261 steps/ && $region =~ /, 0 bad$/m,
+   "list-region-par 10k, nested resets and pooled segments");
+
+my $cache = run_prog("cache-par", "1000000 2");
+ok($cache =~ /(\d+) objects passed, (\d+) constructed, 0 bad/ && $2 < $1 / 20,
+   "cache-par frees cross threads through the depot");
+
+my $calloc = run_prog("calloc-par", 256);
+ok($calloc =~ /checked, 0 bad$/m
+   && $calloc =~ /fresh: (\d+) KB taken, (-?\d+) KB resident/ && $2 < $1 / 8,
+   "calloc-par zeroes reused chunks and leaves fresh segments untouched");
+
+my $pressure = run_prog("pressure-par", "");
+ok($pressure =~ /^limit: [1-9]\d* callbacks/m
+   && $pressure =~ /^cgroup: [1-9]\d* callbacks near memory.max, [1-9]\d* on memory.pressure, 0 when calm$/m
+   && $pressure =~ /^pressure: 0 bad$/m,
+   "pressure-par purges and calls back over the limit and under cgroup pressure");
+
+my $extent = run_prog("extent-hw7", "5005 cache");
+ok($extent =~ /^extent: (\d+) hits, (\d+) misses, 0 bad$/m
+   && $1 == 40040 - $2 && $2 <= 8,
+   "extent-hw7 maps each size once and reuses the extents after");
+
+my $extent_par = run_prog("extent-par", "5005 cache 1536");
+ok($extent_par =~ /^extent: (\d+) hits, (\d+) misses, 0 bad$/m
+   && $1 == 15015 - $2 && $2 <= 3,
+   "extent-par gives freed big blocks back to the extent cache");
+
+my $medium = run_prog("medium-par", 2000);
+ok($medium =~ /reallocs, 0 bad$/m
+   && $medium =~ /^mapped: (\d+) KB at peak, live at most (\d+) KB$/m && $1 < $2,
+   "medium-par keeps buffer contents and reuses freed runs");
+
+# lock waits need threads running at the same time, one cpu sees none
+my $cpus = 0 + `nproc`;
+my $contend = run_prog("contend-par", "8 200000 migrate");
+ok($contend =~ /^arenas: 1 -> (\d+), (\d+) migrations, 0 bad$/m
+   && ($cpus < 2 || ($1 > 1 && $2 > 0)),
+   "contend-par moves threads off a contended arena");
+
+my $phase = run_prog("phase-par", "");
+ok($phase =~ /^phases: live (\d+) MB, peak (\d+) KB/m && $2 < 3 * $1 * 1024,
+   "phase-par reuses segments across size classes");
+
+my $frag = run_prog("frag-par", "plain");
+ok($frag =~ /^plain: peak (\d+) KB, after free (\d+) KB/m && $2 < $1 / 2,
+   "frag-par plain releases the segments emptied by transient objects");
+
+my $background = run_prog("background-par", 100000);
+ok($background =~ /^remote: (\d+) of (\d+) objects freed remotely/m && $1 == $2
+   && $background =~ /^background: [1-9]\d* wakeups, .*, 0 bad$/m,
+   "background-par returns remote frees and purges idle arenas");
+
+my $transfer = run_prog("transfer-par", "2000 4 background");
+ok($transfer =~ /^transfer: (\d+) chunks passed, (\d+) freed remotely, \d+ spills, 0 bad$/m
+   && $2 < $1 / 10 && $transfer =~ /, [1-9]\d* background wakeups$/m,
+   "transfer-par passes freed chunks in batches while the background thread refills");
+
+my $vm = run_prog("vm-par", "reserve");
+ok($vm =~ /^mappings: (\d+) new for/m && $1 < 40
+   && $vm =~ /free after purge, [1-9]\d* KB reused$/m
+   && $vm =~ /^vm: [1-9]\d* merges, 0 fallbacks, 0 decommit fails$/m,
+   "vm-par carves segments from the range and merges freed ones");
+
+my $shm = run_prog("shm-par", "1000 4");
+ok($shm =~ /at 871: 178 steps/ && $shm =~ /^ok: 0 bad, 0 bytes used/m,
+   "shm-par 1k, 4 processes");
+
+system("rm -f heap.tmp");
+run_prog("persist-par", "heap.tmp 10000 crash");
+my $heap = run_prog("persist-par", "heap.tmp 10000");
+system("rm -f heap.tmp");
+ok($heap =~ /at 6171: 261 steps/ && $heap =~ /^recovered\S*: 10000 entries/m,
+   "persist-par recovers 10k entries");
+
+system("rm -f heap.tmp");
+run_prog("persist-par", "heap.tmp 100000 kill");
+$heap = run_prog("persist-par", "heap.tmp 100000");
+system("rm -f heap.tmp");
+ok($heap =~ /^recovered\S*: 100000 entries/m,
+   "persist-par recovers a heap killed while 4 threads allocate");
+
+system("rm -f heap.tmp");
+run_prog("persist-par", "heap.tmp 10000 noinit");
+$heap = run_prog("persist-par", "heap.tmp 10000");
+system("rm -f heap.tmp");
+ok($heap =~ /^built\S*: 10000 entries/m,
+   "persist-par builds a heap whose creator died before its header");
+
+my $epoch = run_prog("epoch-par", "epoch 4");
+ok($epoch =~ /, 0 bad, 0 pending/, "epoch-par lock-free readers, 4 threads");
+
+# sample a histogram, derive a table from it and load that table
+system("rm -f hist.tmp classes.tmp");
+my $classes;
+{
+    local $ENV{LIMALLOC_CONF} = "hist.sample:16";
+    local $ENV{LIMALLOC_HIST} = "hist.tmp";
+    $classes = run_prog("classes-par", "1000000");
+}
+system("./classgen -k 10 hist.tmp > classes.tmp 2> /dev/null");
+my $tuned;
+{
+    local $ENV{LIMALLOC_CLASSES} = "classes.tmp";
+    $tuned = run_prog("classes-par", "1000000");
+}
+system("rm -f hist.tmp classes.tmp");
+my ($default_kb) = $classes =~ /(\d+) KB resident, 0 bad$/m;
+my ($tuned_kb) = $tuned =~ /(\d+) KB resident, 0 bad$/m;
+ok(defined($default_kb) && defined($tuned_kb) && $tuned_kb < $default_kb * 0.85
+   && $classes =~ /^classes: powers of two$/m && $tuned =~ /^classes: loaded table$/m,
+   "classes-par 1M spiky objects take less memory with the classgen table");
+
+sub write_file {
+    my ($file, $text) = @_;
+    open(my $fh, ">", $file) or die "$file: $!";
+    print $fh $text;
+    close($fh);
+}
+
+# not ending at 8192, not a multiple of 16, not increasing, not a number,
+# more classes than buckets, empty
+my @bad_tables = ("32 48 80\n", "32 40 8192\n", "48 32 8192\n",
+                  "32 4x8 8192\n", join(" ", (map { 16 * $_ } 1..10), 8192) . "\n", "");
+my $rejected = 0;
+for my $table (@bad_tables) {
+    write_file("classes.tmp", $table);
+    local $ENV{LIMALLOC_CLASSES} = "classes.tmp";
+    my $outp = run_prog("classes-par", "1000");
+    $rejected += $outp =~ /, 0 bad$/m && $outp =~ /^classes: powers of two$/m;
+}
+system("rm -f classes.tmp");
+ok($rejected == @bad_tables, "classes-par keeps the powers of two for bad tables");
+
+# counters may be refused, then their columns are empty but the row keeps
+# its shape, per op columns are only filled with an op count
+sub perf_row_ok {
+    my ($row, $cols, $ops) = @_;
+    my @fields = split(/,/, $row, -1);
+    return 0 unless @fields == $cols && $fields[0] eq "./collatz-list-par"
+        && $fields[1] eq "1000" && $fields[2] == $ops
+        && $fields[3] =~ /^\d+\.\d{3}$/ && $fields[4] eq "0";
+    for (my $ii = 5; $ii < @fields; $ii += 2) {
+        my ($total, $per_op) = @fields[$ii, $ii + 1];
+        return 0 unless $total =~ /^\d*$/;
+        return 0 unless ($ops > 0 && $total ne "") ? $per_op =~ /^\d+\.\d\d$/
+                                                    : $per_op eq "";
+    }
+    return 1;
+}
+
+system("rm -f perf.tmp");
+my $perf = run_prog("perfrun", "-o perf.tmp -n 1000 ./collatz-list-par 1000");
+$perf .= run_prog("perfrun", "-o perf.tmp ./collatz-list-par 1000");
+my @perf_rows = split(/\n/, `cat perf.tmp`);
+system("rm -f perf.tmp");
+my @header = split(/,/, $perf_rows[0] // "", -1);
+my $names_ok = @header > 5 && @header % 2 == 1;
+for (my $ii = 5; $names_ok && $ii < @header; $ii += 2) {
+    $names_ok = $header[$ii + 1] eq "$header[$ii]_per_op";
+}
+ok($perf =~ /at 871: 178 steps.*at 871: 178 steps/s && @perf_rows == 3
+   && join(",", @header[0..4]) eq "prog,args,ops,wall_s,exit" && $names_ok
+   && perf_row_ok($perf_rows[1], scalar(@header), 1000)
+   && perf_row_ok($perf_rows[2], scalar(@header), 0),
+   "perfrun writes one CSV row per run, per op columns only with -n");
+
 sub clang_check {
     my $errs = `clang-check *.c -- 2>&1`;
     chomp $errs;